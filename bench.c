@@ -0,0 +1,259 @@
+// SPDX-License-Identifier: MIT
+//
+// Replay benchmark
+// ----------------
+//
+// Replays a trace recorded with consistent_hasher_trace_start at
+// full speed and reports the time spent per operation.
+//
+// Usage:
+//
+//   ./bench <trace> [repeat]
+//   ./bench -g <trace> [nodes] [lookups]
+//   ./bench -w [points] [changes]
+//
+// The second form writes a synthetic trace with uniform keys, which
+// is only useful to try the benchmark out. The third one times each
+// insertion and deletion on its own in a ring of [points] points, and
+// reports the slowest one next to the average.
+//
+
+#define _POSIX_C_SOURCE 199309L
+
+#define CONSISTENT_HASHER_TRACE
+#define CONSISTENT_HASHER_IMPLEMENTATION
+#include "consistent-hasher.h"
+
+#include <limits.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+
+#define GENERATE_RING_SIZE 1000003
+
+double now_ns(void)
+{
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec * 1e9 + ts.tv_nsec;
+}
+
+int generate(const char *path, int nodes, long lookups)
+{
+  FILE *file = fopen(path, "wb");
+  if (!file)
+  {
+    perror(path);
+    return 1;
+  }
+
+  ConsistentHasher ch;
+  ConsistentHasherTrace trace;
+  consistent_hasher_init(&ch, GENERATE_RING_SIZE);
+  if (consistent_hasher_trace_start(&ch, &trace, file, 1)
+      != CONSISTENT_HASHER_OK)
+  {
+    fprintf(stderr, "Error writing %s\n", path);
+    return 1;
+  }
+
+  srand(42);
+  for (int i = 0; i < nodes; ++i)
+    consistent_hasher_insert_node(&ch, (ConsistentHasherHash) rand());
+  for (long i = 0; i < lookups; ++i)
+    consistent_hasher_get_node_of(&ch, (ConsistentHasherHash) rand());
+
+  ConsistentHasherError err = consistent_hasher_trace_stop(&ch);
+  consistent_hasher_destroy(&ch);
+  fclose(file);
+  if (err != CONSISTENT_HASHER_OK)
+  {
+    fprintf(stderr, "Error writing %s\n", path);
+    return 1;
+  }
+
+  return 0;
+}
+
+int replay(const char *path, int repeat)
+{
+  FILE *file = fopen(path, "rb");
+  if (!file)
+  {
+    perror(path);
+    return 1;
+  }
+
+  ConsistentHasherTraceHeader header;
+  ConsistentHasherError err = consistent_hasher_trace_read_header(file, &header);
+  if (err == CONSISTENT_HASHER_ERROR_INVALID)
+  {
+    fprintf(stderr, "%s: recorded with a %u byte hash, expected %u\n",
+            path, header.hash_size,
+            (unsigned int) sizeof(ConsistentHasherHash));
+    fclose(file);
+    return 1;
+  }
+  if (err != CONSISTENT_HASHER_OK)
+  {
+    fprintf(stderr, "%s: not a trace file\n", path);
+    fclose(file);
+    return 1;
+  }
+
+  // Load the whole trace so that I/O is not measured
+  long len = 0, capacity = 1024;
+  ConsistentHasherTraceRecord *records =
+    malloc(capacity * sizeof(ConsistentHasherTraceRecord));
+  while (records && consistent_hasher_trace_read(file, &records[len]))
+  {
+    if (++len < capacity) continue;
+    capacity *= 2;
+    records = realloc(records, capacity * sizeof(ConsistentHasherTraceRecord));
+  }
+  fclose(file);
+  if (!records)
+  {
+    fprintf(stderr, "Out of memory\n");
+    return 1;
+  }
+
+  long counts[3] = {0};
+  double times[3] = {0};
+  ConsistentHasherHash sink = 0;
+
+  for (int r = 0; r < repeat; ++r)
+  {
+    ConsistentHasher ch;
+    consistent_hasher_init(&ch, (unsigned int) header.ring_size);
+
+    // Time runs of the same operation together, so that the clock is
+    // not read around every single lookup
+    long i = 0;
+    while (i < len)
+    {
+      uint32_t op = records[i].op;
+      long j = i;
+      double start = now_ns();
+      switch (op)
+      {
+      case CONSISTENT_HASHER_TRACE_LOOKUP:
+        for (; j < len && records[j].op == op; ++j)
+        {
+          if (ch.nodes_len == 0) continue;
+          sink ^= consistent_hasher_get_node_of(&ch,
+                    (ConsistentHasherHash) records[j].hash);
+        }
+        break;
+      case CONSISTENT_HASHER_TRACE_INSERT:
+        for (; j < len && records[j].op == op; ++j)
+          consistent_hasher_insert_point(&ch,
+            (ConsistentHasherHash) records[j].owner,
+            (ConsistentHasherHash) records[j].hash);
+        break;
+      case CONSISTENT_HASHER_TRACE_DELETE:
+        for (; j < len && records[j].op == op; ++j)
+          consistent_hasher_delete_node(&ch,
+            (ConsistentHasherHash) records[j].hash);
+        break;
+      default:
+        fprintf(stderr, "%s: unknown operation %u\n", path, op);
+        free(records);
+        consistent_hasher_destroy(&ch);
+        return 1;
+      }
+      times[op] += now_ns() - start;
+      counts[op] += j - i;
+      i = j;
+    }
+
+    consistent_hasher_destroy(&ch);
+  }
+
+  const char *names[3] = { "lookup", "insert", "delete" };
+  printf("%s: %ld records, ring size %lu, %d runs\n", path, len,
+         (unsigned long) header.ring_size, repeat);
+  for (int op = 0; op < 3; ++op)
+  {
+    if (counts[op] == 0) continue;
+    printf("  %-6s %12ld ops %10.2f ns/op\n", names[op], counts[op],
+           times[op] / counts[op]);
+  }
+  printf("  (checksum %lu)\n", (unsigned long) sink);
+
+  free(records);
+  return 0;
+}
+
+int worst(int points, int changes)
+{
+  // Points in key order are appended to both arrays, so that setting
+  // up a big ring is quick
+  ConsistentHasher ch;
+  consistent_hasher_init(&ch, 0);
+  unsigned int gap = UINT_MAX / (unsigned int) points;
+  for (int i = 0; i < points; ++i)
+    consistent_hasher_insert_point(&ch, (ConsistentHasherHash) i / (points / 64 + 1),
+                                   (ConsistentHasherHash) i * gap);
+  double start = now_ns();
+  consistent_hasher_rebuild(&ch, NULL);
+  double rebuild = now_ns() - start;
+
+  // Insert then delete random points, each timed on its own
+  double total[2] = {0}, slowest[2] = {0};
+  for (int op = 0; op < 2; ++op)
+  {
+    for (int i = 0; i < changes; ++i)
+    {
+      ConsistentHasherHash hash = consistent_hasher_point_hash(i, 1);
+      start = now_ns();
+      if (op == 0)
+        consistent_hasher_insert_point(&ch, i % 64, hash);
+      else
+        consistent_hasher_delete_node(&ch, hash);
+      double time = now_ns() - start;
+      total[op] += time;
+      if (time > slowest[op]) slowest[op] = time;
+    }
+  }
+
+  printf("%d points, %d changes, layout %d\n", points, changes,
+         (int) consistent_hasher_get_layout(&ch));
+  printf("  insert %10.2f ns/op %12.2f ns max\n",
+         total[0] / changes, slowest[0]);
+  printf("  delete %10.2f ns/op %12.2f ns max\n",
+         total[1] / changes, slowest[1]);
+  printf("  rebuild %21.2f ns\n", rebuild);
+
+  consistent_hasher_destroy(&ch);
+  return 0;
+}
+
+int main(int argc, char **argv)
+{
+  if (argc >= 3 && argv[1][0] == '-' && argv[1][1] == 'g')
+  {
+    int nodes = (argc > 3) ? atoi(argv[3]) : 1000;
+    long lookups = (argc > 4) ? atol(argv[4]) : 10000000;
+    return generate(argv[2], nodes, lookups);
+  }
+  if (argc >= 2 && argv[1][0] == '-' && argv[1][1] == 'w')
+  {
+    int points = (argc > 2) ? atoi(argv[2]) : 500000;
+    int changes = (argc > 3) ? atoi(argv[3]) : 100000;
+    return worst(points, (changes > 0) ? changes : 1);
+  }
+
+  if (argc < 2 || argv[1][0] == '-')
+  {
+    fprintf(stderr,
+            "Usage: %s <trace> [repeat]\n"
+            "       %s -g <trace> [nodes] [lookups]\n"
+            "       %s -w [points] [changes]\n",
+            argv[0], argv[0], argv[0]);
+    return 1;
+  }
+
+  int repeat = (argc > 2) ? atoi(argv[2]) : 1;
+  return replay(argv[1], (repeat > 0) ? repeat : 1);
+}
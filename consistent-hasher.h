@@ -111,11 +111,63 @@ extern "C" {
   #define CONSISTENT_HASHER_FREE free
 #endif
 
+// Config: maximum number of points searched with a linear scan by
+// CONSISTENT_HASHER_LAYOUT_AUTO
+#ifndef CONSISTENT_HASHER_LINEAR_MAX
+  #define CONSISTENT_HASHER_LINEAR_MAX 64
+#endif
+
+// Config: minimum number of points searched with an Eytzinger
+// layout by CONSISTENT_HASHER_LAYOUT_AUTO
+#ifndef CONSISTENT_HASHER_EYTZINGER_MIN
+  #define CONSISTENT_HASHER_EYTZINGER_MIN 8192
+#endif
+
+// Config: minimum capacity from which the array is grown and shrunk
+// a few entries per change, instead of copied at once, and the
+// Eytzinger copy is left stale, see consistent_hasher_set_layout
+// Note: each change still shifts the points after it, in O(n)
+#ifndef CONSISTENT_HASHER_INCREMENTAL_MIN
+  #define CONSISTENT_HASHER_INCREMENTAL_MIN 4096
+#endif
+
+// Config: let other threads run, called when spinning on a lock for
+// a while
+#ifndef CONSISTENT_HASHER_YIELD
+  #if defined(__unix__) || defined(__APPLE__)
+    #include <sched.h>
+    #define CONSISTENT_HASHER_YIELD() sched_yield()
+  #else
+    #define CONSISTENT_HASHER_YIELD()
+  #endif
+#endif
+
+// Config: number of lookups in flight in a
+// ConsistentHasherScheduler
+#ifndef CONSISTENT_HASHER_SCHEDULER_SLOTS
+  #define CONSISTENT_HASHER_SCHEDULER_SLOTS 16
+#endif
+
+// Config: record lookups and membership changes in a trace file,
+// see consistent_hasher_trace_start
+// Note: disabled by default
+//#define CONSISTENT_HASHER_TRACE
+#ifdef CONSISTENT_HASHER_TRACE
+  #include <stdio.h>
+#endif
+
 //
 // Types
 //
 
+#include <float.h>
+#include <limits.h>
 #include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#if defined(__SSE2__) && defined(__GNUC__)
+  #include <emmintrin.h>
+#endif
 
 typedef CONSISTENT_HASHER_HASH ConsistentHasherHash;
 
@@ -125,6 +177,10 @@ typedef enum {
   CONSISTENT_HASHER_ERROR_IS_NULL,
   CONSISTENT_HASHER_ERROR_ALLOCATION,
   CONSISTENT_HASHER_ERROR_NODE_PRESENT,
+  CONSISTENT_HASHER_ERROR_FULL,
+  CONSISTENT_HASHER_ERROR_IO,
+  CONSISTENT_HASHER_ERROR_INVALID,
+  CONSISTENT_HASHER_ERROR_EMPTY,
   _CONSISTENT_HASHER_ERROR_MAX,
 } ConsistentHasherError;
 
@@ -134,231 +190,5645 @@ typedef struct {
   ConsistentHasherHash hash;
   // Position in the ring buffer
   unsigned int position;
+  // The hash of the node owning this point, equal to [hash] unless
+  // inserted with consistent_hasher_insert_point
+  ConsistentHasherHash owner;
 } ConsistentHasherNode;
 
+#ifdef CONSISTENT_HASHER_TRACE
+
+#define CONSISTENT_HASHER_TRACE_MAGIC "CHTRACE"
+#define CONSISTENT_HASHER_TRACE_VERSION 2
+
+// Operations recorded in a trace
+typedef enum {
+  CONSISTENT_HASHER_TRACE_LOOKUP = 0,
+  CONSISTENT_HASHER_TRACE_INSERT,
+  CONSISTENT_HASHER_TRACE_DELETE,
+} ConsistentHasherTraceOp;
+
+// Header at the beginning of a trace file
+//
+// Note: traces are written in the native byte order
+typedef struct {
+  // CONSISTENT_HASHER_TRACE_MAGIC
+  char magic[8];
+  // CONSISTENT_HASHER_TRACE_VERSION
+  uint32_t version;
+  // sizeof(ConsistentHasherHash) of the recording process
+  uint32_t hash_size;
+  // Size of the ring buffer of the recorded hasher
+  uint64_t ring_size;
+} ConsistentHasherTraceHeader;
+
+// A recorded operation
+typedef struct {
+  // A ConsistentHasherTraceOp
+  uint32_t op;
+  uint32_t reserved;
+  // Item hash for lookups, node hash for insertions and deletions
+  uint64_t hash;
+  // Hash of the node owning the inserted point
+  uint64_t owner;
+} ConsistentHasherTraceRecord;
+
+// A trace recorder
+typedef struct {
+  FILE *file;
+  // Record one lookup every [sample_every]
+  unsigned int sample_every;
+  // Lookups seen, counted atomically as they may run in parallel
+  unsigned int counter;
+} ConsistentHasherTrace;
+
+#endif // CONSISTENT_HASHER_TRACE
+
+// Initial SipHash state derived from a secret seed, see
+// consistent_hasher_set_seed
+typedef struct {
+  uint64_t v0, v1, v2, v3;
+} ConsistentHasherKey;
+
+// Lookup layouts, see consistent_hasher_set_layout
+typedef enum {
+  // Pick one of the following from the number of points
+  CONSISTENT_HASHER_LAYOUT_AUTO = 0,
+  // Binary search with early exit
+  CONSISTENT_HASHER_LAYOUT_BINARY,
+  // Branch-free count of the smaller positions, for few points
+  CONSISTENT_HASHER_LAYOUT_LINEAR,
+  // Binary search without branches, for mid-sized rings
+  CONSISTENT_HASHER_LAYOUT_BRANCHLESS,
+  // Search a copy of the positions in Eytzinger (BFS) order, for
+  // rings much bigger than the cache
+  CONSISTENT_HASHER_LAYOUT_EYTZINGER,
+  _CONSISTENT_HASHER_LAYOUT_MAX,
+} ConsistentHasherLayout;
+
+// See the Overrides section below
+struct ConsistentHasherOverrides;
+// See the Watches section below
+struct ConsistentHasherWatcher;
+struct ConsistentHasherArcChange;
+
 // The ConsistentHasher
 typedef struct {
-  // Size of the ring buffer
+  // Size of the ring buffer, or 0 for ordered ranges
   unsigned int ring_size;
   // Dynamic sorted array of nodes
   ConsistentHasherNode *nodes;
+  // Reverse index: the same nodes sorted by owner, then by position
+  ConsistentHasherNode *points;
   // Number of nodes present in the array
   int nodes_len;
   // Allocated memory in the dynamic array
   int nodes_capacity;
+  // True if [nodes] is a caller-provided buffer, see
+  // consistent_hasher_init_static
+  bool is_static;
+  // Array being filled while growing or shrinking incrementally, or
+  // NULL. [nodes] and [points] stay the ones searched until it is
+  // complete.
+  ConsistentHasherNode *next_nodes;
+  // Reverse index in the same allocation as [next_nodes]
+  ConsistentHasherNode *next_points;
+  // Capacity of [next_nodes]
+  int next_capacity;
+  // Number of entries of [nodes] and [points] already in the next
+  // arrays
+  int migrated_nodes;
+  int migrated_points;
+  // Layout requested with consistent_hasher_set_layout
+  ConsistentHasherLayout layout;
+  // Layout used by lookups, never CONSISTENT_HASHER_LAYOUT_AUTO
+  ConsistentHasherLayout active_layout;
+  // Bytes [ch] may allocate, or 0 for no limit, see
+  // consistent_hasher_init_budget
+  size_t memory_budget;
+  // Positions in Eytzinger order, starting at index 1
+  unsigned int *eytzinger;
+  // Owners of the points in [eytzinger], index 0 holds the owner of
+  // the first point, where lookups past the last one wrap to
+  ConsistentHasherHash *eytzinger_owners;
+  // Allocated memory in [eytzinger] and [eytzinger_owners]
+  int eytzinger_capacity;
+  // Number of points in [eytzinger], behind [nodes_len] while a
+  // background rebuild is pending
+  int eytzinger_len;
+  // Buffers the next Eytzinger copy is built into, owned by
+  // consistent_hasher_rebuild
+  unsigned int *spare_eytzinger;
+  ConsistentHasherHash *spare_eytzinger_owners;
+  int spare_capacity;
+  // See consistent_hasher_set_background_rebuild
+  bool background_rebuild;
+  // Bumped by each membership change that leaves the Eytzinger copy
+  // stale
+  unsigned int generation;
+  // Generation of the points in [eytzinger]
+  unsigned int built_generation;
+  // Seed of consistent_hasher_hash_key
+  ConsistentHasherKey key;
+  // Checked before the ring if not NULL, see consistent_hasher_set_overrides
+  struct ConsistentHasherOverrides *overrides;
+  // Registered with consistent_hasher_watch, or NULL
+  struct ConsistentHasherWatcher *watchers;
+  // Arcs changed by the current membership change, for [watchers]
+  struct ConsistentHasherArcChange *changes;
+  int changes_len;
+  int changes_capacity;
+  // True if some of the changes did not fit in [changes]
+  bool changes_lost;
+#ifdef CONSISTENT_HASHER_TRACE
+  // Active recorder, or NULL
+  ConsistentHasherTrace *trace;
+#endif
 } ConsistentHasher;
 
-//
-// Function Declarations
-//
+//
+// Function Declarations
+//
+
+// Initialize [ch] with [ring_size] slots
+//
+// A [ring_size] of 0 keeps points and items in key order instead of
+// scattering them, see the Ranges section below.
+//
+// Notes: Remember to destroy [ch] when you are done.
+void consistent_hasher_init(ConsistentHasher *ch,
+                            unsigned int ring_size);
+
+// Initialize [ch] with [ring_size] slots, storing at most
+// [capacity] nodes in the caller-provided [buffer], and the index of
+// their points by node in [points]
+//
+// Notes: [buffer] and [points] must each hold [capacity] nodes and
+// outlive [ch]. [ch] never calls CONSISTENT_HASHER_CALLOC nor
+// CONSISTENT_HASHER_FREE, inserting in a full [ch] fails with
+// CONSISTENT_HASHER_ERROR_FULL instead.
+void consistent_hasher_init_static(ConsistentHasher *ch,
+                                   unsigned int ring_size,
+                                   ConsistentHasherNode *buffer,
+                                   ConsistentHasherNode *points,
+                                   int capacity);
+
+// Initialize [ch] with [ring_size] slots, keeping the memory it
+// allocates within [budget] bytes
+//
+// The Eytzinger layout is only used while its copy of the points
+// fits along the arrays, otherwise lookups fall back to branchless
+// binary search. Growing the arrays beyond the budget fails with
+// CONSISTENT_HASHER_ERROR_FULL, see consistent_hasher_budget_points.
+//
+// Notes: Remember to destroy [ch] when you are done. The old and new
+// arrays are both allocated for the time of a resize.
+void consistent_hasher_init_budget(ConsistentHasher *ch,
+                                   unsigned int ring_size,
+                                   size_t budget);
+
+// Free allocated memory in [ch]
+void consistent_hasher_destroy(ConsistentHasher *ch);
+
+// Insert a node with [node_hash] in [ch]
+//
+// Returns: CONSISTENT_HASHER_OK on success, or an error otherwise
+// Note: Fails if trying to insert a [node_hash] that is already
+// present
+ConsistentHasherError
+consistent_hasher_insert_node(ConsistentHasher *ch,
+                              ConsistentHasherHash node_hash);
+
+// Insert a point with [point_hash] in [ch], owned by the node with
+// [node_hash]
+//
+// Use this to add virtual nodes: items landing on the point are
+// assigned to [node_hash].
+//
+// Returns: CONSISTENT_HASHER_OK on success, or an error otherwise
+// Note: Fails if trying to insert a [point_hash] that is already
+// present
+ConsistentHasherError
+consistent_hasher_insert_point(ConsistentHasher *ch,
+                               ConsistentHasherHash node_hash,
+                               ConsistentHasherHash point_hash);
+
+// Remove node with [node_hash] in [ch]
+//
+// Returns: CONSISTENT_HASHER_OK on success, or an error otherwise
+// Note: this removes a single point, whatever its owner
+ConsistentHasherError
+consistent_hasher_delete_node(ConsistentHasher *ch,
+                              ConsistentHasherHash node_hash);
+
+// Remove all the points owned by [node_hash] in [ch]
+//
+// Both arrays are compacted in a single pass, so this is O(n)
+// whatever the number of points removed.
+//
+// Returns: CONSISTENT_HASHER_OK on success, or an error otherwise
+ConsistentHasherError
+consistent_hasher_delete_points_of(ConsistentHasher *ch,
+                                   ConsistentHasherHash node_hash);
+
+// Get the points owned by [node_hash] in [ch], sorted by position
+//
+// Returns: the points and sets [len] to their number, or NULL if
+// there are none
+// Note: the points are valid until the next change to [ch]
+const ConsistentHasherNode *
+consistent_hasher_points_of(ConsistentHasher *ch,
+                            ConsistentHasherHash node_hash,
+                            int *len);
+
+// Make [node_hash] own [weight] points in [ch]
+//
+// Points are added or removed from the sequence given by
+// consistent_hasher_point_hash, so that only the arcs of the added or
+// removed points change owner. Points inserted otherwise are removed
+// first. Removing is a single pass over the arrays, like
+// consistent_hasher_delete_points_of, while each added point is
+// inserted on its own.
+//
+// Returns: CONSISTENT_HASHER_OK on success, or an error otherwise
+ConsistentHasherError
+consistent_hasher_set_node_weight(ConsistentHasher *ch,
+                                  ConsistentHasherHash node_hash,
+                                  int weight);
+
+// Get the hash of the [i]-th point of [node_hash], as inserted by
+// consistent_hasher_set_node_weight
+ConsistentHasherHash consistent_hasher_point_hash(ConsistentHasherHash node_hash,
+                                                  unsigned int i);
+
+// Get the number of ring positions assigned to [node_hash] in [ch],
+// that is the sum of the arcs ending at each of its points
+unsigned int consistent_hasher_node_load(ConsistentHasher *ch,
+                                         ConsistentHasherHash node_hash);
+
+// Set the lookup layout of [ch]
+//
+// With CONSISTENT_HASHER_LAYOUT_AUTO (the default), the layout is
+// chosen again after each membership change: linear scan up to
+// CONSISTENT_HASHER_LINEAR_MAX points, Eytzinger from
+// CONSISTENT_HASHER_EYTZINGER_MIN points, and branchless binary
+// search in between.
+//
+// Filling the Eytzinger copy is O(n). From a capacity of
+// CONSISTENT_HASHER_INCREMENTAL_MIN, membership changes only mark it
+// stale and lookups use the branchless search until
+// consistent_hasher_rebuild, or this function, fills it again.
+//
+// Returns: CONSISTENT_HASHER_OK on success, or an error otherwise
+// Note: static hashers use CONSISTENT_HASHER_LAYOUT_BRANCHLESS
+// instead of CONSISTENT_HASHER_LAYOUT_EYTZINGER, which allocates
+ConsistentHasherError
+consistent_hasher_set_layout(ConsistentHasher *ch,
+                             ConsistentHasherLayout layout);
+
+// Get the layout currently used by lookups in [ch]
+ConsistentHasherLayout consistent_hasher_get_layout(ConsistentHasher *ch);
+
+// Get the number of bytes allocated by [ch]
+//
+// Note: the buffer of a static hasher and the overrides are owned by
+// the caller, and not counted
+size_t consistent_hasher_footprint(const ConsistentHasher *ch);
+
+// Get the number of points a hasher initialized with
+// consistent_hasher_init_budget can hold within [budget] bytes while
+// using [layout]
+int consistent_hasher_budget_points(size_t budget,
+                                    ConsistentHasherLayout layout);
+
+// Get the hash of the node corresponding to [item_hash] in [ch]
+//
+// Returns: the owner of the first point at or after [item_hash]
+// Note: [ch] must contain at least one node
+ConsistentHasherHash
+consistent_hasher_get_node_of(ConsistentHasher *ch,
+                              ConsistentHasherHash item_hash);
+
+#ifdef CONSISTENT_HASHER_TRACE
+
+// Start recording the operations on [ch] in [file] using [trace]
+//
+// Every insertion and deletion is recorded, while only one lookup
+// every [sample_every] is. The trace begins with an insertion for
+// each node already in [ch], so that it can be replayed from an
+// empty hasher. Lookups may still run in parallel while recording.
+//
+// Returns: CONSISTENT_HASHER_OK on success, or an error otherwise
+// Notes: [trace] and [file] must outlive the recording. Stop it with
+// consistent_hasher_trace_stop.
+ConsistentHasherError
+consistent_hasher_trace_start(ConsistentHasher *ch,
+                              ConsistentHasherTrace *trace,
+                              FILE *file,
+                              unsigned int sample_every);
+
+// Stop recording the operations on [ch] and flush the trace file
+//
+// Returns: CONSISTENT_HASHER_OK on success, or an error otherwise
+ConsistentHasherError
+consistent_hasher_trace_stop(ConsistentHasher *ch);
+
+// Read and validate the header of a trace from [file] into [header]
+//
+// Returns: CONSISTENT_HASHER_OK on success,
+// CONSISTENT_HASHER_ERROR_INVALID if the trace was recorded with
+// another ConsistentHasherHash size, or an error otherwise
+ConsistentHasherError
+consistent_hasher_trace_read_header(FILE *file,
+                                    ConsistentHasherTraceHeader *header);
+
+// Read the next record of a trace from [file] into [record]
+//
+// Returns: true on success, false at the end of the trace
+bool consistent_hasher_trace_read(FILE *file,
+                                  ConsistentHasherTraceRecord *record);
+
+#endif // CONSISTENT_HASHER_TRACE
+
+//
+// Keyed hashing
+//
+// Item positions are a public function of the item hash, so anyone
+// knowing the ring can craft keys that all land on the same node.
+// Hashing the keys with SipHash-2-4 and a secret seed makes the
+// positions unpredictable.
+//
+
+// Set the secret seed used by consistent_hasher_hash_key in [ch]
+//
+// Note: the seed is zero after consistent_hasher_init, which keeps
+// the positions deterministic but not secret
+void consistent_hasher_set_seed(ConsistentHasher *ch,
+                                uint64_t k0,
+                                uint64_t k1);
+
+// Compute the SipHash-2-4 of [len] bytes at [data] keyed with [key]
+uint64_t consistent_hasher_siphash(const ConsistentHasherKey *key,
+                                   const void *data,
+                                   size_t len);
+
+// Compute the SipHash-2-4 of the 8 little-endian bytes of [value]
+// keyed with [key]
+//
+// Note: same as consistent_hasher_siphash, without the byte loads
+uint64_t consistent_hasher_siphash_u64(const ConsistentHasherKey *key,
+                                       uint64_t value);
+
+// Compute consistent_hasher_siphash_u64 of the [n] [values] into
+// [out], interleaving four of them at a time
+void consistent_hasher_siphash_u64_batch(const ConsistentHasherKey *key,
+                                         const uint64_t *values,
+                                         int n,
+                                         uint64_t *out);
+
+// Hash the [len] bytes of [key] with the seed of [ch]
+ConsistentHasherHash consistent_hasher_hash_key(ConsistentHasher *ch,
+                                                const void *key,
+                                                size_t len);
+
+// Hash the [n] [keys] of [lens] bytes with the seed of [ch] into
+// [out]
+void consistent_hasher_hash_keys(ConsistentHasher *ch,
+                                 const void *const *keys,
+                                 const size_t *lens,
+                                 int n,
+                                 ConsistentHasherHash *out);
+
+// Get the hash of the node corresponding to the [len] bytes of [key]
+// in [ch], hashed with the seed of [ch]
+//
+// Note: [ch] must contain at least one node
+ConsistentHasherHash
+consistent_hasher_get_node_of_key(ConsistentHasher *ch,
+                                  const void *key,
+                                  size_t len);
+
+// Find the hash tag of the [len] bytes of [key]
+//
+// Like in Redis Cluster, the tag is what lies between the first '{'
+// and the first '}' after it, so "{user1}.name" and "{user1}.email"
+// share the tag "user1". Keys without a non-empty tag are their own
+// tag.
+//
+// Returns: the start of the tag and sets [tag_len] to its length
+const void *consistent_hasher_hash_tag(const void *key,
+                                       size_t len,
+                                       size_t *tag_len);
+
+// Hash the hash tag of the [len] bytes of [key] with the seed of [ch]
+//
+// Keys with the same tag get the same hash, and so the same node.
+ConsistentHasherHash consistent_hasher_hash_tagged_key(ConsistentHasher *ch,
+                                                       const void *key,
+                                                       size_t len);
+
+// Get the hash of the node corresponding to the hash tag of the
+// [len] bytes of [key] in [ch]
+//
+// Note: [ch] must contain at least one node
+ConsistentHasherHash
+consistent_hasher_get_node_of_tagged_key(ConsistentHasher *ch,
+                                         const void *key,
+                                         size_t len);
+
+//
+// Concurrency
+//
+// The hasher itself is not thread-safe: lookups only read it, so
+// they may run in parallel, but membership changes must be exclusive.
+// The components below are built on the GCC __atomic builtins.
+//
+
+// Spinning reader-writer lock, to share a hasher between threads
+typedef struct {
+  // Number of readers holding the lock
+  unsigned int readers;
+  // 1 while a writer holds or waits for the lock
+  unsigned int writer;
+} ConsistentHasherRwLock;
+
+// Bounded multi-producer single-consumer queue of pointers
+typedef struct {
+  // Sequence number of each slot, tells producers and the consumer
+  // whose turn it is
+  size_t *sequences;
+  void **items;
+  // Capacity - 1, the capacity is a power of two
+  size_t mask;
+  // Keep the producers and the consumer on different cache lines
+  char _pad0[64];
+  // Next slot to write, shared by the producers
+  size_t head;
+  char _pad1[64];
+  // Next slot to read, owned by the consumer
+  size_t tail;
+  char _pad2[64];
+} ConsistentHasherQueue;
+
+// Maps flows to worker cores through a ring, and hands them over
+// with a queue per core
+typedef struct {
+  // The points of each core are owned by the core number
+  ConsistentHasher ring;
+  // Protects [ring] from core changes during dispatch
+  ConsistentHasherRwLock lock;
+  // One queue per core, in [0, max_cores)
+  ConsistentHasherQueue *queues;
+  int max_cores;
+  // Number of points of each core in [ring]
+  int points_per_core;
+} ConsistentHasherDispatcher;
+
+void consistent_hasher_rwlock_read_lock(ConsistentHasherRwLock *lock);
+void consistent_hasher_rwlock_read_unlock(ConsistentHasherRwLock *lock);
+void consistent_hasher_rwlock_write_lock(ConsistentHasherRwLock *lock);
+void consistent_hasher_rwlock_write_unlock(ConsistentHasherRwLock *lock);
+
+// Rebuild the Eytzinger copy of [ch] with consistent_hasher_rebuild
+// instead of during each membership change, if [enabled]
+//
+// Membership changes then return without touching the copy, and
+// lookups keep using the last one built, so they may return the
+// previous owners until the next rebuild. Until a first copy is
+// built, lookups use CONSISTENT_HASHER_LAYOUT_BRANCHLESS.
+//
+// Returns: CONSISTENT_HASHER_OK on success, or an error otherwise
+// Note: disabling it rebuilds the copy right away, and must not race
+// with consistent_hasher_rebuild
+ConsistentHasherError
+consistent_hasher_set_background_rebuild(ConsistentHasher *ch,
+                                         bool enabled);
+
+// Check whether [ch] changed since its Eytzinger copy was built
+//
+// Note: call it under the lock that protects membership changes
+bool consistent_hasher_rebuild_pending(ConsistentHasher *ch);
+
+// Bring the Eytzinger copy of [ch] up to date, typically from a
+// thread of its own while others use [ch]
+//
+// Without background rebuilds, lookups search the arrays while the
+// copy is stale, and switch back to it once this returns. With a
+// NULL [lock] the copy is then filled in place.
+//
+// The points are copied under the read side of [lock], the new copy
+// is built into a spare buffer without holding it, and the buffers
+// are swapped under the write side. The old copy becomes the next
+// spare buffer once no lookup can still be using it. With a NULL
+// [lock], the caller makes sure [ch] is not used meanwhile.
+//
+// Returns: CONSISTENT_HASHER_OK on success, or an error otherwise
+// Note: only one thread may rebuild [ch] at a time, and membership
+// changes must take the write side of [lock]
+ConsistentHasherError
+consistent_hasher_rebuild(ConsistentHasher *ch,
+                          ConsistentHasherRwLock *lock);
+
+// Initialize [queue] with room for [capacity] items, rounded up to a
+// power of two
+//
+// Returns: CONSISTENT_HASHER_OK on success, or an error otherwise
+// Notes: Remember to destroy [queue] when you are done.
+ConsistentHasherError
+consistent_hasher_queue_init(ConsistentHasherQueue *queue,
+                             size_t capacity);
+
+// Free allocated memory in [queue]
+void consistent_hasher_queue_destroy(ConsistentHasherQueue *queue);
+
+// Append [item] to [queue], from any thread
+//
+// Returns: CONSISTENT_HASHER_OK on success, or
+// CONSISTENT_HASHER_ERROR_FULL if [queue] is full
+ConsistentHasherError
+consistent_hasher_queue_push(ConsistentHasherQueue *queue,
+                             void *item);
+
+// Take the oldest item of [queue] into [item], from the one consumer
+// thread
+//
+// Returns: true on success, false if [queue] is empty
+bool consistent_hasher_queue_pop(ConsistentHasherQueue *queue,
+                                 void **item);
+
+// Initialize [d] for up to [max_cores] cores, each with a queue of
+// [queue_capacity] items and [points_per_core] points on the ring
+//
+// Returns: CONSISTENT_HASHER_OK on success, or an error otherwise
+// Notes: No core receives flows until added with
+// consistent_hasher_dispatcher_add_core. Remember to destroy [d] when
+// you are done.
+ConsistentHasherError
+consistent_hasher_dispatcher_init(ConsistentHasherDispatcher *d,
+                                  int max_cores,
+                                  size_t queue_capacity,
+                                  int points_per_core);
+
+// Free allocated memory in [d]
+//
+// Note: items left in the queues are dropped
+void consistent_hasher_dispatcher_destroy(ConsistentHasherDispatcher *d);
+
+// Start sending flows to [core]
+//
+// Only the flows landing on the arcs of the new core move, the
+// others stay on their current core. Safe to call while other
+// threads dispatch.
+//
+// Returns: CONSISTENT_HASHER_OK on success, or an error otherwise
+ConsistentHasherError
+consistent_hasher_dispatcher_add_core(ConsistentHasherDispatcher *d,
+                                      int core);
+
+// Stop sending flows to [core]
+//
+// Only the flows of [core] move. Items already queued stay there
+// until the worker of [core] pops them. Safe to call while other
+// threads dispatch.
+//
+// Returns: CONSISTENT_HASHER_OK on success, or an error otherwise
+ConsistentHasherError
+consistent_hasher_dispatcher_remove_core(ConsistentHasherDispatcher *d,
+                                         int core);
+
+// Get the core handling [flow_hash] in [d]
+//
+// Returns: the core, or -1 if [d] has no cores
+int consistent_hasher_dispatcher_core_of(ConsistentHasherDispatcher *d,
+                                         ConsistentHasherHash flow_hash);
+
+// Queue [item] of [flow_hash] to its core in [d], from any thread
+//
+// Returns: CONSISTENT_HASHER_OK on success, or an error otherwise.
+// [core] is set to the chosen core if not NULL.
+ConsistentHasherError
+consistent_hasher_dispatch(ConsistentHasherDispatcher *d,
+                           ConsistentHasherHash flow_hash,
+                           void *item,
+                           int *core);
+
+// Queue the [n] [items] of [flow_hashes] to their cores in [d],
+// taking the lock once for all of them
+//
+// Returns: the number of queued items. [cores] is set to the core of
+// each item, or -1 where it could not be queued, if not NULL.
+int consistent_hasher_dispatch_batch(ConsistentHasherDispatcher *d,
+                                     const ConsistentHasherHash *flow_hashes,
+                                     void *const *items,
+                                     int n,
+                                     int *cores);
+
+// Take the oldest item queued to [core] in [d] into [item]
+//
+// Returns: true on success, false if the queue is empty
+// Note: only the worker of [core] may call this
+bool consistent_hasher_dispatcher_pop(ConsistentHasherDispatcher *d,
+                                      int core,
+                                      void **item);
+
+//
+// Flow table
+//
+// Pins established connections to their backend, so that membership
+// changes of the ring only affect new flows. Flows are looked up by
+// hash in a fixed-size set-associative table: a flow can only live in
+// the CONSISTENT_HASHER_FLOW_WAYS entries of its bucket, and the
+// least recently used one is evicted when the bucket is full.
+//
+
+// Config: number of entries per bucket of a ConsistentHasherFlowTable
+#ifndef CONSISTENT_HASHER_FLOW_WAYS
+  #define CONSISTENT_HASHER_FLOW_WAYS 4
+#endif
+
+// A bucket of a ConsistentHasherFlowTable
+typedef struct {
+  // Odd while a writer changes the bucket
+  uint32_t version;
+  // Time of last use of each entry, 0 if the entry is empty
+  uint32_t stamps[CONSISTENT_HASHER_FLOW_WAYS];
+  ConsistentHasherHash flows[CONSISTENT_HASHER_FLOW_WAYS];
+  ConsistentHasherHash backends[CONSISTENT_HASHER_FLOW_WAYS];
+} ConsistentHasherFlowBucket;
+
+// Connection-tracking table in front of a ring
+typedef struct {
+  ConsistentHasherFlowBucket *buckets;
+  // Number of buckets - 1, the number of buckets is a power of two
+  size_t mask;
+  // Flows idle for longer than this are forgotten, 0 to never expire
+  uint32_t timeout;
+} ConsistentHasherFlowTable;
+
+// Initialize [table] with room for at least [flows] flows, forgotten
+// after being idle for [timeout]
+//
+// Returns: CONSISTENT_HASHER_OK on success, or an error otherwise
+// Notes: Remember to destroy [table] when you are done.
+ConsistentHasherError
+consistent_hasher_flow_table_init(ConsistentHasherFlowTable *table,
+                                  size_t flows,
+                                  uint32_t timeout);
+
+// Free allocated memory in [table]
+void consistent_hasher_flow_table_destroy(ConsistentHasherFlowTable *table);
+
+// Get the backend of the flow with [flow_hash] at time [now]
+//
+// Known flows keep their backend. New flows get their node in [ch]
+// and are remembered. Readers never block, and may run in parallel
+// with each other.
+//
+// Returns: the backend of the flow
+// Notes: [ch] must contain at least one node and is only read on a
+// miss. [now] is any increasing clock, in the unit of the timeout.
+ConsistentHasherHash
+consistent_hasher_flow_lookup(ConsistentHasherFlowTable *table,
+                              ConsistentHasher *ch,
+                              ConsistentHasherHash flow_hash,
+                              uint32_t now);
+
+// Find the backend of the known flow with [flow_hash] at time [now]
+//
+// Returns: true and sets [backend] if the flow is known, false
+// otherwise
+bool consistent_hasher_flow_find(ConsistentHasherFlowTable *table,
+                                 ConsistentHasherHash flow_hash,
+                                 uint32_t now,
+                                 ConsistentHasherHash *backend);
+
+// Forget the flow with [flow_hash], for example when its connection
+// is closed
+void consistent_hasher_flow_remove(ConsistentHasherFlowTable *table,
+                                   ConsistentHasherHash flow_hash);
+
+// Forget all the flows pinned to [backend], for example when it is
+// removed from the ring
+//
+// Note: this scans the whole table
+void consistent_hasher_flow_remove_backend(ConsistentHasherFlowTable *table,
+                                           ConsistentHasherHash backend);
+
+//
+// Overrides
+//
+// Pin specific items to a node without changing the ring, for
+// example to move hot keys away from a busy node. Overrides are
+// checked by consistent_hasher_get_node_of before searching the
+// ring. An item can only live in its bucket, which is one cache
+// line, so a miss costs a single probe.
+//
+
+// Number of overrides in a bucket of ConsistentHasherOverrides
+#define CONSISTENT_HASHER_OVERRIDE_WAYS \
+  ((64 - 2 * sizeof(uint32_t)) / (2 * sizeof(ConsistentHasherHash)))
+
+// Contents of a ConsistentHasherOverrideBucket
+typedef struct {
+  // Odd while a writer changes the bucket
+  uint32_t version;
+  // Bit i is set if [items][i] is used
+  uint32_t used;
+  ConsistentHasherHash items[CONSISTENT_HASHER_OVERRIDE_WAYS];
+  ConsistentHasherHash nodes[CONSISTENT_HASHER_OVERRIDE_WAYS];
+} ConsistentHasherOverrideSlots;
+
+// A cache line of ConsistentHasherOverrides. The slots leave a few
+// bytes unused with some hash sizes, the union pads them to the full
+// line so that buckets never straddle two lines.
+typedef union {
+  ConsistentHasherOverrideSlots data;
+  unsigned char line[64];
+} ConsistentHasherOverrideBucket;
+
+// Fails to compile if a bucket is not exactly one cache line
+typedef char _consistent_hasher_override_bucket_size
+  [(sizeof(ConsistentHasherOverrideBucket) == 64) ? 1 : -1];
+
+// Table of item hash to node overrides
+typedef struct ConsistentHasherOverrides {
+  // Aligned to a cache line
+  ConsistentHasherOverrideBucket *buckets;
+  // Number of buckets - 1, the number of buckets is a power of two
+  size_t mask;
+  // Unaligned allocation of [buckets]
+  void *allocation;
+} ConsistentHasherOverrides;
+
+// Initialize [overrides] with room for at least [capacity] items
+//
+// Returns: CONSISTENT_HASHER_OK on success, or an error otherwise
+// Notes: Remember to destroy [overrides] when you are done.
+ConsistentHasherError
+consistent_hasher_overrides_init(ConsistentHasherOverrides *overrides,
+                                 size_t capacity);
+
+// Free allocated memory in [overrides]
+void consistent_hasher_overrides_destroy(ConsistentHasherOverrides *overrides);
+
+// Make [ch] check [overrides] before its ring, or stop if NULL
+//
+// Note: [overrides] must outlive [ch] or be detached first
+void consistent_hasher_set_overrides(ConsistentHasher *ch,
+                                     ConsistentHasherOverrides *overrides);
+
+// Assign [item_hash] to [node_hash] in [overrides]
+//
+// Returns: CONSISTENT_HASHER_OK on success, or
+// CONSISTENT_HASHER_ERROR_FULL if the bucket of [item_hash] is full
+ConsistentHasherError
+consistent_hasher_overrides_set(ConsistentHasherOverrides *overrides,
+                                ConsistentHasherHash item_hash,
+                                ConsistentHasherHash node_hash);
+
+// Remove the override of [item_hash] from [overrides]
+void consistent_hasher_overrides_remove(ConsistentHasherOverrides *overrides,
+                                        ConsistentHasherHash item_hash);
+
+// Assign the [n] [item_hashes] to [node_hashes] in [overrides]
+//
+// Returns: the number of assigned items, the others did not fit in
+// their bucket
+int consistent_hasher_overrides_set_batch(ConsistentHasherOverrides *overrides,
+                                          const ConsistentHasherHash *item_hashes,
+                                          const ConsistentHasherHash *node_hashes,
+                                          int n);
+
+// Remove the overrides of the [n] [item_hashes] from [overrides]
+void
+consistent_hasher_overrides_remove_batch(ConsistentHasherOverrides *overrides,
+                                         const ConsistentHasherHash *item_hashes,
+                                         int n);
+
+// Find the override of [item_hash] in [overrides], without locking
+//
+// Returns: true and sets [node_hash] if [item_hash] is overridden,
+// false otherwise
+bool consistent_hasher_overrides_find(ConsistentHasherOverrides *overrides,
+                                      ConsistentHasherHash item_hash,
+                                      ConsistentHasherHash *node_hash);
+
+//
+// Ranges
+//
+// A hasher initialized with a ring size of 0 places each point at
+// its hash as is, so the key order is preserved: a point at [end]
+// owns the range of keys after the previous point up to [end]
+// included, and the keys after the last point wrap around to the
+// first one. Keys made with consistent_hasher_range_key keep the
+// order of their byte strings, so a range scan only touches the
+// owners of the ranges it crosses.
+//
+
+// Get an order-preserving key from the first bytes of [key]
+//
+// Returns: the first sizeof(unsigned int) bytes of [key] as a big
+// endian number, padded with zeros if [len] is shorter
+unsigned int consistent_hasher_range_key(const void *key, size_t len);
+
+// Split the range of [ch] containing [at], giving the keys up to
+// [at] included to [node_hash]
+//
+// Returns: CONSISTENT_HASHER_OK on success, or an error otherwise
+// Note: fails with CONSISTENT_HASHER_ERROR_INVALID if [ch] does not
+// use ordered ranges, and with CONSISTENT_HASHER_ERROR_NODE_PRESENT
+// if a range already ends at [at]
+ConsistentHasherError
+consistent_hasher_range_split(ConsistentHasher *ch,
+                              unsigned int at,
+                              ConsistentHasherHash node_hash);
+
+// Merge the range of [ch] ending at [at] into the following one
+//
+// Returns: CONSISTENT_HASHER_OK on success, or
+// CONSISTENT_HASHER_ERROR_INVALID if [ch] does not use ordered ranges
+// or no range ends at [at]
+ConsistentHasherError
+consistent_hasher_range_merge(ConsistentHasher *ch,
+                              unsigned int at);
+
+// Get the owners of the keys from [lo] included to [hi] excluded
+//
+// Owners are written to [owners] in key order, up to [max] of them;
+// an owner of consecutive ranges is written once. If [hi] is not
+// greater than [lo] the query wraps around, so a [hi] of 0 reaches
+// the last key.
+//
+// Returns: the number of owners found, which may be bigger than [max]
+int consistent_hasher_range_owners(ConsistentHasher *ch,
+                                   unsigned int lo,
+                                   unsigned int hi,
+                                   ConsistentHasherHash *owners,
+                                   int max);
+
+//
+// Cluster slots
+//
+// A fixed table of CONSISTENT_HASHER_CLUSTER_SLOTS slots, each owned
+// by a node, like in Redis Cluster: keys map to slots with CRC16 of
+// their hash tag, and slots map to nodes with a single load. The
+// table follows a hasher: when its membership changes,
+// consistent_hasher_cluster_plan lists the slots whose owner on the
+// ring changed, which are the only ones to migrate.
+//
+
+#define CONSISTENT_HASHER_CLUSTER_SLOTS 16384
+
+// Migration state of a slot
+typedef enum {
+  // Served by its owner only
+  CONSISTENT_HASHER_SLOT_STABLE = 0,
+  // Keys are moving from the owner to the peer of the slot
+  CONSISTENT_HASHER_SLOT_MIGRATING,
+  // Keys are moving from the peer of the slot to the owner
+  CONSISTENT_HASHER_SLOT_IMPORTING,
+} ConsistentHasherSlotState;
+
+// Slot to node table
+typedef struct {
+  // Owner of each slot
+  ConsistentHasherHash *owners;
+  // Other node of a migrating or importing slot
+  ConsistentHasherHash *peers;
+  // ConsistentHasherSlotState of each slot
+  unsigned char *states;
+} ConsistentHasherCluster;
+
+// A slot to move, see consistent_hasher_cluster_plan
+typedef struct {
+  unsigned int slot;
+  ConsistentHasherHash from;
+  ConsistentHasherHash to;
+} ConsistentHasherSlotMove;
+
+// Initialize [cluster] with every slot owned by node 0
+//
+// Returns: CONSISTENT_HASHER_OK on success, or an error otherwise
+// Notes: Remember to destroy [cluster] when you are done.
+ConsistentHasherError
+consistent_hasher_cluster_init(ConsistentHasherCluster *cluster);
+
+// Free allocated memory in [cluster]
+void consistent_hasher_cluster_destroy(ConsistentHasherCluster *cluster);
+
+// Get the slot of the [len] bytes of [key]
+//
+// Returns: the CRC16 of the hash tag of [key] modulo
+// CONSISTENT_HASHER_CLUSTER_SLOTS, same as Redis Cluster
+unsigned int consistent_hasher_key_slot(const void *key, size_t len);
+
+// Get the owner of [slot] in [cluster]
+ConsistentHasherHash
+consistent_hasher_cluster_node_of(ConsistentHasherCluster *cluster,
+                                  unsigned int slot);
+
+// Get the owner of the slot of the [len] bytes of [key] in [cluster]
+ConsistentHasherHash
+consistent_hasher_cluster_node_of_key(ConsistentHasherCluster *cluster,
+                                      const void *key,
+                                      size_t len);
+
+// Give [slot] of [cluster] to [node_hash], ending any migration
+//
+// Returns: CONSISTENT_HASHER_OK on success, or an error otherwise
+ConsistentHasherError
+consistent_hasher_cluster_set_node(ConsistentHasherCluster *cluster,
+                                   unsigned int slot,
+                                   ConsistentHasherHash node_hash);
+
+// Set the migration [state] of [slot] in [cluster], with [peer] the
+// node keys move to or come from
+//
+// Returns: CONSISTENT_HASHER_OK on success, or an error otherwise
+ConsistentHasherError
+consistent_hasher_cluster_set_state(ConsistentHasherCluster *cluster,
+                                    unsigned int slot,
+                                    ConsistentHasherSlotState state,
+                                    ConsistentHasherHash peer);
+
+// Get the migration state of [slot] in [cluster], setting [peer] if
+// it is not stable
+ConsistentHasherSlotState
+consistent_hasher_cluster_get_state(ConsistentHasherCluster *cluster,
+                                    unsigned int slot,
+                                    ConsistentHasherHash *peer);
+
+// Get the ring position of [slot], see consistent_hasher_cluster_plan
+ConsistentHasherHash consistent_hasher_slot_hash(unsigned int slot);
+
+// List the slots of [cluster] whose owner differs from their owner in
+// [ch], which looks up each slot at consistent_hasher_slot_hash
+//
+// Since the ring moves few slots when a node joins or leaves, so does
+// the plan. Up to [max] moves are written to [moves] in slot order.
+//
+// Returns: the number of slots to move, which may be bigger than [max]
+// Note: [ch] must contain at least one node
+int consistent_hasher_cluster_plan(ConsistentHasherCluster *cluster,
+                                   ConsistentHasher *ch,
+                                   ConsistentHasherSlotMove *moves,
+                                   int max);
+
+// Mark the [n] [moves] as migrating in [cluster], or give the slots
+// to their new owner right away if [migrate] is false
+//
+// Returns: CONSISTENT_HASHER_OK on success, or an error otherwise
+ConsistentHasherError
+consistent_hasher_cluster_apply(ConsistentHasherCluster *cluster,
+                                const ConsistentHasherSlotMove *moves,
+                                int n,
+                                bool migrate);
+
+//
+// Ownership masks
+//
+
+// Test which of the [n] [item_hashes] belong to [node_hash] in [ch]
+//
+// Sets bit i % 64 of [mask][i / 64] if the i-th item is assigned to
+// [node_hash], same as comparing consistent_hasher_get_node_of with
+// [node_hash], and clears it otherwise. The arcs of [node_hash] are
+// computed once for the whole batch, and each item is compared with
+// all of them without branches when there are few.
+//
+// Returns: CONSISTENT_HASHER_OK on success, or an error otherwise
+// Note: [mask] must hold (n + 63) / 64 words. Static hashers do not
+// allocate the arcs and look every item up instead.
+ConsistentHasherError
+consistent_hasher_owned_mask(ConsistentHasher *ch,
+                             ConsistentHasherHash node_hash,
+                             const ConsistentHasherHash *item_hashes,
+                             int n,
+                             uint64_t *mask);
+
+//
+// Straw2
+//
+// An alternative to the ring, from CRUSH: for each item every node
+// draws a random straw scaled by its weight and the longest straw
+// wins. A draw only depends on the item, the node and its weight, so
+// changing the weight of a node only moves items to or from it, and
+// each node gets items in proportion to its weight.
+//
+
+// Weighted nodes selected by straw2
+typedef struct {
+  // Hash of each node
+  ConsistentHasherHash *nodes;
+  // Weight of each node
+  unsigned int *weights;
+  // 1 / weight of each node, so that draws multiply
+  double *inverse_weights;
+  // Number of nodes
+  int len;
+  // Allocated memory in the arrays
+  int capacity;
+} ConsistentHasherStraw2;
+
+// Initialize [straw2] without nodes
+//
+// Notes: Remember to destroy [straw2] when you are done.
+void consistent_hasher_straw2_init(ConsistentHasherStraw2 *straw2);
+
+// Free allocated memory in [straw2]
+void consistent_hasher_straw2_destroy(ConsistentHasherStraw2 *straw2);
+
+// Set the [weight] of [node_hash] in [straw2], adding the node if
+// needed. A node with weight 0 is never selected.
+//
+// Returns: CONSISTENT_HASHER_OK on success, or an error otherwise
+ConsistentHasherError
+consistent_hasher_straw2_set_weight(ConsistentHasherStraw2 *straw2,
+                                    ConsistentHasherHash node_hash,
+                                    unsigned int weight);
+
+// Remove [node_hash] from [straw2]
+//
+// Returns: CONSISTENT_HASHER_OK on success, or an error otherwise
+ConsistentHasherError
+consistent_hasher_straw2_remove(ConsistentHasherStraw2 *straw2,
+                                ConsistentHasherHash node_hash);
+
+// Get the node selected by straw2 for [item_hash]
+//
+// Note: [straw2] must contain a node with a positive weight
+ConsistentHasherHash
+consistent_hasher_straw2_select(ConsistentHasherStraw2 *straw2,
+                                ConsistentHasherHash item_hash);
+
+// Select the nodes of the [n] [item_hashes] into [out]
+//
+// Same as consistent_hasher_straw2_select on each item, but the items
+// are drawn in blocks against one node at a time, which the compiler
+// vectorizes.
+void consistent_hasher_straw2_select_batch(ConsistentHasherStraw2 *straw2,
+                                           const ConsistentHasherHash *item_hashes,
+                                           int n,
+                                           ConsistentHasherHash *out);
+
+//
+// Gapped ring
+//
+// Inserting in or deleting from ConsistentHasher shifts every point
+// after the changed one. ConsistentHasherGapped keeps its points in a
+// packed memory array instead: the sorted array has gaps spread
+// across it, so most changes fill or open a gap in place, and the
+// others only spread the points of a small window around them. This
+// costs O(log^2 n) amortized moves per change. Each gap holds a copy
+// of the next point, so lookups search the whole array like a
+// sorted one.
+//
+
+// A ring stored as a packed memory array
+typedef struct {
+  // Position of the point in each slot. Gaps hold the position of
+  // the next point, or UINT64_MAX after the last one
+  uint64_t *keys;
+  // Owner of the point in each slot, copied in gaps
+  ConsistentHasherHash *owners;
+  // Hash of the point in each slot, copied in gaps
+  ConsistentHasherHash *hashes;
+  // 1 for the slots holding a point, 0 for gaps
+  unsigned char *used;
+  // Number of slots, a power of two
+  size_t capacity;
+  // Number of slots in the smallest window that is spread
+  size_t segment;
+  // Number of points
+  size_t len;
+  // Size of the ring buffer, or 0 for ordered ranges
+  unsigned int ring_size;
+} ConsistentHasherGapped;
+
+// Initialize [ring] with [ring_size] slots, see consistent_hasher_init
+//
+// Notes: Remember to destroy [ring] when you are done.
+void consistent_hasher_gapped_init(ConsistentHasherGapped *ring,
+                                   unsigned int ring_size);
+
+// Free allocated memory in [ring]
+void consistent_hasher_gapped_destroy(ConsistentHasherGapped *ring);
+
+// Insert a point with [point_hash] in [ring], owned by [node_hash]
+//
+// Returns: CONSISTENT_HASHER_OK on success, or an error otherwise
+// Note: Fails if trying to insert a [point_hash] that is already
+// present
+ConsistentHasherError
+consistent_hasher_gapped_insert_point(ConsistentHasherGapped *ring,
+                                      ConsistentHasherHash node_hash,
+                                      ConsistentHasherHash point_hash);
+
+// Remove the point with [point_hash] from [ring]
+//
+// Returns: CONSISTENT_HASHER_OK on success, or an error otherwise
+ConsistentHasherError
+consistent_hasher_gapped_delete_point(ConsistentHasherGapped *ring,
+                                      ConsistentHasherHash point_hash);
+
+// Get the hash of the node corresponding to [item_hash] in [ring]
+//
+// Returns: the owner of the first point at or after [item_hash]
+// Note: [ring] must contain at least one point
+ConsistentHasherHash
+consistent_hasher_gapped_get_node_of(ConsistentHasherGapped *ring,
+                                     ConsistentHasherHash item_hash);
+
+//
+// Inline lookups
+//
+// The functions above are compiled once, in the file defining
+// CONSISTENT_HASHER_IMPLEMENTATION, so calls from other files cannot
+// be inlined without link-time optimization. The lookups below are
+// defined in every file including this header instead. Mutations
+// stay out of line.
+//
+
+// Same as consistent_hasher_get_node_of, except that lookups are not
+// traced
+//
+// Note: [ch] must contain at least one node
+static inline ConsistentHasherHash
+consistent_hasher_lookup(const ConsistentHasher *ch,
+                         ConsistentHasherHash item_hash)
+{
+  ConsistentHasherHash node_hash;
+  if (ch->overrides
+      && consistent_hasher_overrides_find(ch->overrides, item_hash, &node_hash))
+    return node_hash;
+
+  unsigned int position = (ch->ring_size)
+    ? item_hash % ch->ring_size : (unsigned int) item_hash;
+  
+  if (ch->active_layout == CONSISTENT_HASHER_LAYOUT_EYTZINGER)
+  {
+    unsigned int k = 1;
+    while (k <= (unsigned int) ch->eytzinger_len)
+      k = 2 * k + (ch->eytzinger[k] < position);
+    while (k & 1) k >>= 1;
+    k >>= 1;
+    return ch->eytzinger_owners[k];
+  }
+
+  // The other layouts all keep [nodes] sorted
+  const ConsistentHasherNode *base = ch->nodes;
+  int len = ch->nodes_len;
+  while (len > 1)
+  {
+    int half = len / 2;
+    base = (base[half].position < position) ? base + half : base;
+    len -= half;
+  }
+  base += (base->position < position);
+
+  return (base == ch->nodes + ch->nodes_len) ? ch->nodes[0].owner
+                                             : base->owner;
+}
+
+// Look up the [n] [item_hashes] in [ch] into [out], same as
+// consistent_hasher_lookup
+//
+// Groups of four searches advance together, so that their memory
+// accesses overlap.
+static inline void
+consistent_hasher_lookup_batch(const ConsistentHasher *ch,
+                               const ConsistentHasherHash *item_hashes,
+                               int n,
+                               ConsistentHasherHash *out)
+{
+  int i = 0;
+  if (!ch->overrides
+      && ch->active_layout != CONSISTENT_HASHER_LAYOUT_EYTZINGER)
+  {
+    const ConsistentHasherNode *end = ch->nodes + ch->nodes_len;
+    for (; i + 4 <= n; i += 4)
+    {
+      unsigned int positions[4];
+      const ConsistentHasherNode *bases[4];
+      for (int j = 0; j < 4; ++j)
+      {
+        positions[j] = (ch->ring_size) ? item_hashes[i + j] % ch->ring_size
+                                       : (unsigned int) item_hashes[i + j];
+        bases[j] = ch->nodes;
+      }
+      
+      int len = ch->nodes_len;
+      while (len > 1)
+      {
+        int half = len / 2;
+        for (int j = 0; j < 4; ++j)
+          bases[j] = (bases[j][half].position < positions[j])
+            ? bases[j] + half : bases[j];
+        len -= half;
+      }
+      
+      for (int j = 0; j < 4; ++j)
+      {
+        const ConsistentHasherNode *base =
+          bases[j] + (bases[j]->position < positions[j]);
+        out[i + j] = (base == end) ? ch->nodes[0].owner : base->owner;
+      }
+    }
+  }
+  
+  for (; i < n; ++i)
+    out[i] = consistent_hasher_lookup(ch, item_hashes[i]);
+  return;
+}
+
+//
+// Interleaved lookups
+//
+// Each level of a search on a big ring waits for a cache miss.
+// Callers that have a batch of items at hand can use
+// consistent_hasher_lookup_batch; the scheduler below lets lookups
+// submitted one at a time, from unrelated places, overlap as well.
+// Every lookup is a small state machine: a step does one level of
+// its search, prefetches the next one and moves on to the other
+// lookups while the memory arrives (asynchronous memory access
+// chaining, AMAC).
+//
+
+// Called by a ConsistentHasherScheduler when the lookup submitted
+// with [user] finds [node_hash] for [item_hash]
+typedef void (*ConsistentHasherLookupDone)(void *user,
+                                           ConsistentHasherHash item_hash,
+                                           ConsistentHasherHash node_hash);
+
+// A lookup in flight
+typedef struct {
+  ConsistentHasherHash item_hash;
+  unsigned int position;
+  // Sorted layouts: first candidate point and number of candidates
+  const ConsistentHasherNode *base;
+  int len;
+  // Eytzinger layout: next index to compare
+  unsigned int k;
+  // Written with the result if not NULL
+  ConsistentHasherHash *out;
+  void *user;
+} ConsistentHasherLookupState;
+
+// Interleaves the lookups on a hasher
+typedef struct {
+  ConsistentHasher *ch;
+  // Called on each completed lookup, if not NULL
+  ConsistentHasherLookupDone done;
+  ConsistentHasherLookupState slots[CONSISTENT_HASHER_SCHEDULER_SLOTS];
+  // Number of lookups in flight, at the start of [slots]
+  int active;
+} ConsistentHasherScheduler;
+
+// Initialize [scheduler] to look up items in [ch], calling [done] on
+// each result if not NULL
+//
+// Note: [ch] must contain at least one node and not change while
+// lookups are in flight. [done] may submit more lookups to
+// [scheduler].
+void consistent_hasher_scheduler_init(ConsistentHasherScheduler *scheduler,
+                                      ConsistentHasher *ch,
+                                      ConsistentHasherLookupDone done);
+
+// Start the lookup of [item_hash], storing the owner in [out] if not
+// NULL and passing [user] to the done callback
+//
+// If CONSISTENT_HASHER_SCHEDULER_SLOTS lookups are in flight, the
+// others are stepped until one completes.
+void consistent_hasher_scheduler_submit(ConsistentHasherScheduler *scheduler,
+                                        ConsistentHasherHash item_hash,
+                                        ConsistentHasherHash *out,
+                                        void *user);
+
+// Advance every lookup in flight by one level of its search
+//
+// Returns: the number of lookups still in flight
+int consistent_hasher_scheduler_step(ConsistentHasherScheduler *scheduler);
+
+// Complete every lookup in flight
+void consistent_hasher_scheduler_drain(ConsistentHasherScheduler *scheduler);
+
+//
+// Watches
+//
+// Tell callers which parts of the ring changed owner, for example to
+// invalidate or prefetch cached data, without keeping a copy of the
+// ring. Changes are collected during a membership change and passed
+// to every watcher when it returns.
+//
+
+// The positions in (start, end] of the ring moved from [old_owner]
+// to [new_owner]. The arc wraps around the end of the ring when
+// [start] >= [end].
+typedef struct ConsistentHasherArcChange {
+  unsigned int start;
+  unsigned int end;
+  ConsistentHasherHash old_owner;
+  ConsistentHasherHash new_owner;
+} ConsistentHasherArcChange;
+
+// Called with the [len] arcs changed by a membership change of [ch],
+// in the order they changed. An arc may change more than once, for
+// example when a weight changes, so apply them in order. [len] is -1
+// and [changes] NULL if the changes could not be recorded for lack
+// of memory.
+//
+// Note: [ch] may be searched, but not changed. With background
+// rebuilds, lookups may still return the old owners.
+typedef void (*ConsistentHasherWatchCallback)(ConsistentHasher *ch,
+                                              const ConsistentHasherArcChange *changes,
+                                              int len,
+                                              void *user);
+
+// A registered callback
+typedef struct ConsistentHasherWatcher {
+  ConsistentHasherWatchCallback callback;
+  void *user;
+  // Next watcher of the same hasher
+  struct ConsistentHasherWatcher *next;
+} ConsistentHasherWatcher;
+
+// Call [callback] with [user] after each membership change of [ch]
+// that changes the owner of some positions, using [watcher]
+//
+// Returns: CONSISTENT_HASHER_OK on success, or an error otherwise
+// Notes: [watcher] must outlive the watch. Changes from or to an
+// empty ring are not reported. Static hashers cannot be watched, as
+// the changes are collected in allocated memory.
+ConsistentHasherError
+consistent_hasher_watch(ConsistentHasher *ch,
+                        ConsistentHasherWatcher *watcher,
+                        ConsistentHasherWatchCallback callback,
+                        void *user);
+
+// Stop calling the callback registered with [watcher] on [ch]
+void consistent_hasher_unwatch(ConsistentHasher *ch,
+                               ConsistentHasherWatcher *watcher);
+
+//
+// Scale-in
+//
+// Pick the nodes whose removal moves the fewest items and leaves the
+// most even ring, from the arcs of each node rather than by trying
+// each removal.
+//
+
+// A node to remove, see consistent_hasher_rank_scale_in
+typedef struct {
+  ConsistentHasherHash node;
+  // Positions that move to other nodes, which is the load of [node]
+  uint64_t movement;
+  // Biggest load of the nodes left divided by their mean load, 1 for
+  // a perfectly even ring
+  double imbalance;
+} ConsistentHasherScaleIn;
+
+// Rank up to [k] nodes of [ch] to remove, best first, in [ranking]
+//
+// Removing a node gives each of its arcs to the owner of the next
+// point, so its cost is known from the arcs alone. Each pick is the
+// node with the smallest movement, over the mean load left, plus
+// imbalance, assuming the nodes ranked before it are removed. Each
+// pick takes O(points) time.
+//
+// Returns: CONSISTENT_HASHER_OK on success, or an error otherwise
+// Notes: [len] is set to the number of ranked nodes, which is less
+// than [k] if fewer than [k] + 1 nodes are in [ch]. Static hashers
+// return CONSISTENT_HASHER_ERROR_INVALID, as this allocates.
+ConsistentHasherError
+consistent_hasher_rank_scale_in(ConsistentHasher *ch,
+                                int k,
+                                ConsistentHasherScaleIn *ranking,
+                                int *len);
+
+//
+// Partition assignment
+//
+// Assign a fixed set of partitions, numbered from 0, to the nodes of
+// a ring, for example the partitions of a stream to the consumers of
+// a group. The partitions are sorted by ring position once, so the
+// whole assignment is computed again in a single walk along the
+// ring, and only the partitions that changed owner are reported.
+//
+
+// Owners of the partitions
+typedef struct {
+  int partitions;
+  // Owner of each partition, valid after consistent_hasher_assign
+  ConsistentHasherHash *owners;
+  // Owners found by the last walk
+  ConsistentHasherHash *next;
+  // Partitions in ring order, and their positions
+  int *order;
+  unsigned int *positions;
+  // Ring size [order] was sorted for
+  unsigned int ring_size;
+  bool sorted;
+  // True once [owners] is set
+  bool assigned;
+} ConsistentHasherAssignment;
+
+// A partition that changed owner, see consistent_hasher_assign
+typedef struct {
+  int partition;
+  ConsistentHasherHash from;
+  ConsistentHasherHash to;
+} ConsistentHasherPartitionMove;
+
+// Initialize [assignment] for [partitions] partitions
+//
+// Returns: CONSISTENT_HASHER_OK on success, or an error otherwise
+// Notes: Remember to destroy [assignment] when you are done.
+ConsistentHasherError
+consistent_hasher_assignment_init(ConsistentHasherAssignment *assignment,
+                                  int partitions);
+
+// Free allocated memory in [assignment]
+void
+consistent_hasher_assignment_destroy(ConsistentHasherAssignment *assignment);
+
+// Get the ring position of [partition], see consistent_hasher_assign
+ConsistentHasherHash consistent_hasher_partition_hash(int partition);
+
+// Assign each partition of [assignment] to its owner in [ch], which
+// looks up each partition at consistent_hasher_partition_hash
+//
+// Partitions that changed owner since the last call are written to
+// [moves], up to [max] of them, in partition order. The first call
+// assigns every partition and reports none.
+//
+// Returns: the number of partitions that changed owner, which may be
+// bigger than [max]
+// Note: [ch] must contain at least one node
+int consistent_hasher_assign(ConsistentHasherAssignment *assignment,
+                             ConsistentHasher *ch,
+                             ConsistentHasherPartitionMove *moves,
+                             int max);
+
+//
+// XOR metric
+//
+// An alternative to the ring, from Kademlia: an item belongs to the
+// node whose hash is closest to the item hash in XOR distance, and
+// the next closest nodes make a natural replica list. The nodes are
+// kept in a crit-bit trie, which only branches where their hashes
+// differ, so a lookup tests at most one bit of the hash per level
+// whatever the number of nodes, and n nodes take n - 1 branches.
+//
+
+// Number of bits of a ConsistentHasherHash
+#define CONSISTENT_HASHER_XOR_BITS (8 * (int) sizeof(ConsistentHasherHash))
+
+// A branch of ConsistentHasherXorTrie
+typedef struct {
+  // Bit tested, counting from the most significant one
+  int bit;
+  // Subtrees for a 0 and a 1 bit: a branch index if >= 0, or the
+  // complement of a node index
+  int children[2];
+} ConsistentHasherXorBranch;
+
+// Nodes sorted by XOR distance
+typedef struct {
+  // [len] - 1 branches, bits grow going down
+  ConsistentHasherXorBranch *branches;
+  // [len] node hashes
+  ConsistentHasherHash *nodes;
+  // The top branch, or the complement of the only node
+  int root;
+  int len;
+  int capacity;
+} ConsistentHasherXorTrie;
+
+// Initialize an empty [trie]
+//
+// Notes: Remember to destroy [trie] when you are done.
+void consistent_hasher_xor_init(ConsistentHasherXorTrie *trie);
+
+// Free allocated memory in [trie]
+void consistent_hasher_xor_destroy(ConsistentHasherXorTrie *trie);
+
+// Insert the node with [node_hash] in [trie]
+//
+// Returns: CONSISTENT_HASHER_OK on success, or an error otherwise
+// Note: Fails if trying to insert a [node_hash] that is already
+// present. Node hashes should be uniformly distributed.
+ConsistentHasherError
+consistent_hasher_xor_insert(ConsistentHasherXorTrie *trie,
+                             ConsistentHasherHash node_hash);
+
+// Remove the node with [node_hash] from [trie]
+//
+// Returns: CONSISTENT_HASHER_OK on success, or an error otherwise
+ConsistentHasherError
+consistent_hasher_xor_delete(ConsistentHasherXorTrie *trie,
+                             ConsistentHasherHash node_hash);
+
+// Get the node of [trie] closest to [item_hash]
+//
+// Returns: the node hash with the smallest XOR with [item_hash]
+// Note: [trie] must contain at least one node
+ConsistentHasherHash
+consistent_hasher_xor_nearest(const ConsistentHasherXorTrie *trie,
+                              ConsistentHasherHash item_hash);
+
+// Get the [k] nodes of [trie] closest to [item_hash] in [nodes],
+// closest first
+//
+// Returns: the number of nodes written, less than [k] if [trie] has
+// fewer nodes
+int consistent_hasher_xor_k_nearest(const ConsistentHasherXorTrie *trie,
+                                    ConsistentHasherHash item_hash,
+                                    ConsistentHasherHash *nodes,
+                                    int k);
+  
+//
+// Implementations
+//
+
+#ifdef CONSISTENT_HASHER_IMPLEMENTATION
+
+#ifdef CONSISTENT_HASHER_TRACE
+
+void _consistent_hasher_trace_record(ConsistentHasher *ch,
+                                     ConsistentHasherTraceOp op,
+                                     ConsistentHasherHash hash,
+                                     ConsistentHasherHash owner)
+{
+  ConsistentHasherTrace *trace = ch->trace;
+  if (!trace) return;
+
+  // Parallel lookups each get their own count, and the file is
+  // locked by stdio
+  if (op == CONSISTENT_HASHER_TRACE_LOOKUP)
+  {
+    unsigned int seen =
+      __atomic_add_fetch(&trace->counter, 1, __ATOMIC_RELAXED);
+    if (seen % trace->sample_every != 0) return;
+  }
+
+  ConsistentHasherTraceRecord record = (ConsistentHasherTraceRecord) {
+    .op = op,
+    .reserved = 0,
+    .hash = (uint64_t) hash,
+    .owner = (uint64_t) owner,
+  };
+  fwrite(&record, sizeof(record), 1, trace->file);
+  
+  return;
+}
+
+#define _CONSISTENT_HASHER_TRACE_RECORD(ch, op, hash, owner) \
+  _consistent_hasher_trace_record((ch), (op), (hash), (owner))
+
+ConsistentHasherError
+consistent_hasher_trace_start(ConsistentHasher *ch,
+                              ConsistentHasherTrace *trace,
+                              FILE *file,
+                              unsigned int sample_every)
+{
+  if (!ch || !trace || !file) return CONSISTENT_HASHER_ERROR_IS_NULL;
+
+  ConsistentHasherTraceHeader header = (ConsistentHasherTraceHeader) {
+    .magic = CONSISTENT_HASHER_TRACE_MAGIC,
+    .version = CONSISTENT_HASHER_TRACE_VERSION,
+    .hash_size = sizeof(ConsistentHasherHash),
+    .ring_size = ch->ring_size,
+  };
+  if (fwrite(&header, sizeof(header), 1, file) != 1)
+    return CONSISTENT_HASHER_ERROR_IO;
+
+  *trace = (ConsistentHasherTrace) {
+    .file = file,
+    .sample_every = (sample_every) ? sample_every : 1,
+    .counter = 0,
+  };
+  ch->trace = trace;
+
+  for (int i = 0; i < ch->nodes_len; ++i)
+  {
+    _consistent_hasher_trace_record(ch, CONSISTENT_HASHER_TRACE_INSERT,
+                                    ch->nodes[i].hash, ch->nodes[i].owner);
+  }
+  
+  return CONSISTENT_HASHER_OK;
+}
+
+ConsistentHasherError
+consistent_hasher_trace_stop(ConsistentHasher *ch)
+{
+  if (!ch) return CONSISTENT_HASHER_ERROR_IS_NULL;
+  if (!ch->trace) return CONSISTENT_HASHER_OK;
+
+  FILE *file = ch->trace->file;
+  ch->trace = NULL;
+  if (ferror(file) || fflush(file) != 0) return CONSISTENT_HASHER_ERROR_IO;
+
+  return CONSISTENT_HASHER_OK;
+}
+
+ConsistentHasherError
+consistent_hasher_trace_read_header(FILE *file,
+                                    ConsistentHasherTraceHeader *header)
+{
+  if (!file || !header) return CONSISTENT_HASHER_ERROR_IS_NULL;
+
+  if (fread(header, sizeof(*header), 1, file) != 1)
+    return CONSISTENT_HASHER_ERROR_IO;
+  
+  for (unsigned int i = 0; i < sizeof(CONSISTENT_HASHER_TRACE_MAGIC); ++i)
+  {
+    if (header->magic[i] != CONSISTENT_HASHER_TRACE_MAGIC[i])
+      return CONSISTENT_HASHER_ERROR_IO;
+  }
+  if (header->version != CONSISTENT_HASHER_TRACE_VERSION)
+    return CONSISTENT_HASHER_ERROR_IO;
+  // The records would hold truncated hashes
+  if (header->hash_size != sizeof(ConsistentHasherHash))
+    return CONSISTENT_HASHER_ERROR_INVALID;
+
+  return CONSISTENT_HASHER_OK;
+}
+
+bool consistent_hasher_trace_read(FILE *file,
+                                  ConsistentHasherTraceRecord *record)
+{
+  if (!file || !record) return false;
+  return fread(record, sizeof(*record), 1, file) == 1;
+}
+
+#else
+
+#define _CONSISTENT_HASHER_TRACE_RECORD(ch, op, hash, owner)
+
+#endif // CONSISTENT_HASHER_TRACE
+
+
+void consistent_hasher_init(ConsistentHasher *ch,
+                            unsigned int ring_size)
+{
+  if (!ch) return;
+
+  *ch = (ConsistentHasher) {
+    .ring_size = ring_size,
+    .nodes_len = 0,
+    .nodes_capacity = 0,
+    .nodes = NULL,
+    .points = NULL,
+    .is_static = false,
+    .next_nodes = NULL,
+    .next_points = NULL,
+    .next_capacity = 0,
+    .migrated_nodes = 0,
+    .migrated_points = 0,
+    .layout = CONSISTENT_HASHER_LAYOUT_AUTO,
+    .active_layout = CONSISTENT_HASHER_LAYOUT_LINEAR,
+    .memory_budget = 0,
+    .eytzinger = NULL,
+    .eytzinger_owners = NULL,
+    .eytzinger_capacity = 0,
+    .eytzinger_len = 0,
+    .spare_eytzinger = NULL,
+    .spare_eytzinger_owners = NULL,
+    .spare_capacity = 0,
+    .background_rebuild = false,
+    .generation = 0,
+    .built_generation = 0,
+    .overrides = NULL,
+    .watchers = NULL,
+    .changes = NULL,
+    .changes_len = 0,
+    .changes_capacity = 0,
+    .changes_lost = false,
+  };
+  consistent_hasher_set_seed(ch, 0, 0);
+  
+  return;
+}
+
+void consistent_hasher_init_budget(ConsistentHasher *ch,
+                                   unsigned int ring_size,
+                                   size_t budget)
+{
+  if (!ch) return;
+
+  consistent_hasher_init(ch, ring_size);
+  ch->memory_budget = budget;
+  return;
+}
+
+void consistent_hasher_init_static(ConsistentHasher *ch,
+                                   unsigned int ring_size,
+                                   ConsistentHasherNode *buffer,
+                                   ConsistentHasherNode *points,
+                                   int capacity)
+{
+  if (!ch) return;
+
+  // Without both buffers every insert fails with
+  // CONSISTENT_HASHER_ERROR_FULL
+  bool usable = buffer && points && capacity > 0;
+  *ch = (ConsistentHasher) {
+    .ring_size = ring_size,
+    .nodes_len = 0,
+    .nodes_capacity = (usable) ? capacity : 0,
+    .nodes = (usable) ? buffer : NULL,
+    .points = (usable) ? points : NULL,
+    .is_static = true,
+    .next_nodes = NULL,
+    .next_points = NULL,
+    .next_capacity = 0,
+    .migrated_nodes = 0,
+    .migrated_points = 0,
+    .layout = CONSISTENT_HASHER_LAYOUT_AUTO,
+    .active_layout = CONSISTENT_HASHER_LAYOUT_LINEAR,
+    .memory_budget = 0,
+    .eytzinger = NULL,
+    .eytzinger_owners = NULL,
+    .eytzinger_capacity = 0,
+    .eytzinger_len = 0,
+    .spare_eytzinger = NULL,
+    .spare_eytzinger_owners = NULL,
+    .spare_capacity = 0,
+    .background_rebuild = false,
+    .generation = 0,
+    .built_generation = 0,
+    .overrides = NULL,
+    .watchers = NULL,
+    .changes = NULL,
+    .changes_len = 0,
+    .changes_capacity = 0,
+    .changes_lost = false,
+  };
+  consistent_hasher_set_seed(ch, 0, 0);
+
+  return;
+}
+ 
+void consistent_hasher_destroy(ConsistentHasher *ch)
+{
+  if (!ch) return;
+  
+  if (ch->nodes && !ch->is_static) CONSISTENT_HASHER_FREE(ch->nodes);
+  if (ch->next_nodes) CONSISTENT_HASHER_FREE(ch->next_nodes);
+  if (ch->eytzinger) CONSISTENT_HASHER_FREE(ch->eytzinger);
+  if (ch->eytzinger_owners) CONSISTENT_HASHER_FREE(ch->eytzinger_owners);
+  if (ch->spare_eytzinger) CONSISTENT_HASHER_FREE(ch->spare_eytzinger);
+  if (ch->spare_eytzinger_owners)
+    CONSISTENT_HASHER_FREE(ch->spare_eytzinger_owners);
+  if (ch->changes) CONSISTENT_HASHER_FREE(ch->changes);
+  ch->nodes = NULL;
+  ch->points = NULL;
+  ch->next_nodes = NULL;
+  ch->next_points = NULL;
+  ch->eytzinger = NULL;
+  ch->eytzinger_owners = NULL;
+  ch->eytzinger_capacity = 0;
+  ch->eytzinger_len = 0;
+  ch->spare_eytzinger = NULL;
+  ch->spare_eytzinger_owners = NULL;
+  ch->spare_capacity = 0;
+  ch->watchers = NULL;
+  ch->changes = NULL;
+  ch->changes_len = 0;
+  ch->changes_capacity = 0;
+  ch->nodes_len = 0;
+  ch->nodes_capacity = 0;
+  
+  return;
+}
+
+ConsistentHasherHash consistent_hasher_point_hash(ConsistentHasherHash node_hash,
+                                                  unsigned int i)
+{
+  // splitmix64 finalizer
+  uint64_t x = (uint64_t) node_hash * 0x9E3779B97F4A7C15ULL + i + 1;
+  x = (x ^ (x >> 30)) * 0xBF58476D1CE4E5B9ULL;
+  x = (x ^ (x >> 27)) * 0x94D049BB133111EBULL;
+  x = x ^ (x >> 31);
+  
+  return (ConsistentHasherHash) x;
+}
+
+// Position of [hash] in the ring of [ch]
+unsigned int _consistent_hasher_position(ConsistentHasher *ch,
+                                         ConsistentHasherHash hash)
+{
+  // Ordered ranges use the whole unsigned int space
+  return (ch->ring_size) ? hash % ch->ring_size : (unsigned int) hash;
+}
+
+bool _consistent_hasher_binary_search(ConsistentHasher *ch,
+                                      ConsistentHasherHash node_hash,
+                                      int *index)
+{
+  int start = 0;
+  int end = ch->nodes_len - 1;
+  unsigned int position = _consistent_hasher_position(ch, node_hash);
+  int mid = (end - start) / 2 + start;
+  
+  while(end >= start) {
+    
+    if (ch->nodes[mid].position == position)
+    {
+      if (index) *index = mid;
+      return true;
+    }
+    
+    if (ch->nodes[mid].position > position)
+    {
+      end = mid - 1;
+    }
+    else if (ch->nodes[mid].position < position)
+    {
+      start = mid + 1;
+    }
+
+    mid = (end - start) / 2 + start;
+  }
+
+  if (index) *index = mid;
+  return false;
+}
+
+// Search the point of [owner] at [position] in the reverse index
+//
+// Returns: true if found. [index] is set to the index of the point,
+// or to the index where it would be inserted
+bool _consistent_hasher_points_search(ConsistentHasher *ch,
+                                      ConsistentHasherHash owner,
+                                      unsigned int position,
+                                      int *index)
+{
+  int start = 0;
+  int end = ch->nodes_len;
+  
+  while (start < end)
+  {
+    int mid = (end - start) / 2 + start;
+    ConsistentHasherNode *point = &ch->points[mid];
+    if (point->owner < owner
+        || (point->owner == owner && point->position < position))
+      start = mid + 1;
+    else
+      end = mid;
+  }
+
+  if (index) *index = start;
+  return start < ch->nodes_len
+    && ch->points[start].owner == owner
+    && ch->points[start].position == position;
+}
+
+// Bytes of the arrays of [capacity] nodes
+#define _CONSISTENT_HASHER_ARRAY_BYTES(capacity) \
+  (2 * (size_t)(capacity) * sizeof(ConsistentHasherNode))
+// Bytes of an Eytzinger copy of [capacity] points
+#define _CONSISTENT_HASHER_EYTZINGER_BYTES(capacity) \
+  ((size_t)(capacity) * (sizeof(unsigned int) + sizeof(ConsistentHasherHash)))
+
+size_t consistent_hasher_footprint(const ConsistentHasher *ch)
+{
+  if (!ch) return 0;
+
+  size_t bytes = 0;
+  if (!ch->is_static) bytes += _CONSISTENT_HASHER_ARRAY_BYTES(ch->nodes_capacity);
+  if (ch->next_nodes) bytes += _CONSISTENT_HASHER_ARRAY_BYTES(ch->next_capacity);
+  if (ch->eytzinger)
+    bytes += _CONSISTENT_HASHER_EYTZINGER_BYTES(ch->eytzinger_capacity);
+  if (ch->spare_eytzinger)
+    bytes += _CONSISTENT_HASHER_EYTZINGER_BYTES(ch->spare_capacity);
+  return bytes;
+}
+
+// Largest capacity of the arrays of a hasher limited to [budget]
+// bytes
+int _consistent_hasher_budget_capacity(size_t budget)
+{
+  size_t capacity = budget / _CONSISTENT_HASHER_ARRAY_BYTES(1);
+  return (capacity > INT_MAX / 2) ? INT_MAX / 2 : (int) capacity;
+}
+
+int consistent_hasher_budget_points(size_t budget,
+                                    ConsistentHasherLayout layout)
+{
+  if (layout != CONSISTENT_HASHER_LAYOUT_EYTZINGER)
+    return _consistent_hasher_budget_capacity(budget);
+
+  // The copy has one more entry than the arrays
+  size_t one = _CONSISTENT_HASHER_EYTZINGER_BYTES(1);
+  if (budget < one) return 0;
+  size_t capacity = (budget - one)
+    / (_CONSISTENT_HASHER_ARRAY_BYTES(1) + one);
+  return (capacity > INT_MAX / 2) ? INT_MAX / 2 : (int) capacity;
+}
+
+// Reallocate [ch] to hold [capacity] nodes
+ConsistentHasherError _consistent_hasher_resize(ConsistentHasher *ch,
+                                                int capacity)
+{
+  // The ring and the reverse index share one allocation
+  ConsistentHasherNode *new_nodes =
+    CONSISTENT_HASHER_CALLOC(2 * capacity, sizeof(ConsistentHasherNode));
+  if (!new_nodes) return CONSISTENT_HASHER_ERROR_ALLOCATION;
+
+  ConsistentHasherNode *new_points = new_nodes + capacity;
+  for (int i = 0; i < ch->nodes_len; ++i)
+  {
+    new_nodes[i] = ch->nodes[i];
+    new_points[i] = ch->points[i];
+  }
+  if (ch->nodes) CONSISTENT_HASHER_FREE(ch->nodes);
+
+  ch->nodes = new_nodes;
+  ch->points = new_points;
+  ch->nodes_capacity = capacity;
+
+  return CONSISTENT_HASHER_OK;
+}
+
+// Entries copied to the next arrays by each change. Growing starts
+// half full and shrinking an eighth full, which leaves enough
+// changes to copy everything before the current array is full.
+#define _CONSISTENT_HASHER_MIGRATE_STEP 3
+
+// Start moving [ch] to arrays of [capacity] nodes, a few entries per
+// change
+void _consistent_hasher_migrate_start(ConsistentHasher *ch, int capacity)
+{
+  // Both arrays are kept until the end, which may not fit the budget
+  if (ch->memory_budget
+      && consistent_hasher_footprint(ch) + _CONSISTENT_HASHER_ARRAY_BYTES(capacity)
+         > ch->memory_budget)
+    return;
+
+  // On failure the array is resized at once when needed
+  ConsistentHasherNode *next =
+    CONSISTENT_HASHER_CALLOC(2 * capacity, sizeof(ConsistentHasherNode));
+  if (!next) return;
+
+  ch->next_nodes = next;
+  ch->next_points = next + capacity;
+  ch->next_capacity = capacity;
+  ch->migrated_nodes = 0;
+  ch->migrated_points = 0;
+  return;
+}
+
+// Stop moving [ch] to the next arrays, leaving the current ones
+void _consistent_hasher_migrate_abort(ConsistentHasher *ch)
+{
+  if (!ch->next_nodes) return;
+  
+  CONSISTENT_HASHER_FREE(ch->next_nodes);
+  ch->next_nodes = NULL;
+  ch->next_points = NULL;
+  ch->next_capacity = 0;
+  return;
+}
+
+// Copy up to [count] more entries of [ch] to the next arrays, and
+// switch to them once they are complete
+void _consistent_hasher_migrate_step(ConsistentHasher *ch, int count)
+{
+  if (!ch->next_nodes) return;
+
+  for (int i = 0; i < count && ch->migrated_nodes < ch->nodes_len; ++i)
+  {
+    ch->next_nodes[ch->migrated_nodes] = ch->nodes[ch->migrated_nodes];
+    ch->migrated_nodes++;
+  }
+  for (int i = 0; i < count && ch->migrated_points < ch->nodes_len; ++i)
+  {
+    ch->next_points[ch->migrated_points] = ch->points[ch->migrated_points];
+    ch->migrated_points++;
+  }
+  if (ch->migrated_nodes < ch->nodes_len
+      || ch->migrated_points < ch->nodes_len)
+    return;
+
+  CONSISTENT_HASHER_FREE(ch->nodes);
+  ch->nodes = ch->next_nodes;
+  ch->points = ch->next_points;
+  ch->nodes_capacity = ch->next_capacity;
+  ch->next_nodes = NULL;
+  ch->next_points = NULL;
+  ch->next_capacity = 0;
+  return;
+}
+
+// Insert [node] at [index] of [nodes], which holds [len] entries
+void _consistent_hasher_array_insert(ConsistentHasherNode *nodes,
+                                     int len,
+                                     int index,
+                                     ConsistentHasherNode node)
+{
+  for (int i = len; i > index; --i)
+  {
+    nodes[i] = nodes[i - 1];
+  }
+  nodes[index] = node;
+  return;
+}
+
+// Remove the entry at [index] of [nodes], which holds [len] entries
+void _consistent_hasher_array_delete(ConsistentHasherNode *nodes,
+                                     int len,
+                                     int index)
+{
+  for (int i = index; i < len - 1; ++i)
+  {
+    nodes[i] = nodes[i + 1];
+  }
+  return;
+}
+
+// Shrink the allocation of [ch] once it is half empty, or an eighth
+// full for incremental shrinking, far from where growing starts
+void _consistent_hasher_shrink(ConsistentHasher *ch)
+{
+  if (ch->is_static || ch->nodes_len == 0 || ch->next_nodes) return;
+
+  if (ch->nodes_capacity >= CONSISTENT_HASHER_INCREMENTAL_MIN)
+  {
+    if (ch->nodes_len <= ch->nodes_capacity / 8)
+      _consistent_hasher_migrate_start(ch, ch->nodes_capacity / 2);
+    return;
+  }
+  if (ch->nodes_len > ch->nodes_capacity / 2) return;
+
+  // On failure keep the bigger allocation
+  _consistent_hasher_resize(ch, ch->nodes_len);
+  return;
+}
+
+#if defined(__GNUC__)
+  #define _CONSISTENT_HASHER_PREFETCH(addr) __builtin_prefetch(addr)
+#else
+  #define _CONSISTENT_HASHER_PREFETCH(addr)
+#endif
+
+// Fill [positions] and [owners] from index [k], starting from the
+// [i]-th of the [len] sorted [points]
+int _consistent_hasher_eytzinger_fill(const ConsistentHasherNode *points,
+                                      int len,
+                                      unsigned int *positions,
+                                      ConsistentHasherHash *owners,
+                                      int i, int k)
+{
+  if (k > len) return i;
+  
+  i = _consistent_hasher_eytzinger_fill(points, len, positions, owners,
+                                        i, 2 * k);
+  positions[k] = points[i].position;
+  owners[k] = points[i].owner;
+  i++;
+  return _consistent_hasher_eytzinger_fill(points, len, positions, owners,
+                                           i, 2 * k + 1);
+}
+
+// Make sure [*positions] and [*owners] have room for [len] points,
+// reallocating them to [capacity] if not
+ConsistentHasherError
+_consistent_hasher_eytzinger_reserve(unsigned int **positions,
+                                     ConsistentHasherHash **owners,
+                                     int *allocated,
+                                     int len,
+                                     int capacity)
+{
+  if (*allocated >= len + 1) return CONSISTENT_HASHER_OK;
+  if (capacity < len + 1) capacity = len + 1;
+
+  unsigned int *new_positions =
+    CONSISTENT_HASHER_CALLOC(capacity, sizeof(unsigned int));
+  ConsistentHasherHash *new_owners =
+    CONSISTENT_HASHER_CALLOC(capacity, sizeof(ConsistentHasherHash));
+  if (!new_positions || !new_owners)
+  {
+    if (new_positions) CONSISTENT_HASHER_FREE(new_positions);
+    if (new_owners) CONSISTENT_HASHER_FREE(new_owners);
+    return CONSISTENT_HASHER_ERROR_ALLOCATION;
+  }
+
+  if (*positions) CONSISTENT_HASHER_FREE(*positions);
+  if (*owners) CONSISTENT_HASHER_FREE(*owners);
+  *positions = new_positions;
+  *owners = new_owners;
+  *allocated = capacity;
+  return CONSISTENT_HASHER_OK;
+}
+
+ConsistentHasherError _consistent_hasher_eytzinger_build(ConsistentHasher *ch)
+{
+  ConsistentHasherError err =
+    _consistent_hasher_eytzinger_reserve(&ch->eytzinger,
+                                         &ch->eytzinger_owners,
+                                         &ch->eytzinger_capacity,
+                                         ch->nodes_len,
+                                         ch->nodes_capacity + 1);
+  if (err != CONSISTENT_HASHER_OK) return err;
+  
+  _consistent_hasher_eytzinger_fill(ch->nodes, ch->nodes_len, ch->eytzinger,
+                                    ch->eytzinger_owners, 0, 1);
+  if (ch->nodes_len > 0) ch->eytzinger_owners[0] = ch->nodes[0].owner;
+  ch->eytzinger_len = ch->nodes_len;
+  return CONSISTENT_HASHER_OK;
+}
+
+// Remember that (start, end] moved from [old_owner] to [new_owner]
+// for the watchers of [ch]
+void _consistent_hasher_watch_record(ConsistentHasher *ch,
+                                     unsigned int start,
+                                     unsigned int end,
+                                     ConsistentHasherHash old_owner,
+                                     ConsistentHasherHash new_owner)
+{
+  if (!ch->watchers || old_owner == new_owner || ch->changes_lost) return;
+
+  // Extend the last arc when a run of points changes the same way
+  ConsistentHasherArcChange *last =
+    (ch->changes_len) ? &ch->changes[ch->changes_len - 1] : NULL;
+  if (last && last->end == start && last->old_owner == old_owner
+      && last->new_owner == new_owner)
+  {
+    last->end = end;
+    return;
+  }
+
+  if (ch->changes_len == ch->changes_capacity)
+  {
+    int capacity = (ch->changes_capacity)
+      ? 2 * ch->changes_capacity : CONSISTENT_HASHER_INITIAL_CAPACITY;
+    ConsistentHasherArcChange *changes =
+      CONSISTENT_HASHER_CALLOC(capacity, sizeof(ConsistentHasherArcChange));
+    if (!changes)
+    {
+      ch->changes_lost = true;
+      return;
+    }
+    for (int i = 0; i < ch->changes_len; ++i) changes[i] = ch->changes[i];
+    if (ch->changes) CONSISTENT_HASHER_FREE(ch->changes);
+    ch->changes = changes;
+    ch->changes_capacity = capacity;
+  }
+
+  ch->changes[ch->changes_len++] = (ConsistentHasherArcChange) {
+    .start = start,
+    .end = end,
+    .old_owner = old_owner,
+    .new_owner = new_owner,
+  };
+  return;
+}
+
+// Pass the changes recorded since the last call to the watchers of
+// [ch]
+void _consistent_hasher_watch_flush(ConsistentHasher *ch)
+{
+  if (!ch->watchers || (ch->changes_len == 0 && !ch->changes_lost)) return;
+
+  const ConsistentHasherArcChange *changes =
+    (ch->changes_lost) ? NULL : ch->changes;
+  int len = (ch->changes_lost) ? -1 : ch->changes_len;
+  ch->changes_len = 0;
+  ch->changes_lost = false;
+  for (ConsistentHasherWatcher *w = ch->watchers; w; w = w->next)
+    w->callback(ch, changes, len, w->user);
+  return;
+}
+
+// Layout [ch] should use for its current points
+ConsistentHasherLayout _consistent_hasher_pick_layout(ConsistentHasher *ch)
+{
+  ConsistentHasherLayout layout = ch->layout;
+  if (layout == CONSISTENT_HASHER_LAYOUT_AUTO)
+  {
+    if (ch->nodes_len <= CONSISTENT_HASHER_LINEAR_MAX)
+      layout = CONSISTENT_HASHER_LAYOUT_LINEAR;
+    else if (ch->nodes_len < CONSISTENT_HASHER_EYTZINGER_MIN)
+      layout = CONSISTENT_HASHER_LAYOUT_BRANCHLESS;
+    else
+      layout = CONSISTENT_HASHER_LAYOUT_EYTZINGER;
+  }
+  if (layout == CONSISTENT_HASHER_LAYOUT_EYTZINGER && ch->is_static)
+    layout = CONSISTENT_HASHER_LAYOUT_BRANCHLESS;
+
+  if (layout == CONSISTENT_HASHER_LAYOUT_EYTZINGER && ch->memory_budget)
+  {
+    // Count the copy at the size it is built, twice if a spare one is
+    // kept for background rebuilds
+    int capacity = ch->nodes_capacity + 1;
+    if (ch->eytzinger_capacity > capacity) capacity = ch->eytzinger_capacity;
+    size_t bytes = _CONSISTENT_HASHER_ARRAY_BYTES(ch->nodes_capacity)
+      + _CONSISTENT_HASHER_EYTZINGER_BYTES(capacity)
+        * (ch->background_rebuild ? 2 : 1);
+    if (ch->next_nodes) bytes += _CONSISTENT_HASHER_ARRAY_BYTES(ch->next_capacity);
+    if (bytes > ch->memory_budget) layout = CONSISTENT_HASHER_LAYOUT_BRANCHLESS;
+  }
+  return layout;
+}
+
+// Resolve the layout of [ch] for its current points and build the
+// data it needs
+//
+// Unless [fill], the Eytzinger copy of a ring of
+// CONSISTENT_HASHER_INCREMENTAL_MIN capacity or more is only marked
+// stale, as filling it is O(n).
+ConsistentHasherError _consistent_hasher_apply_layout(ConsistentHasher *ch,
+                                                      bool fill)
+{
+  ConsistentHasherLayout layout = _consistent_hasher_pick_layout(ch);
+
+  ConsistentHasherError err = CONSISTENT_HASHER_OK;
+  if (layout == CONSISTENT_HASHER_LAYOUT_EYTZINGER
+      && (ch->background_rebuild
+          || (!fill && ch->nodes_capacity >= CONSISTENT_HASHER_INCREMENTAL_MIN)))
+  {
+    // Leave the copy to consistent_hasher_rebuild. Background rebuilds
+    // keep using the last one meanwhile, other lookups search the
+    // arrays.
+    ch->generation++;
+    if (!ch->background_rebuild || !ch->eytzinger || ch->eytzinger_len == 0)
+      layout = CONSISTENT_HASHER_LAYOUT_BRANCHLESS;
+  }
+  else if (layout == CONSISTENT_HASHER_LAYOUT_EYTZINGER)
+  {
+    err = _consistent_hasher_eytzinger_build(ch);
+    if (err != CONSISTENT_HASHER_OK)
+      layout = CONSISTENT_HASHER_LAYOUT_BRANCHLESS;
+    else
+      ch->built_generation = ch->generation;
+  }
+  else if (ch->eytzinger)
+  {
+    CONSISTENT_HASHER_FREE(ch->eytzinger);
+    CONSISTENT_HASHER_FREE(ch->eytzinger_owners);
+    ch->eytzinger = NULL;
+    ch->eytzinger_owners = NULL;
+    ch->eytzinger_capacity = 0;
+    ch->eytzinger_len = 0;
+  }
+
+  ch->active_layout = layout;
+  _consistent_hasher_watch_flush(ch);
+  return err;
+}
+
+// Resolve the layout of [ch] after a membership change
+ConsistentHasherError _consistent_hasher_update_layout(ConsistentHasher *ch)
+{
+  return _consistent_hasher_apply_layout(ch, false);
+}
+
+ConsistentHasherError
+consistent_hasher_set_layout(ConsistentHasher *ch,
+                             ConsistentHasherLayout layout)
+{
+  if (!ch) return CONSISTENT_HASHER_ERROR_IS_NULL;
+  if (layout >= _CONSISTENT_HASHER_LAYOUT_MAX)
+    layout = CONSISTENT_HASHER_LAYOUT_AUTO;
+
+  ch->layout = layout;
+  return _consistent_hasher_apply_layout(ch, true);
+}
+
+ConsistentHasherLayout consistent_hasher_get_layout(ConsistentHasher *ch)
+{
+  if (!ch) return CONSISTENT_HASHER_LAYOUT_AUTO;
+  return ch->active_layout;
+}
+
+// Index of the first point at or after [position] in [ch], or
+// [ch->nodes_len] if there is none
+int _consistent_hasher_linear_search(ConsistentHasher *ch,
+                                     unsigned int position)
+{
+  // Count instead of breaking out, so that the loop is vectorized
+  int index = 0;
+  for (int i = 0; i < ch->nodes_len; ++i)
+  {
+    index += (ch->nodes[i].position < position);
+  }
+  
+  return index;
+}
+
+// Same as _consistent_hasher_linear_search
+int _consistent_hasher_branchless_search(ConsistentHasher *ch,
+                                         unsigned int position)
+{
+  const ConsistentHasherNode *base = ch->nodes;
+  int len = ch->nodes_len;
+  if (len == 0) return 0;
+  
+  while (len > 1)
+  {
+    int half = len / 2;
+    base = (base[half].position < position) ? base + half : base;
+    len -= half;
+  }
+
+  return (int)(base - ch->nodes) + (base->position < position);
+}
+
+// Owner of the first point at or after [position] in the Eytzinger
+// layout of [ch]
+ConsistentHasherHash _consistent_hasher_eytzinger_search(ConsistentHasher *ch,
+                                                         unsigned int position)
+{
+  const unsigned int *positions = ch->eytzinger;
+  unsigned int len = (unsigned int) ch->eytzinger_len;
+  unsigned int k = 1;
+  
+  while (k <= len)
+  {
+    // Four levels down fit in one cache line
+    _CONSISTENT_HASHER_PREFETCH(positions + 16 * k);
+    k = 2 * k + (positions[k] < position);
+  }
+
+  // Go back up to the last left turn
+#if defined(__GNUC__)
+  k >>= __builtin_ctz(~k) + 1;
+#else
+  while (k & 1) k >>= 1;
+  k >>= 1;
+#endif
+  
+  return ch->eytzinger_owners[k];
+}
+
+ConsistentHasherError
+_consistent_hasher_insert_point(ConsistentHasher *ch,
+                                ConsistentHasherHash node_hash,
+                                ConsistentHasherHash point_hash)
+{
+  ConsistentHasherNode new_node = (ConsistentHasherNode) {
+    .hash = point_hash,
+    .position = _consistent_hasher_position(ch, point_hash),
+    .owner = node_hash,
+  };
+
+  int index;
+  bool found = _consistent_hasher_binary_search(ch, point_hash, &index);
+  if (found) return CONSISTENT_HASHER_ERROR_NODE_PRESENT;
+  
+  // A shrink that would not fit is given up, a growth starts once
+  // the array is half full
+  if (ch->next_nodes && ch->nodes_len == ch->next_capacity)
+    _consistent_hasher_migrate_abort(ch);
+  if (!ch->is_static && !ch->next_nodes
+      && ch->nodes_capacity >= CONSISTENT_HASHER_INCREMENTAL_MIN
+      && ch->nodes_len >= ch->nodes_capacity / 2)
+    _consistent_hasher_migrate_start(ch, 2 * ch->nodes_capacity);
+  
+  if (ch->nodes_capacity == ch->nodes_len)
+  {
+    if (ch->is_static) return CONSISTENT_HASHER_ERROR_FULL;
+
+    if (ch->next_nodes)
+      _consistent_hasher_migrate_step(ch, ch->nodes_len);
+    else
+    {
+      int new_capacity = (ch->nodes_capacity)
+        ? ch->nodes_capacity * 2 : CONSISTENT_HASHER_INITIAL_CAPACITY;
+      if (ch->memory_budget)
+      {
+        int max = _consistent_hasher_budget_capacity(ch->memory_budget);
+        if (new_capacity > max) new_capacity = max;
+        if (new_capacity <= ch->nodes_capacity)
+          return CONSISTENT_HASHER_ERROR_FULL;
+      }
+      ConsistentHasherError err = _consistent_hasher_resize(ch, new_capacity);
+      if (err != CONSISTENT_HASHER_OK) return err;
+    }
+  }
+
+  // Entries already copied to the next arrays are changed there too
+  _consistent_hasher_array_insert(ch->nodes, ch->nodes_len, index, new_node);
+  if (ch->next_nodes && index < ch->migrated_nodes)
+    _consistent_hasher_array_insert(ch->next_nodes, ch->migrated_nodes++,
+                                    index, new_node);
+
+  _consistent_hasher_points_search(ch, node_hash, new_node.position, &index);
+  _consistent_hasher_array_insert(ch->points, ch->nodes_len, index, new_node);
+  if (ch->next_nodes && index < ch->migrated_points)
+    _consistent_hasher_array_insert(ch->next_points, ch->migrated_points++,
+                                    index, new_node);
+  ch->nodes_len += 1;
+  _consistent_hasher_migrate_step(ch, _CONSISTENT_HASHER_MIGRATE_STEP);
+
+  // The new point takes the arc from its predecessor over from its
+  // successor
+  if (ch->watchers && ch->nodes_len > 1)
+  {
+    int len = ch->nodes_len;
+    _consistent_hasher_binary_search(ch, point_hash, &index);
+    _consistent_hasher_watch_record(ch,
+      ch->nodes[(index + len - 1) % len].position, new_node.position,
+      ch->nodes[(index + 1) % len].owner, node_hash);
+  }
+  
+  _CONSISTENT_HASHER_TRACE_RECORD(ch, CONSISTENT_HASHER_TRACE_INSERT,
+                                  point_hash, node_hash);
+  return CONSISTENT_HASHER_OK;
+}
+
+ConsistentHasherError
+consistent_hasher_insert_point(ConsistentHasher *ch,
+                               ConsistentHasherHash node_hash,
+                               ConsistentHasherHash point_hash)
+{
+  if (!ch) return CONSISTENT_HASHER_ERROR_IS_NULL;
+
+  ConsistentHasherError err =
+    _consistent_hasher_insert_point(ch, node_hash, point_hash);
+  if (err == CONSISTENT_HASHER_OK) _consistent_hasher_update_layout(ch);
+  
+  return err;
+}
+
+ConsistentHasherError
+consistent_hasher_insert_node(ConsistentHasher *ch,
+                              ConsistentHasherHash node_hash)
+{
+  return consistent_hasher_insert_point(ch, node_hash, node_hash);
+}
+
+// Remove the point with [node_hash] from [ch]
+//
+// Returns: false if there is none, which leaves [ch] untouched
+bool _consistent_hasher_delete_node(ConsistentHasher *ch,
+                                    ConsistentHasherHash node_hash)
+{
+  int index;
+  bool found = _consistent_hasher_binary_search(ch, node_hash, &index);
+  if (!found) return false;
+
+  ConsistentHasherNode node = ch->nodes[index];
+  if (ch->watchers && ch->nodes_len > 1)
+  {
+    // The successor takes the arc of the point over
+    int len = ch->nodes_len;
+    _consistent_hasher_watch_record(ch,
+      ch->nodes[(index + len - 1) % len].position, node.position,
+      node.owner, ch->nodes[(index + 1) % len].owner);
+  }
+  _consistent_hasher_array_delete(ch->nodes, ch->nodes_len, index);
+  if (ch->next_nodes && index < ch->migrated_nodes)
+    _consistent_hasher_array_delete(ch->next_nodes, ch->migrated_nodes--,
+                                    index);
+  
+  _consistent_hasher_points_search(ch, node.owner, node.position, &index);
+  _consistent_hasher_array_delete(ch->points, ch->nodes_len, index);
+  if (ch->next_nodes && index < ch->migrated_points)
+    _consistent_hasher_array_delete(ch->next_points, ch->migrated_points--,
+                                    index);
+  ch->nodes_len = ch->nodes_len - 1;
+  _consistent_hasher_migrate_step(ch, _CONSISTENT_HASHER_MIGRATE_STEP);
+  _consistent_hasher_shrink(ch);
+  
+  _CONSISTENT_HASHER_TRACE_RECORD(ch, CONSISTENT_HASHER_TRACE_DELETE,
+                                  node_hash, node_hash);
+  return true;
+}
+
+ConsistentHasherError
+consistent_hasher_delete_node(ConsistentHasher *ch,
+                              ConsistentHasherHash node_hash)
+{
+  if (!ch) return CONSISTENT_HASHER_ERROR_IS_NULL;
+
+  if (_consistent_hasher_delete_node(ch, node_hash))
+    _consistent_hasher_update_layout(ch);
+  
+  return CONSISTENT_HASHER_OK;
+}
+
+const ConsistentHasherNode *
+consistent_hasher_points_of(ConsistentHasher *ch,
+                            ConsistentHasherHash node_hash,
+                            int *len)
+{
+  if (!ch || !len) return NULL;
+  
+  int first;
+  _consistent_hasher_points_search(ch, node_hash, 0, &first);
+  int last = first;
+  while (last < ch->nodes_len && ch->points[last].owner == node_hash)
+    last++;
+
+  *len = last - first;
+  return (last > first) ? &ch->points[first] : NULL;
+}
+
+// Index of the point at [position] among the [len] [points] of one
+// node, sorted by position, or [len] if there is none
+int _consistent_hasher_run_search(const ConsistentHasherNode *points,
+                                  int len,
+                                  unsigned int position)
+{
+  int start = 0;
+  int end = len;
+  
+  while (start < end)
+  {
+    int mid = (end - start) / 2 + start;
+    if (points[mid].position < position)
+      start = mid + 1;
+    else
+      end = mid;
+  }
+
+  return (start < len && points[start].position == position) ? start : len;
+}
+
+// True if the [index]-th point of [ch] is one of the [len] points of
+// [node_hash] at [run] that are not marked to be kept
+bool _consistent_hasher_unmarked(ConsistentHasher *ch,
+                                 int index,
+                                 ConsistentHasherHash node_hash,
+                                 const ConsistentHasherNode *run,
+                                 int len,
+                                 int kept)
+{
+  ConsistentHasherNode *node = &ch->nodes[index];
+  if (node->owner != node_hash) return false;
+  if (kept == 0) return true;
+  
+  return run[_consistent_hasher_run_search(run, len, node->position)].owner
+    == node_hash;
+}
+
+// Remove the [len] points of [node_hash] starting at [first] in the
+// points of [ch], but the [kept] ones marked with another owner,
+// which is restored
+//
+// Both arrays are compacted in a single pass, in O(n + len log len).
+void _consistent_hasher_delete_unmarked(ConsistentHasher *ch,
+                                        ConsistentHasherHash node_hash,
+                                        int first,
+                                        int len,
+                                        int kept)
+{
+  // Removing many points moves most of the array, start over
+  _consistent_hasher_migrate_abort(ch);
+
+  ConsistentHasherNode *run = &ch->points[first];
+  int removed = len - kept;
+  if (ch->watchers && removed < ch->nodes_len)
+  {
+    // Each run of removed points goes to the owner of the point after
+    // it, walk the ring once from a point left
+    int n = ch->nodes_len;
+    int start = 0;
+    while (_consistent_hasher_unmarked(ch, start, node_hash, run, len, kept))
+      start++;
+    for (int i = 1; i < n; ++i)
+    {
+      if (!_consistent_hasher_unmarked(ch, (start + i) % n, node_hash,
+                                       run, len, kept))
+        continue;
+
+      int end = i;
+      while (_consistent_hasher_unmarked(ch, (start + end) % n, node_hash,
+                                         run, len, kept))
+        end++;
+      _consistent_hasher_watch_record(ch,
+        ch->nodes[(start + i - 1) % n].position,
+        ch->nodes[(start + end - 1) % n].position,
+        node_hash, ch->nodes[(start + end) % n].owner);
+      i = end;
+    }
+  }
+  
+  // Points are sorted by position, so only the ring after the first
+  // one needs to be compacted
+  int index;
+  _consistent_hasher_binary_search(ch, run[0].hash, &index);
+  int write = index;
+  for (int read = index; read < ch->nodes_len; ++read)
+  {
+    if (_consistent_hasher_unmarked(ch, read, node_hash, run, len, kept))
+      continue;
+    ch->nodes[write++] = ch->nodes[read];
+  }
+
+  write = first;
+  for (int read = first; read < first + len; ++read)
+  {
+    ConsistentHasherNode point = ch->points[read];
+    if (point.owner == node_hash)
+    {
+      _CONSISTENT_HASHER_TRACE_RECORD(ch, CONSISTENT_HASHER_TRACE_DELETE,
+                                      point.hash, node_hash);
+      continue;
+    }
+    point.owner = node_hash;
+    ch->points[write++] = point;
+  }
+  for (int read = first + len; read < ch->nodes_len; ++read)
+  {
+    ch->points[write++] = ch->points[read];
+  }
+  ch->nodes_len -= removed;
+  _consistent_hasher_shrink(ch);
+  return;
+}
+
+ConsistentHasherError
+consistent_hasher_delete_points_of(ConsistentHasher *ch,
+                                   ConsistentHasherHash node_hash)
+{
+  if (!ch) return CONSISTENT_HASHER_ERROR_IS_NULL;
+
+  int len;
+  const ConsistentHasherNode *points =
+    consistent_hasher_points_of(ch, node_hash, &len);
+  if (!points) return CONSISTENT_HASHER_OK;
+
+  _consistent_hasher_delete_unmarked(ch, node_hash,
+                                     (int)(points - ch->points), len, 0);
+  _consistent_hasher_update_layout(ch);
+  
+  return CONSISTENT_HASHER_OK;
+}
+
+ConsistentHasherError
+_consistent_hasher_set_node_weight(ConsistentHasher *ch,
+                                   ConsistentHasherHash node_hash,
+                                   int weight)
+{
+  if (weight < 0) weight = 0;
+
+  int count;
+  const ConsistentHasherNode *points =
+    consistent_hasher_points_of(ch, node_hash, &count);
+
+  // Some derived points may collide with other nodes, allow for a
+  // few more attempts than needed
+  unsigned int limit = 2 * (unsigned int)((weight > count) ? weight : count) + 64;
+  
+  if (count < weight)
+  {
+    for (unsigned int i = 0; count < weight && i < limit; ++i)
+    {
+      ConsistentHasherError err =
+        _consistent_hasher_insert_point(ch, node_hash,
+                            consistent_hasher_point_hash(node_hash, i));
+      if (err == CONSISTENT_HASHER_OK) count++;
+      else if (err != CONSISTENT_HASHER_ERROR_NODE_PRESENT) return err;
+    }
+    return (count == weight) ? CONSISTENT_HASHER_OK
+                             : CONSISTENT_HASHER_ERROR_NODE_PRESENT;
+  }
+  if (count == weight) return CONSISTENT_HASHER_OK;
+
+  // Keep the first [weight] derived points, so that shrinking and
+  // growing back restores the same points. They are marked with
+  // another owner until the others are removed.
+  int first = (int)(points - ch->points);
+  ConsistentHasherNode *run = &ch->points[first];
+  ConsistentHasherHash mark = ~node_hash;
+  int kept = 0;
+  for (unsigned int i = 0; kept < weight && i < limit; ++i)
+  {
+    ConsistentHasherHash point_hash =
+      consistent_hasher_point_hash(node_hash, i);
+    int index = _consistent_hasher_run_search(run, count,
+                  _consistent_hasher_position(ch, point_hash));
+    if (index == count || run[index].hash != point_hash
+        || run[index].owner == mark)
+      continue;
+    
+    run[index].owner = mark;
+    kept++;
+  }
+
+  // Points not derived from [node_hash] go last, the lowest positions
+  // are kept
+  for (int i = 0; kept < weight && i < count; ++i)
+  {
+    if (run[i].owner == mark) continue;
+    run[i].owner = mark;
+    kept++;
+  }
+
+  _consistent_hasher_delete_unmarked(ch, node_hash, first, count, kept);
+  return CONSISTENT_HASHER_OK;
+}
+
+ConsistentHasherError
+consistent_hasher_set_node_weight(ConsistentHasher *ch,
+                                  ConsistentHasherHash node_hash,
+                                  int weight)
+{
+  if (!ch) return CONSISTENT_HASHER_ERROR_IS_NULL;
+
+  // Pick the layout once for all the points, if any changed
+  int len = ch->nodes_len;
+  ConsistentHasherError err =
+    _consistent_hasher_set_node_weight(ch, node_hash, weight);
+  if (ch->nodes_len != len) _consistent_hasher_update_layout(ch);
+
+  return err;
+}
+
+unsigned int consistent_hasher_node_load(ConsistentHasher *ch,
+                                         ConsistentHasherHash node_hash)
+{
+  if (!ch) return 0;
+
+  int len;
+  const ConsistentHasherNode *points =
+    consistent_hasher_points_of(ch, node_hash, &len);
+
+  unsigned int load = 0;
+  for (int i = 0; i < len; ++i)
+  {
+    int index;
+    _consistent_hasher_binary_search(ch, points[i].hash, &index);
+    if (index > 0)
+      load += points[i].position - ch->nodes[index - 1].position;
+    else
+      load += points[i].position + ch->ring_size
+        - ch->nodes[ch->nodes_len - 1].position;
+  }
+
+  return load;
+}
+
+ConsistentHasherHash
+consistent_hasher_get_node_of(ConsistentHasher *ch,
+                              ConsistentHasherHash item_hash)
+{
+  _CONSISTENT_HASHER_TRACE_RECORD(ch, CONSISTENT_HASHER_TRACE_LOOKUP,
+                                  item_hash, 0);
+  
+  ConsistentHasherHash node_hash;
+  if (ch->overrides
+      && consistent_hasher_overrides_find(ch->overrides, item_hash, &node_hash))
+    return node_hash;
+  
+  unsigned int position = _consistent_hasher_position(ch, item_hash);
+  int index;
+  switch (ch->active_layout)
+  {
+  case CONSISTENT_HASHER_LAYOUT_LINEAR:
+    index = _consistent_hasher_linear_search(ch, position);
+    break;
+  case CONSISTENT_HASHER_LAYOUT_BRANCHLESS:
+    index = _consistent_hasher_branchless_search(ch, position);
+    break;
+  case CONSISTENT_HASHER_LAYOUT_EYTZINGER:
+    return _consistent_hasher_eytzinger_search(ch, position);
+  default:
+    _consistent_hasher_binary_search(ch, item_hash, &index);
+    break;
+  }
+  if (index == ch->nodes_len)
+    index = 0;
+  
+  return ch->nodes[index].owner;
+}
+
+#define _CONSISTENT_HASHER_ROTL(x, b) (((x) << (b)) | ((x) >> (64 - (b))))
+
+#define _CONSISTENT_HASHER_SIPROUND(v0, v1, v2, v3) \
+  do {                                              \
+    v0 += v1; v1 = _CONSISTENT_HASHER_ROTL(v1, 13); \
+    v1 ^= v0; v0 = _CONSISTENT_HASHER_ROTL(v0, 32); \
+    v2 += v3; v3 = _CONSISTENT_HASHER_ROTL(v3, 16); \
+    v3 ^= v2;                                       \
+    v0 += v3; v3 = _CONSISTENT_HASHER_ROTL(v3, 21); \
+    v3 ^= v0;                                       \
+    v2 += v1; v1 = _CONSISTENT_HASHER_ROTL(v1, 17); \
+    v1 ^= v2; v2 = _CONSISTENT_HASHER_ROTL(v2, 32); \
+  } while (0)
+
+uint64_t _consistent_hasher_load64_le(const unsigned char *p)
+{
+  return (uint64_t) p[0]         | ((uint64_t) p[1] << 8)
+       | ((uint64_t) p[2] << 16) | ((uint64_t) p[3] << 24)
+       | ((uint64_t) p[4] << 32) | ((uint64_t) p[5] << 40)
+       | ((uint64_t) p[6] << 48) | ((uint64_t) p[7] << 56);
+}
+
+void consistent_hasher_set_seed(ConsistentHasher *ch,
+                                uint64_t k0,
+                                uint64_t k1)
+{
+  if (!ch) return;
+
+  // Keep the initial state rather than the key, it is the same for
+  // every hash
+  ch->key = (ConsistentHasherKey) {
+    .v0 = k0 ^ 0x736f6d6570736575ULL,
+    .v1 = k1 ^ 0x646f72616e646f6dULL,
+    .v2 = k0 ^ 0x6c7967656e657261ULL,
+    .v3 = k1 ^ 0x7465646279746573ULL,
+  };
+  
+  return;
+}
+
+uint64_t consistent_hasher_siphash(const ConsistentHasherKey *key,
+                                   const void *data,
+                                   size_t len)
+{
+  const unsigned char *in = data;
+  uint64_t v0 = key->v0, v1 = key->v1, v2 = key->v2, v3 = key->v3;
+  
+  const unsigned char *end = in + len - (len % 8);
+  for (; in != end; in += 8)
+  {
+    uint64_t m = _consistent_hasher_load64_le(in);
+    v3 ^= m;
+    _CONSISTENT_HASHER_SIPROUND(v0, v1, v2, v3);
+    _CONSISTENT_HASHER_SIPROUND(v0, v1, v2, v3);
+    v0 ^= m;
+  }
+
+  uint64_t b = ((uint64_t) len) << 56;
+  switch (len & 7)
+  {
+  case 7: b |= ((uint64_t) in[6]) << 48; // fall through
+  case 6: b |= ((uint64_t) in[5]) << 40; // fall through
+  case 5: b |= ((uint64_t) in[4]) << 32; // fall through
+  case 4: b |= ((uint64_t) in[3]) << 24; // fall through
+  case 3: b |= ((uint64_t) in[2]) << 16; // fall through
+  case 2: b |= ((uint64_t) in[1]) << 8;  // fall through
+  case 1: b |= ((uint64_t) in[0]);       break;
+  case 0: break;
+  }
+
+  v3 ^= b;
+  _CONSISTENT_HASHER_SIPROUND(v0, v1, v2, v3);
+  _CONSISTENT_HASHER_SIPROUND(v0, v1, v2, v3);
+  v0 ^= b;
+
+  v2 ^= 0xff;
+  _CONSISTENT_HASHER_SIPROUND(v0, v1, v2, v3);
+  _CONSISTENT_HASHER_SIPROUND(v0, v1, v2, v3);
+  _CONSISTENT_HASHER_SIPROUND(v0, v1, v2, v3);
+  _CONSISTENT_HASHER_SIPROUND(v0, v1, v2, v3);
+  
+  return v0 ^ v1 ^ v2 ^ v3;
+}
+
+uint64_t consistent_hasher_siphash_u64(const ConsistentHasherKey *key,
+                                       uint64_t value)
+{
+  uint64_t v0 = key->v0, v1 = key->v1, v2 = key->v2, v3 = key->v3;
+  const uint64_t b = ((uint64_t) 8) << 56;
+
+  v3 ^= value;
+  _CONSISTENT_HASHER_SIPROUND(v0, v1, v2, v3);
+  _CONSISTENT_HASHER_SIPROUND(v0, v1, v2, v3);
+  v0 ^= value;
+  
+  v3 ^= b;
+  _CONSISTENT_HASHER_SIPROUND(v0, v1, v2, v3);
+  _CONSISTENT_HASHER_SIPROUND(v0, v1, v2, v3);
+  v0 ^= b;
+
+  v2 ^= 0xff;
+  _CONSISTENT_HASHER_SIPROUND(v0, v1, v2, v3);
+  _CONSISTENT_HASHER_SIPROUND(v0, v1, v2, v3);
+  _CONSISTENT_HASHER_SIPROUND(v0, v1, v2, v3);
+  _CONSISTENT_HASHER_SIPROUND(v0, v1, v2, v3);
+  
+  return v0 ^ v1 ^ v2 ^ v3;
+}
+
+void consistent_hasher_siphash_u64_batch(const ConsistentHasherKey *key,
+                                         const uint64_t *values,
+                                         int n,
+                                         uint64_t *out)
+{
+  if (!key || !values || !out) return;
+  
+  const uint64_t b = ((uint64_t) 8) << 56;
+  int i = 0;
+
+  // The rounds of one hash depend on each other, four independent
+  // hashes keep the execution units busy
+  for (; i + 4 <= n; i += 4)
+  {
+    uint64_t v0[4], v1[4], v2[4], v3[4];
+    for (int j = 0; j < 4; ++j)
+    {
+      v0[j] = key->v0; v1[j] = key->v1;
+      v2[j] = key->v2; v3[j] = key->v3 ^ values[i + j];
+    }
+    for (int j = 0; j < 4; ++j)
+    {
+      _CONSISTENT_HASHER_SIPROUND(v0[j], v1[j], v2[j], v3[j]);
+      _CONSISTENT_HASHER_SIPROUND(v0[j], v1[j], v2[j], v3[j]);
+      v0[j] ^= values[i + j];
+      v3[j] ^= b;
+      _CONSISTENT_HASHER_SIPROUND(v0[j], v1[j], v2[j], v3[j]);
+      _CONSISTENT_HASHER_SIPROUND(v0[j], v1[j], v2[j], v3[j]);
+      v0[j] ^= b;
+      v2[j] ^= 0xff;
+      _CONSISTENT_HASHER_SIPROUND(v0[j], v1[j], v2[j], v3[j]);
+      _CONSISTENT_HASHER_SIPROUND(v0[j], v1[j], v2[j], v3[j]);
+      _CONSISTENT_HASHER_SIPROUND(v0[j], v1[j], v2[j], v3[j]);
+      _CONSISTENT_HASHER_SIPROUND(v0[j], v1[j], v2[j], v3[j]);
+    }
+    for (int j = 0; j < 4; ++j)
+      out[i + j] = v0[j] ^ v1[j] ^ v2[j] ^ v3[j];
+  }
+
+  for (; i < n; ++i)
+    out[i] = consistent_hasher_siphash_u64(key, values[i]);
+  
+  return;
+}
+
+ConsistentHasherHash consistent_hasher_hash_key(ConsistentHasher *ch,
+                                                const void *key,
+                                                size_t len)
+{
+  if (!ch || !key) return 0;
+  return (ConsistentHasherHash) consistent_hasher_siphash(&ch->key, key, len);
+}
+
+void consistent_hasher_hash_keys(ConsistentHasher *ch,
+                                 const void *const *keys,
+                                 const size_t *lens,
+                                 int n,
+                                 ConsistentHasherHash *out)
+{
+  if (!ch || !keys || !lens || !out) return;
+
+  for (int i = 0; i < n; ++i)
+  {
+    // Fetch the next key while hashing this one
+    if (i + 1 < n) _CONSISTENT_HASHER_PREFETCH(keys[i + 1]);
+    out[i] = (ConsistentHasherHash)
+      consistent_hasher_siphash(&ch->key, keys[i], lens[i]);
+  }
+  
+  return;
+}
+
+ConsistentHasherHash
+consistent_hasher_get_node_of_key(ConsistentHasher *ch,
+                                  const void *key,
+                                  size_t len)
+{
+  return consistent_hasher_get_node_of(ch,
+                                       consistent_hasher_hash_key(ch, key, len));
+}
+
+// Find the first [c] in the [len] bytes at [p], or NULL
+const unsigned char *_consistent_hasher_find_byte(const unsigned char *p,
+                                                  size_t len,
+                                                  unsigned char c)
+{
+  size_t i = 0;
+#if defined(__SSE2__) && defined(__GNUC__)
+  // Compare 16 bytes at a time, keys are usually short
+  __m128i needle = _mm_set1_epi8((char) c);
+  for (; i + 16 <= len; i += 16)
+  {
+    __m128i chunk = _mm_loadu_si128((const __m128i*) (p + i));
+    int mask = _mm_movemask_epi8(_mm_cmpeq_epi8(chunk, needle));
+    if (mask) return p + i + __builtin_ctz(mask);
+  }
+#endif
+  for (; i < len; ++i)
+    if (p[i] == c) return p + i;
+
+  return NULL;
+}
+
+const void *consistent_hasher_hash_tag(const void *key,
+                                       size_t len,
+                                       size_t *tag_len)
+{
+  const unsigned char *bytes = key;
+  const unsigned char *open = (bytes)
+    ? _consistent_hasher_find_byte(bytes, len, '{') : NULL;
+  if (open)
+  {
+    size_t rest = len - (size_t)(open - bytes) - 1;
+    const unsigned char *close =
+      _consistent_hasher_find_byte(open + 1, rest, '}');
+    if (close && close > open + 1)
+    {
+      if (tag_len) *tag_len = (size_t)(close - open) - 1;
+      return open + 1;
+    }
+  }
+
+  if (tag_len) *tag_len = len;
+  return key;
+}
+
+ConsistentHasherHash consistent_hasher_hash_tagged_key(ConsistentHasher *ch,
+                                                       const void *key,
+                                                       size_t len)
+{
+  size_t tag_len;
+  const void *tag = consistent_hasher_hash_tag(key, len, &tag_len);
+  return consistent_hasher_hash_key(ch, tag, tag_len);
+}
+
+ConsistentHasherHash
+consistent_hasher_get_node_of_tagged_key(ConsistentHasher *ch,
+                                         const void *key,
+                                         size_t len)
+{
+  return consistent_hasher_get_node_of(ch,
+                  consistent_hasher_hash_tagged_key(ch, key, len));
+}
+
+#define _CONSISTENT_HASHER_LOAD(ptr, order) __atomic_load_n((ptr), (order))
+#define _CONSISTENT_HASHER_STORE(ptr, val, order) \
+  __atomic_store_n((ptr), (val), (order))
+#define _CONSISTENT_HASHER_FETCH_ADD(ptr, val, order) \
+  __atomic_fetch_add((ptr), (val), (order))
+#define _CONSISTENT_HASHER_FETCH_SUB(ptr, val, order) \
+  __atomic_fetch_sub((ptr), (val), (order))
+#define _CONSISTENT_HASHER_CAS(ptr, expected, desired, order) \
+  __atomic_compare_exchange_n((ptr), (expected), (desired), false, \
+                              (order), __ATOMIC_RELAXED)
+
+#if defined(__x86_64__) || defined(__i386__)
+  #define _CONSISTENT_HASHER_PAUSE() __builtin_ia32_pause()
+#else
+  #define _CONSISTENT_HASHER_PAUSE()
+#endif
+
+// Wait a bit before checking a lock again. The holder may have been
+// preempted, so give up the CPU after a few attempts.
+void _consistent_hasher_spin(unsigned int *spins)
+{
+  if (++(*spins) < 64)
+  {
+    _CONSISTENT_HASHER_PAUSE();
+    return;
+  }
+  
+  *spins = 0;
+  CONSISTENT_HASHER_YIELD();
+  return;
+}
+
+void consistent_hasher_rwlock_read_lock(ConsistentHasherRwLock *lock)
+{
+  unsigned int spins = 0;
+  for (;;)
+  {
+    while (_CONSISTENT_HASHER_LOAD(&lock->writer, __ATOMIC_SEQ_CST))
+      _consistent_hasher_spin(&spins);
+
+    _CONSISTENT_HASHER_FETCH_ADD(&lock->readers, 1, __ATOMIC_SEQ_CST);
+    if (!_CONSISTENT_HASHER_LOAD(&lock->writer, __ATOMIC_SEQ_CST)) break;
+
+    // A writer came in between, let it go first
+    _CONSISTENT_HASHER_FETCH_SUB(&lock->readers, 1, __ATOMIC_SEQ_CST);
+  }
+  
+  return;
+}
+
+void consistent_hasher_rwlock_read_unlock(ConsistentHasherRwLock *lock)
+{
+  _CONSISTENT_HASHER_FETCH_SUB(&lock->readers, 1, __ATOMIC_RELEASE);
+  return;
+}
+
+void consistent_hasher_rwlock_write_lock(ConsistentHasherRwLock *lock)
+{
+  unsigned int spins = 0;
+  unsigned int expected = 0;
+  while (!_CONSISTENT_HASHER_CAS(&lock->writer, &expected, 1,
+                                 __ATOMIC_SEQ_CST))
+  {
+    expected = 0;
+    _consistent_hasher_spin(&spins);
+  }
+  
+  while (_CONSISTENT_HASHER_LOAD(&lock->readers, __ATOMIC_SEQ_CST))
+    _consistent_hasher_spin(&spins);
+  
+  return;
+}
+
+void consistent_hasher_rwlock_write_unlock(ConsistentHasherRwLock *lock)
+{
+  _CONSISTENT_HASHER_STORE(&lock->writer, 0, __ATOMIC_RELEASE);
+  return;
+}
+
+// Sequence locks: writers make [version] odd while they change the
+// data it protects, readers retry if [version] changed under them
+
+// Returns: the version to pass to _consistent_hasher_seqlock_retry
+uint32_t _consistent_hasher_seqlock_begin(uint32_t *version)
+{
+  unsigned int spins = 0;
+  for (;;)
+  {
+    uint32_t current = _CONSISTENT_HASHER_LOAD(version, __ATOMIC_ACQUIRE);
+    if (!(current & 1)) return current;
+    _consistent_hasher_spin(&spins);
+  }
+}
+
+// Returns: true if the data read since
+// _consistent_hasher_seqlock_begin returned [start] may be torn
+bool _consistent_hasher_seqlock_retry(uint32_t *version, uint32_t start)
+{
+  __atomic_thread_fence(__ATOMIC_ACQUIRE);
+  return _CONSISTENT_HASHER_LOAD(version, __ATOMIC_RELAXED) != start;
+}
+
+void _consistent_hasher_seqlock_lock(uint32_t *version)
+{
+  unsigned int spins = 0;
+  for (;;)
+  {
+    uint32_t current = _CONSISTENT_HASHER_LOAD(version, __ATOMIC_RELAXED);
+    if (!(current & 1)
+        && _CONSISTENT_HASHER_CAS(version, &current, current + 1,
+                                  __ATOMIC_ACQUIRE))
+      break;
+    _consistent_hasher_spin(&spins);
+  }
+  // The data must not be written before the version is odd
+  __atomic_thread_fence(__ATOMIC_RELEASE);
+  
+  return;
+}
+
+void _consistent_hasher_seqlock_unlock(uint32_t *version)
+{
+  _CONSISTENT_HASHER_FETCH_ADD(version, 1, __ATOMIC_RELEASE);
+  return;
+}
+
+ConsistentHasherError
+consistent_hasher_queue_init(ConsistentHasherQueue *queue,
+                             size_t capacity)
+{
+  if (!queue) return CONSISTENT_HASHER_ERROR_IS_NULL;
+
+  size_t size = 1;
+  while (size < capacity) size *= 2;
+
+  *queue = (ConsistentHasherQueue) {
+    .sequences = CONSISTENT_HASHER_CALLOC(size, sizeof(size_t)),
+    .items = CONSISTENT_HASHER_CALLOC(size, sizeof(void*)),
+    .mask = size - 1,
+    .head = 0,
+    .tail = 0,
+  };
+  if (!queue->sequences || !queue->items)
+  {
+    consistent_hasher_queue_destroy(queue);
+    return CONSISTENT_HASHER_ERROR_ALLOCATION;
+  }
+
+  for (size_t i = 0; i < size; ++i)
+    queue->sequences[i] = i;
+  
+  return CONSISTENT_HASHER_OK;
+}
+
+void consistent_hasher_queue_destroy(ConsistentHasherQueue *queue)
+{
+  if (!queue) return;
+  
+  if (queue->sequences) CONSISTENT_HASHER_FREE(queue->sequences);
+  if (queue->items) CONSISTENT_HASHER_FREE(queue->items);
+  queue->sequences = NULL;
+  queue->items = NULL;
+  
+  return;
+}
+
+ConsistentHasherError
+consistent_hasher_queue_push(ConsistentHasherQueue *queue,
+                             void *item)
+{
+  size_t position = _CONSISTENT_HASHER_LOAD(&queue->head, __ATOMIC_RELAXED);
+  for (;;)
+  {
+    size_t sequence =
+      _CONSISTENT_HASHER_LOAD(&queue->sequences[position & queue->mask],
+                              __ATOMIC_ACQUIRE);
+    intptr_t diff = (intptr_t) sequence - (intptr_t) position;
+    
+    if (diff == 0)
+    {
+      // The slot is free, claim it
+      if (_CONSISTENT_HASHER_CAS(&queue->head, &position, position + 1,
+                                 __ATOMIC_RELAXED))
+        break;
+    }
+    else if (diff < 0)
+    {
+      // The consumer did not free the slot yet
+      return CONSISTENT_HASHER_ERROR_FULL;
+    }
+    else
+    {
+      position = _CONSISTENT_HASHER_LOAD(&queue->head, __ATOMIC_RELAXED);
+    }
+  }
+
+  queue->items[position & queue->mask] = item;
+  _CONSISTENT_HASHER_STORE(&queue->sequences[position & queue->mask],
+                           position + 1, __ATOMIC_RELEASE);
+  
+  return CONSISTENT_HASHER_OK;
+}
+
+bool consistent_hasher_queue_pop(ConsistentHasherQueue *queue,
+                                 void **item)
+{
+  size_t position = queue->tail;
+  size_t sequence =
+    _CONSISTENT_HASHER_LOAD(&queue->sequences[position & queue->mask],
+                            __ATOMIC_ACQUIRE);
+  if (sequence != position + 1) return false;
+
+  *item = queue->items[position & queue->mask];
+  _CONSISTENT_HASHER_STORE(&queue->sequences[position & queue->mask],
+                           position + queue->mask + 1, __ATOMIC_RELEASE);
+  queue->tail = position + 1;
+  
+  return true;
+}
+
+ConsistentHasherError
+consistent_hasher_dispatcher_init(ConsistentHasherDispatcher *d,
+                                  int max_cores,
+                                  size_t queue_capacity,
+                                  int points_per_core)
+{
+  if (!d) return CONSISTENT_HASHER_ERROR_IS_NULL;
+  if (max_cores <= 0) return CONSISTENT_HASHER_ERROR_INVALID;
+
+  *d = (ConsistentHasherDispatcher) {
+    .lock = { .readers = 0, .writer = 0 },
+    .queues = CONSISTENT_HASHER_CALLOC(max_cores,
+                                       sizeof(ConsistentHasherQueue)),
+    .max_cores = max_cores,
+    .points_per_core = (points_per_core > 0) ? points_per_core : 1,
+  };
+  consistent_hasher_init(&d->ring, UINT32_MAX);
+  if (!d->queues) return CONSISTENT_HASHER_ERROR_ALLOCATION;
+
+  for (int i = 0; i < max_cores; ++i)
+  {
+    ConsistentHasherError err =
+      consistent_hasher_queue_init(&d->queues[i], queue_capacity);
+    if (err != CONSISTENT_HASHER_OK)
+    {
+      consistent_hasher_dispatcher_destroy(d);
+      return err;
+    }
+  }
+  
+  return CONSISTENT_HASHER_OK;
+}
+
+void consistent_hasher_dispatcher_destroy(ConsistentHasherDispatcher *d)
+{
+  if (!d) return;
+
+  if (d->queues)
+  {
+    for (int i = 0; i < d->max_cores; ++i)
+      consistent_hasher_queue_destroy(&d->queues[i]);
+    CONSISTENT_HASHER_FREE(d->queues);
+  }
+  d->queues = NULL;
+  consistent_hasher_destroy(&d->ring);
+  
+  return;
+}
+
+ConsistentHasherError
+consistent_hasher_dispatcher_add_core(ConsistentHasherDispatcher *d,
+                                      int core)
+{
+  if (!d) return CONSISTENT_HASHER_ERROR_IS_NULL;
+  if (core < 0 || core >= d->max_cores) return CONSISTENT_HASHER_ERROR_INVALID;
+
+  consistent_hasher_rwlock_write_lock(&d->lock);
+  ConsistentHasherError err =
+    consistent_hasher_set_node_weight(&d->ring, (ConsistentHasherHash) core,
+                                      d->points_per_core);
+  consistent_hasher_rwlock_write_unlock(&d->lock);
+
+  return err;
+}
+
+ConsistentHasherError
+consistent_hasher_dispatcher_remove_core(ConsistentHasherDispatcher *d,
+                                         int core)
+{
+  if (!d) return CONSISTENT_HASHER_ERROR_IS_NULL;
+  if (core < 0 || core >= d->max_cores) return CONSISTENT_HASHER_ERROR_INVALID;
+
+  consistent_hasher_rwlock_write_lock(&d->lock);
+  ConsistentHasherError err =
+    consistent_hasher_delete_points_of(&d->ring, (ConsistentHasherHash) core);
+  consistent_hasher_rwlock_write_unlock(&d->lock);
+
+  return err;
+}
+
+int consistent_hasher_dispatcher_core_of(ConsistentHasherDispatcher *d,
+                                         ConsistentHasherHash flow_hash)
+{
+  if (!d) return -1;
+
+  consistent_hasher_rwlock_read_lock(&d->lock);
+  int core = (d->ring.nodes_len > 0)
+    ? (int) consistent_hasher_get_node_of(&d->ring, flow_hash) : -1;
+  consistent_hasher_rwlock_read_unlock(&d->lock);
+
+  return core;
+}
+
+ConsistentHasherError
+consistent_hasher_dispatch(ConsistentHasherDispatcher *d,
+                           ConsistentHasherHash flow_hash,
+                           void *item,
+                           int *core)
+{
+  if (!d) return CONSISTENT_HASHER_ERROR_IS_NULL;
+
+  int target = consistent_hasher_dispatcher_core_of(d, flow_hash);
+  if (core) *core = target;
+  if (target < 0) return CONSISTENT_HASHER_ERROR_EMPTY;
+
+  return consistent_hasher_queue_push(&d->queues[target], item);
+}
+
+int consistent_hasher_dispatch_batch(ConsistentHasherDispatcher *d,
+                                     const ConsistentHasherHash *flow_hashes,
+                                     void *const *items,
+                                     int n,
+                                     int *cores)
+{
+  if (!d || !flow_hashes || !items) return 0;
+
+  int queued = 0;
+  consistent_hasher_rwlock_read_lock(&d->lock);
+  for (int i = 0; i < n; ++i)
+  {
+    int target = -1;
+    if (d->ring.nodes_len > 0)
+    {
+      target = (int) consistent_hasher_get_node_of(&d->ring, flow_hashes[i]);
+      if (consistent_hasher_queue_push(&d->queues[target], items[i])
+          == CONSISTENT_HASHER_OK)
+        queued++;
+      else
+        target = -1;
+    }
+    if (cores) cores[i] = target;
+  }
+  consistent_hasher_rwlock_read_unlock(&d->lock);
+
+  return queued;
+}
+
+bool consistent_hasher_dispatcher_pop(ConsistentHasherDispatcher *d,
+                                      int core,
+                                      void **item)
+{
+  if (!d || !item || core < 0 || core >= d->max_cores) return false;
+  return consistent_hasher_queue_pop(&d->queues[core], item);
+}
+
+ConsistentHasherError
+consistent_hasher_flow_table_init(ConsistentHasherFlowTable *table,
+                                  size_t flows,
+                                  uint32_t timeout)
+{
+  if (!table) return CONSISTENT_HASHER_ERROR_IS_NULL;
+
+  size_t buckets = 1;
+  while (buckets * CONSISTENT_HASHER_FLOW_WAYS < flows) buckets *= 2;
+  
+  *table = (ConsistentHasherFlowTable) {
+    .buckets = CONSISTENT_HASHER_CALLOC(buckets,
+                                        sizeof(ConsistentHasherFlowBucket)),
+    .mask = buckets - 1,
+    .timeout = timeout,
+  };
+  if (!table->buckets) return CONSISTENT_HASHER_ERROR_ALLOCATION;
+
+  return CONSISTENT_HASHER_OK;
+}
+
+void consistent_hasher_flow_table_destroy(ConsistentHasherFlowTable *table)
+{
+  if (!table) return;
+  
+  if (table->buckets) CONSISTENT_HASHER_FREE(table->buckets);
+  table->buckets = NULL;
+  
+  return;
+}
+
+ConsistentHasherFlowBucket *
+_consistent_hasher_flow_bucket(ConsistentHasherFlowTable *table,
+                               ConsistentHasherHash flow_hash)
+{
+  // Flow hashes are also ring positions, spread them differently
+  uint64_t x = (uint64_t) flow_hash * 0x9E3779B97F4A7C15ULL;
+  return &table->buckets[(x >> 32) & table->mask];
+}
+
+bool _consistent_hasher_flow_alive(ConsistentHasherFlowTable *table,
+                                   uint32_t stamp,
+                                   uint32_t now)
+{
+  return stamp != 0
+    && (table->timeout == 0 || (uint32_t)(now - stamp) <= table->timeout);
+}
+
+// Search [flow_hash] in [bucket] without locking
+//
+// Returns: the way of the flow, or -1. [backend] and [stamp] are set
+// to those of the flow.
+int _consistent_hasher_flow_search(ConsistentHasherFlowTable *table,
+                                   ConsistentHasherFlowBucket *bucket,
+                                   ConsistentHasherHash flow_hash,
+                                   uint32_t now,
+                                   ConsistentHasherHash *backend,
+                                   uint32_t *stamp)
+{
+  for (;;)
+  {
+    uint32_t version = _consistent_hasher_seqlock_begin(&bucket->version);
+
+    int way = -1;
+    ConsistentHasherHash found = 0;
+    for (int i = 0; i < CONSISTENT_HASHER_FLOW_WAYS; ++i)
+    {
+      *stamp = _CONSISTENT_HASHER_LOAD(&bucket->stamps[i], __ATOMIC_RELAXED);
+      if (_consistent_hasher_flow_alive(table, *stamp, now)
+          && _CONSISTENT_HASHER_LOAD(&bucket->flows[i], __ATOMIC_RELAXED)
+             == flow_hash)
+      {
+        way = i;
+        found = _CONSISTENT_HASHER_LOAD(&bucket->backends[i],
+                                        __ATOMIC_RELAXED);
+        break;
+      }
+    }
+
+    if (_consistent_hasher_seqlock_retry(&bucket->version, version))
+      continue;
+
+    if (way >= 0 && backend) *backend = found;
+    return way;
+  }
+}
+
+void _consistent_hasher_flow_touch(ConsistentHasherFlowBucket *bucket,
+                                   int way,
+                                   uint32_t stamp,
+                                   uint32_t now)
+{
+  // Only write when the time changed, to keep the line clean on
+  // hits. Fail if a writer reused or removed the entry since.
+  if (stamp != now)
+    _CONSISTENT_HASHER_CAS(&bucket->stamps[way], &stamp, now,
+                           __ATOMIC_RELAXED);
+  return;
+}
+
+bool consistent_hasher_flow_find(ConsistentHasherFlowTable *table,
+                                 ConsistentHasherHash flow_hash,
+                                 uint32_t now,
+                                 ConsistentHasherHash *backend)
+{
+  if (!table || !table->buckets) return false;
+  if (now == 0) now = 1;
+
+  ConsistentHasherFlowBucket *bucket =
+    _consistent_hasher_flow_bucket(table, flow_hash);
+  uint32_t stamp;
+  int way = _consistent_hasher_flow_search(table, bucket, flow_hash, now,
+                                           backend, &stamp);
+  if (way < 0) return false;
+
+  _consistent_hasher_flow_touch(bucket, way, stamp, now);
+  return true;
+}
+
+ConsistentHasherHash
+consistent_hasher_flow_lookup(ConsistentHasherFlowTable *table,
+                              ConsistentHasher *ch,
+                              ConsistentHasherHash flow_hash,
+                              uint32_t now)
+{
+  ConsistentHasherHash backend;
+  if (consistent_hasher_flow_find(table, flow_hash, now, &backend))
+    return backend;
+  if (now == 0) now = 1;
+  
+  backend = consistent_hasher_get_node_of(ch, flow_hash);
+  if (!table || !table->buckets) return backend;
+
+  ConsistentHasherFlowBucket *bucket =
+    _consistent_hasher_flow_bucket(table, flow_hash);
+  _consistent_hasher_seqlock_lock(&bucket->version);
+
+  // Another thread may have pinned the flow in the meantime, and
+  // otherwise take the free or least recently used way
+  int victim = 0;
+  uint32_t victim_age = 0;
+  for (int i = 0; i < CONSISTENT_HASHER_FLOW_WAYS; ++i)
+  {
+    uint32_t stamp = bucket->stamps[i];
+    bool alive = _consistent_hasher_flow_alive(table, stamp, now);
+    if (alive && bucket->flows[i] == flow_hash)
+    {
+      backend = bucket->backends[i];
+      _consistent_hasher_seqlock_unlock(&bucket->version);
+      return backend;
+    }
+    
+    uint32_t age = (alive) ? now - stamp : UINT32_MAX;
+    if (age > victim_age || i == 0)
+    {
+      victim = i;
+      victim_age = age;
+    }
+  }
+  
+  _CONSISTENT_HASHER_STORE(&bucket->flows[victim], flow_hash,
+                           __ATOMIC_RELAXED);
+  _CONSISTENT_HASHER_STORE(&bucket->backends[victim], backend,
+                           __ATOMIC_RELAXED);
+  _CONSISTENT_HASHER_STORE(&bucket->stamps[victim], now, __ATOMIC_RELAXED);
+  _consistent_hasher_seqlock_unlock(&bucket->version);
+
+  return backend;
+}
+
+void consistent_hasher_flow_remove(ConsistentHasherFlowTable *table,
+                                   ConsistentHasherHash flow_hash)
+{
+  if (!table || !table->buckets) return;
+
+  ConsistentHasherFlowBucket *bucket =
+    _consistent_hasher_flow_bucket(table, flow_hash);
+  _consistent_hasher_seqlock_lock(&bucket->version);
+  for (int i = 0; i < CONSISTENT_HASHER_FLOW_WAYS; ++i)
+  {
+    if (bucket->stamps[i] != 0 && bucket->flows[i] == flow_hash)
+      _CONSISTENT_HASHER_STORE(&bucket->stamps[i], 0, __ATOMIC_RELAXED);
+  }
+  _consistent_hasher_seqlock_unlock(&bucket->version);
+  
+  return;
+}
+
+void consistent_hasher_flow_remove_backend(ConsistentHasherFlowTable *table,
+                                           ConsistentHasherHash backend)
+{
+  if (!table || !table->buckets) return;
+
+  for (size_t b = 0; b <= table->mask; ++b)
+  {
+    ConsistentHasherFlowBucket *bucket = &table->buckets[b];
+    _consistent_hasher_seqlock_lock(&bucket->version);
+    for (int i = 0; i < CONSISTENT_HASHER_FLOW_WAYS; ++i)
+    {
+      if (bucket->stamps[i] != 0 && bucket->backends[i] == backend)
+        _CONSISTENT_HASHER_STORE(&bucket->stamps[i], 0, __ATOMIC_RELAXED);
+    }
+    _consistent_hasher_seqlock_unlock(&bucket->version);
+  }
+  
+  return;
+}
+
+ConsistentHasherError
+consistent_hasher_overrides_init(ConsistentHasherOverrides *overrides,
+                                 size_t capacity)
+{
+  if (!overrides) return CONSISTENT_HASHER_ERROR_IS_NULL;
+
+  // Keep buckets half empty, so that few of them overflow
+  size_t buckets = 1;
+  while (buckets * CONSISTENT_HASHER_OVERRIDE_WAYS < 2 * capacity)
+    buckets *= 2;
+
+  void *allocation =
+    CONSISTENT_HASHER_CALLOC(buckets + 1,
+                             sizeof(ConsistentHasherOverrideBucket));
+  if (!allocation) return CONSISTENT_HASHER_ERROR_ALLOCATION;
+
+  uintptr_t aligned = ((uintptr_t) allocation + 63) & ~(uintptr_t) 63;
+  *overrides = (ConsistentHasherOverrides) {
+    .buckets = (ConsistentHasherOverrideBucket*) aligned,
+    .mask = buckets - 1,
+    .allocation = allocation,
+  };
+  
+  return CONSISTENT_HASHER_OK;
+}
+
+void consistent_hasher_overrides_destroy(ConsistentHasherOverrides *overrides)
+{
+  if (!overrides) return;
+
+  if (overrides->allocation) CONSISTENT_HASHER_FREE(overrides->allocation);
+  overrides->allocation = NULL;
+  overrides->buckets = NULL;
+  
+  return;
+}
+
+void consistent_hasher_set_overrides(ConsistentHasher *ch,
+                                     ConsistentHasherOverrides *overrides)
+{
+  if (!ch) return;
+  ch->overrides = overrides;
+  return;
+}
+
+ConsistentHasherOverrideBucket *
+_consistent_hasher_override_bucket(ConsistentHasherOverrides *overrides,
+                                   ConsistentHasherHash item_hash)
+{
+  uint64_t x = (uint64_t) item_hash * 0xC2B2AE3D27D4EB4FULL;
+  return &overrides->buckets[(x >> 32) & overrides->mask];
+}
+
+// Set or remove, with [bucket] locked
+ConsistentHasherError
+_consistent_hasher_overrides_update(ConsistentHasherOverrideBucket *bucket,
+                                    ConsistentHasherHash item_hash,
+                                    ConsistentHasherHash node_hash,
+                                    bool remove)
+{
+  int free_way = -1;
+  for (unsigned int i = 0; i < CONSISTENT_HASHER_OVERRIDE_WAYS; ++i)
+  {
+    if (!(bucket->data.used & (1u << i)))
+    {
+      if (free_way < 0) free_way = i;
+      continue;
+    }
+    if (bucket->data.items[i] != item_hash) continue;
+
+    if (remove)
+      _CONSISTENT_HASHER_STORE(&bucket->data.used, bucket->data.used & ~(1u << i),
+                               __ATOMIC_RELAXED);
+    else
+      _CONSISTENT_HASHER_STORE(&bucket->data.nodes[i], node_hash,
+                               __ATOMIC_RELAXED);
+    return CONSISTENT_HASHER_OK;
+  }
+
+  if (remove) return CONSISTENT_HASHER_OK;
+  if (free_way < 0) return CONSISTENT_HASHER_ERROR_FULL;
+
+  _CONSISTENT_HASHER_STORE(&bucket->data.items[free_way], item_hash,
+                           __ATOMIC_RELAXED);
+  _CONSISTENT_HASHER_STORE(&bucket->data.nodes[free_way], node_hash,
+                           __ATOMIC_RELAXED);
+  _CONSISTENT_HASHER_STORE(&bucket->data.used, bucket->data.used | (1u << free_way),
+                           __ATOMIC_RELAXED);
+  return CONSISTENT_HASHER_OK;
+}
+
+ConsistentHasherError
+consistent_hasher_overrides_set(ConsistentHasherOverrides *overrides,
+                                ConsistentHasherHash item_hash,
+                                ConsistentHasherHash node_hash)
+{
+  if (!overrides || !overrides->buckets)
+    return CONSISTENT_HASHER_ERROR_IS_NULL;
+
+  ConsistentHasherOverrideBucket *bucket =
+    _consistent_hasher_override_bucket(overrides, item_hash);
+  _consistent_hasher_seqlock_lock(&bucket->data.version);
+  ConsistentHasherError err =
+    _consistent_hasher_overrides_update(bucket, item_hash, node_hash, false);
+  _consistent_hasher_seqlock_unlock(&bucket->data.version);
+
+  return err;
+}
+
+void consistent_hasher_overrides_remove(ConsistentHasherOverrides *overrides,
+                                        ConsistentHasherHash item_hash)
+{
+  if (!overrides || !overrides->buckets) return;
+
+  ConsistentHasherOverrideBucket *bucket =
+    _consistent_hasher_override_bucket(overrides, item_hash);
+  _consistent_hasher_seqlock_lock(&bucket->data.version);
+  _consistent_hasher_overrides_update(bucket, item_hash, 0, true);
+  _consistent_hasher_seqlock_unlock(&bucket->data.version);
+  
+  return;
+}
+
+int consistent_hasher_overrides_set_batch(ConsistentHasherOverrides *overrides,
+                                          const ConsistentHasherHash *item_hashes,
+                                          const ConsistentHasherHash *node_hashes,
+                                          int n)
+{
+  if (!overrides || !overrides->buckets || !item_hashes || !node_hashes)
+    return 0;
+
+  // Consecutive items of the same bucket share the lock
+  int set = 0;
+  ConsistentHasherOverrideBucket *locked = NULL;
+  for (int i = 0; i < n; ++i)
+  {
+    ConsistentHasherOverrideBucket *bucket =
+      _consistent_hasher_override_bucket(overrides, item_hashes[i]);
+    if (bucket != locked)
+    {
+      if (locked) _consistent_hasher_seqlock_unlock(&locked->data.version);
+      _consistent_hasher_seqlock_lock(&bucket->data.version);
+      locked = bucket;
+    }
+    if (i + 1 < n)
+      _CONSISTENT_HASHER_PREFETCH(
+        _consistent_hasher_override_bucket(overrides, item_hashes[i + 1]));
+    
+    if (_consistent_hasher_overrides_update(bucket, item_hashes[i],
+                                            node_hashes[i], false)
+        == CONSISTENT_HASHER_OK)
+      set++;
+  }
+  if (locked) _consistent_hasher_seqlock_unlock(&locked->data.version);
+
+  return set;
+}
+
+void
+consistent_hasher_overrides_remove_batch(ConsistentHasherOverrides *overrides,
+                                         const ConsistentHasherHash *item_hashes,
+                                         int n)
+{
+  if (!overrides || !overrides->buckets || !item_hashes) return;
+
+  ConsistentHasherOverrideBucket *locked = NULL;
+  for (int i = 0; i < n; ++i)
+  {
+    ConsistentHasherOverrideBucket *bucket =
+      _consistent_hasher_override_bucket(overrides, item_hashes[i]);
+    if (bucket != locked)
+    {
+      if (locked) _consistent_hasher_seqlock_unlock(&locked->data.version);
+      _consistent_hasher_seqlock_lock(&bucket->data.version);
+      locked = bucket;
+    }
+    _consistent_hasher_overrides_update(bucket, item_hashes[i], 0, true);
+  }
+  if (locked) _consistent_hasher_seqlock_unlock(&locked->data.version);
+  
+  return;
+}
+
+bool consistent_hasher_overrides_find(ConsistentHasherOverrides *overrides,
+                                      ConsistentHasherHash item_hash,
+                                      ConsistentHasherHash *node_hash)
+{
+  ConsistentHasherOverrideBucket *bucket =
+    _consistent_hasher_override_bucket(overrides, item_hash);
+
+  for (;;)
+  {
+    uint32_t version = _consistent_hasher_seqlock_begin(&bucket->data.version);
+    uint32_t used = _CONSISTENT_HASHER_LOAD(&bucket->data.used, __ATOMIC_RELAXED);
+    
+    bool found = false;
+    ConsistentHasherHash node = 0;
+    for (unsigned int i = 0; used && i < CONSISTENT_HASHER_OVERRIDE_WAYS; ++i)
+    {
+      if ((used & (1u << i))
+          && _CONSISTENT_HASHER_LOAD(&bucket->data.items[i], __ATOMIC_RELAXED)
+             == item_hash)
+      {
+        found = true;
+        node = _CONSISTENT_HASHER_LOAD(&bucket->data.nodes[i], __ATOMIC_RELAXED);
+        break;
+      }
+    }
+
+    if (_consistent_hasher_seqlock_retry(&bucket->data.version, version))
+      continue;
+
+    if (found && node_hash) *node_hash = node;
+    return found;
+  }
+}
+
+unsigned int consistent_hasher_range_key(const void *key, size_t len)
+{
+  const unsigned char *bytes = key;
+  unsigned int prefix = 0;
+  for (size_t i = 0; i < sizeof(unsigned int); ++i)
+    prefix = (prefix << 8) | ((bytes && i < len) ? bytes[i] : 0);
+
+  return prefix;
+}
+
+ConsistentHasherError
+consistent_hasher_range_split(ConsistentHasher *ch,
+                              unsigned int at,
+                              ConsistentHasherHash node_hash)
+{
+  if (!ch) return CONSISTENT_HASHER_ERROR_IS_NULL;
+  if (ch->ring_size != 0) return CONSISTENT_HASHER_ERROR_INVALID;
+
+  return consistent_hasher_insert_point(ch, node_hash, at);
+}
+
+ConsistentHasherError
+consistent_hasher_range_merge(ConsistentHasher *ch,
+                              unsigned int at)
+{
+  if (!ch) return CONSISTENT_HASHER_ERROR_IS_NULL;
+  if (ch->ring_size != 0
+      || !_consistent_hasher_binary_search(ch, at, NULL))
+    return CONSISTENT_HASHER_ERROR_INVALID;
+
+  return consistent_hasher_delete_node(ch, at);
+}
+
+int consistent_hasher_range_owners(ConsistentHasher *ch,
+                                   unsigned int lo,
+                                   unsigned int hi,
+                                   ConsistentHasherHash *owners,
+                                   int max)
+{
+  if (!ch || ch->nodes_len == 0) return 0;
+
+  // Number of keys in the query, minus one
+  unsigned int span = hi - lo - 1;
+  int index = _consistent_hasher_branchless_search(ch, lo);
+  unsigned int position = lo;
+  int found = 0;
+  ConsistentHasherHash last = 0;
+  
+  for (int seen = 0; seen <= ch->nodes_len; ++seen)
+  {
+    if (index == ch->nodes_len) index = 0;
+    ConsistentHasherHash owner = ch->nodes[index].owner;
+    if (found == 0 || owner != last)
+    {
+      if (owners && found < max) owners[found] = owner;
+      found++;
+      last = owner;
+    }
+
+    // Stop at the range holding the last key
+    unsigned int end = ch->nodes[index].position;
+    if (end - lo >= span || end - lo < position - lo) break;
+    position = end + 1;
+    index++;
+  }
+
+  return found;
+}
+
+ConsistentHasherError
+consistent_hasher_cluster_init(ConsistentHasherCluster *cluster)
+{
+  if (!cluster) return CONSISTENT_HASHER_ERROR_IS_NULL;
+
+  *cluster = (ConsistentHasherCluster) {
+    .owners = CONSISTENT_HASHER_CALLOC(CONSISTENT_HASHER_CLUSTER_SLOTS,
+                                       sizeof(ConsistentHasherHash)),
+    .peers = CONSISTENT_HASHER_CALLOC(CONSISTENT_HASHER_CLUSTER_SLOTS,
+                                      sizeof(ConsistentHasherHash)),
+    .states = CONSISTENT_HASHER_CALLOC(CONSISTENT_HASHER_CLUSTER_SLOTS, 1),
+  };
+  if (!cluster->owners || !cluster->peers || !cluster->states)
+  {
+    consistent_hasher_cluster_destroy(cluster);
+    return CONSISTENT_HASHER_ERROR_ALLOCATION;
+  }
+
+  return CONSISTENT_HASHER_OK;
+}
+
+void consistent_hasher_cluster_destroy(ConsistentHasherCluster *cluster)
+{
+  if (!cluster) return;
+
+  if (cluster->owners) CONSISTENT_HASHER_FREE(cluster->owners);
+  if (cluster->peers) CONSISTENT_HASHER_FREE(cluster->peers);
+  if (cluster->states) CONSISTENT_HASHER_FREE(cluster->states);
+  cluster->owners = NULL;
+  cluster->peers = NULL;
+  cluster->states = NULL;
+  
+  return;
+}
+
+unsigned int consistent_hasher_key_slot(const void *key, size_t len)
+{
+  size_t tag_len;
+  const unsigned char *tag = consistent_hasher_hash_tag(key, len, &tag_len);
+  if (!tag) return 0;
+
+  // CRC16-CCITT (XMODEM), polynomial 0x1021, a nibble at a time
+  static const uint16_t table[16] = {
+    0x0000, 0x1021, 0x2042, 0x3063, 0x4084, 0x50A5, 0x60C6, 0x70E7,
+    0x8108, 0x9129, 0xA14A, 0xB16B, 0xC18C, 0xD1AD, 0xE1CE, 0xF1EF,
+  };
+  uint16_t crc = 0;
+  for (size_t i = 0; i < tag_len; ++i)
+  {
+    crc = (uint16_t) ((crc << 4) ^ table[(crc >> 12) ^ (tag[i] >> 4)]);
+    crc = (uint16_t) ((crc << 4) ^ table[(crc >> 12) ^ (tag[i] & 0x0F)]);
+  }
+
+  return crc & (CONSISTENT_HASHER_CLUSTER_SLOTS - 1);
+}
+
+ConsistentHasherHash
+consistent_hasher_cluster_node_of(ConsistentHasherCluster *cluster,
+                                  unsigned int slot)
+{
+  return cluster->owners[slot & (CONSISTENT_HASHER_CLUSTER_SLOTS - 1)];
+}
+
+ConsistentHasherHash
+consistent_hasher_cluster_node_of_key(ConsistentHasherCluster *cluster,
+                                      const void *key,
+                                      size_t len)
+{
+  return cluster->owners[consistent_hasher_key_slot(key, len)];
+}
+
+ConsistentHasherError
+consistent_hasher_cluster_set_node(ConsistentHasherCluster *cluster,
+                                   unsigned int slot,
+                                   ConsistentHasherHash node_hash)
+{
+  if (!cluster || !cluster->owners) return CONSISTENT_HASHER_ERROR_IS_NULL;
+  if (slot >= CONSISTENT_HASHER_CLUSTER_SLOTS)
+    return CONSISTENT_HASHER_ERROR_INVALID;
+
+  cluster->owners[slot] = node_hash;
+  cluster->peers[slot] = 0;
+  cluster->states[slot] = CONSISTENT_HASHER_SLOT_STABLE;
+  
+  return CONSISTENT_HASHER_OK;
+}
+
+ConsistentHasherError
+consistent_hasher_cluster_set_state(ConsistentHasherCluster *cluster,
+                                    unsigned int slot,
+                                    ConsistentHasherSlotState state,
+                                    ConsistentHasherHash peer)
+{
+  if (!cluster || !cluster->owners) return CONSISTENT_HASHER_ERROR_IS_NULL;
+  if (slot >= CONSISTENT_HASHER_CLUSTER_SLOTS
+      || state > CONSISTENT_HASHER_SLOT_IMPORTING)
+    return CONSISTENT_HASHER_ERROR_INVALID;
+
+  cluster->peers[slot] = (state == CONSISTENT_HASHER_SLOT_STABLE) ? 0 : peer;
+  cluster->states[slot] = (unsigned char) state;
+  
+  return CONSISTENT_HASHER_OK;
+}
+
+ConsistentHasherSlotState
+consistent_hasher_cluster_get_state(ConsistentHasherCluster *cluster,
+                                    unsigned int slot,
+                                    ConsistentHasherHash *peer)
+{
+  if (!cluster || !cluster->owners
+      || slot >= CONSISTENT_HASHER_CLUSTER_SLOTS)
+    return CONSISTENT_HASHER_SLOT_STABLE;
+
+  ConsistentHasherSlotState state = cluster->states[slot];
+  if (state != CONSISTENT_HASHER_SLOT_STABLE && peer)
+    *peer = cluster->peers[slot];
+  
+  return state;
+}
+
+ConsistentHasherHash consistent_hasher_slot_hash(unsigned int slot)
+{
+  // Spread the slots over the whole ring, whatever its size
+  return consistent_hasher_point_hash((ConsistentHasherHash) slot, 0);
+}
+
+int consistent_hasher_cluster_plan(ConsistentHasherCluster *cluster,
+                                   ConsistentHasher *ch,
+                                   ConsistentHasherSlotMove *moves,
+                                   int max)
+{
+  if (!cluster || !cluster->owners || !ch || ch->nodes_len == 0) return 0;
+
+  int found = 0;
+  for (unsigned int slot = 0; slot < CONSISTENT_HASHER_CLUSTER_SLOTS; ++slot)
+  {
+    ConsistentHasherHash to =
+      consistent_hasher_get_node_of(ch, consistent_hasher_slot_hash(slot));
+    if (to == cluster->owners[slot]) continue;
+
+    if (moves && found < max)
+      moves[found] = (ConsistentHasherSlotMove) {
+        .slot = slot,
+        .from = cluster->owners[slot],
+        .to = to,
+      };
+    found++;
+  }
+
+  return found;
+}
+
+ConsistentHasherError
+consistent_hasher_cluster_apply(ConsistentHasherCluster *cluster,
+                                const ConsistentHasherSlotMove *moves,
+                                int n,
+                                bool migrate)
+{
+  if (!cluster || !cluster->owners || !moves)
+    return CONSISTENT_HASHER_ERROR_IS_NULL;
+
+  for (int i = 0; i < n; ++i)
+  {
+    ConsistentHasherError err = (migrate)
+      ? consistent_hasher_cluster_set_state(cluster, moves[i].slot,
+                                            CONSISTENT_HASHER_SLOT_MIGRATING,
+                                            moves[i].to)
+      : consistent_hasher_cluster_set_node(cluster, moves[i].slot,
+                                           moves[i].to);
+    if (err != CONSISTENT_HASHER_OK) return err;
+  }
+
+  return CONSISTENT_HASHER_OK;
+}
+
+// Collect the arcs of [node_hash] in [ch] as sorted, disjoint
+// intervals [lows][i], [lows][i] + [spans][i], merging adjacent ones
+//
+// Returns: the number of arcs, at most the number of points + 1
+int _consistent_hasher_arcs_of(ConsistentHasher *ch,
+                               ConsistentHasherHash node_hash,
+                               unsigned int *lows,
+                               unsigned int *spans)
+{
+  int len;
+  const ConsistentHasherNode *points =
+    consistent_hasher_points_of(ch, node_hash, &len);
+  unsigned int max = (ch->ring_size) ? ch->ring_size - 1 : (unsigned int) -1;
+  
+  int arcs = 0;
+  bool wraps = false;
+  unsigned int wrap_low = 0;
+  for (int i = 0; i < len; ++i)
+  {
+    int index;
+    _consistent_hasher_binary_search(ch, points[i].hash, &index);
+    unsigned int low = 0;
+    if (index > 0)
+      low = ch->nodes[index - 1].position + 1;
+    else if (ch->nodes[ch->nodes_len - 1].position < max)
+    {
+      // The first point also owns the end of the ring
+      wraps = true;
+      wrap_low = ch->nodes[ch->nodes_len - 1].position + 1;
+    }
+    
+    unsigned int high = points[i].position;
+    if (arcs > 0 && lows[arcs - 1] + spans[arcs - 1] + 1 == low)
+      spans[arcs - 1] = high - lows[arcs - 1];
+    else
+    {
+      lows[arcs] = low;
+      spans[arcs] = high - low;
+      arcs++;
+    }
+  }
+
+  if (wraps)
+  {
+    if (arcs > 0 && lows[arcs - 1] + spans[arcs - 1] + 1 == wrap_low)
+      spans[arcs - 1] = max - lows[arcs - 1];
+    else
+    {
+      lows[arcs] = wrap_low;
+      spans[arcs] = max - wrap_low;
+      arcs++;
+    }
+  }
+
+  return arcs;
+}
+
+ConsistentHasherError
+consistent_hasher_owned_mask(ConsistentHasher *ch,
+                             ConsistentHasherHash node_hash,
+                             const ConsistentHasherHash *item_hashes,
+                             int n,
+                             uint64_t *mask)
+{
+  if (!ch || !item_hashes || !mask) return CONSISTENT_HASHER_ERROR_IS_NULL;
+  
+  for (int i = 0; i < (n + 63) / 64; ++i) mask[i] = 0;
+
+  if (ch->is_static || ch->overrides)
+  {
+    // Overridden items do not follow the arcs
+    for (int i = 0; i < n; ++i)
+    {
+      ConsistentHasherHash owner;
+      bool owned = (ch->overrides
+                    && consistent_hasher_overrides_find(ch->overrides,
+                                                        item_hashes[i],
+                                                        &owner))
+        ? owner == node_hash
+        : (ch->nodes_len > 0
+           && consistent_hasher_get_node_of(ch, item_hashes[i]) == node_hash);
+      mask[i / 64] |= (uint64_t) owned << (i % 64);
+    }
+    return CONSISTENT_HASHER_OK;
+  }
+
+  int len;
+  if (!consistent_hasher_points_of(ch, node_hash, &len))
+    return CONSISTENT_HASHER_OK;
+  unsigned int *lows = CONSISTENT_HASHER_CALLOC(2 * (len + 1),
+                                                sizeof(unsigned int));
+  if (!lows) return CONSISTENT_HASHER_ERROR_ALLOCATION;
+  
+  unsigned int *spans = lows + len + 1;
+  int arcs = _consistent_hasher_arcs_of(ch, node_hash, lows, spans);
+  for (int i = 0; i < n; ++i)
+  {
+    unsigned int position = _consistent_hasher_position(ch, item_hashes[i]);
+    unsigned int owned = 0;
+    if (arcs <= CONSISTENT_HASHER_LINEAR_MAX)
+    {
+      // Unsigned wraparound makes each test a single comparison
+      for (int j = 0; j < arcs; ++j)
+        owned |= (position - lows[j] <= spans[j]);
+    }
+    else
+    {
+      // Last arc starting at or before [position]
+      const unsigned int *base = lows;
+      int count = arcs;
+      while (count > 1)
+      {
+        int half = count / 2;
+        base = (base[half] <= position) ? base + half : base;
+        count -= half;
+      }
+      int j = (int)(base - lows);
+      owned = (position - lows[j] <= spans[j]);
+    }
+    mask[i / 64] |= (uint64_t) owned << (i % 64);
+  }
+
+  CONSISTENT_HASHER_FREE(lows);
+  return CONSISTENT_HASHER_OK;
+}
+
+// log2(1 + i / 256) in 16.16 fixed point
+static const int32_t _consistent_hasher_log2_table[257] = {
+  0, 369, 736, 1102, 1466, 1829, 2190, 2551,
+  2909, 3267, 3623, 3978, 4331, 4683, 5034, 5384,
+  5732, 6079, 6425, 6769, 7112, 7454, 7795, 8134,
+  8473, 8810, 9146, 9480, 9814, 10146, 10477, 10807,
+  11136, 11464, 11791, 12116, 12440, 12764, 13086, 13407,
+  13727, 14046, 14363, 14680, 14996, 15310, 15624, 15937,
+  16248, 16559, 16868, 17177, 17484, 17791, 18096, 18401,
+  18704, 19007, 19308, 19609, 19909, 20207, 20505, 20802,
+  21098, 21393, 21687, 21980, 22272, 22564, 22854, 23144,
+  23433, 23720, 24007, 24293, 24579, 24863, 25146, 25429,
+  25711, 25992, 26272, 26551, 26830, 27108, 27384, 27660,
+  27936, 28210, 28484, 28757, 29029, 29300, 29571, 29840,
+  30109, 30378, 30645, 30912, 31178, 31443, 31707, 31971,
+  32234, 32496, 32758, 33019, 33279, 33538, 33797, 34055,
+  34312, 34569, 34825, 35080, 35334, 35588, 35841, 36094,
+  36346, 36597, 36847, 37097, 37346, 37595, 37842, 38090,
+  38336, 38582, 38827, 39072, 39316, 39559, 39802, 40044,
+  40286, 40527, 40767, 41006, 41246, 41484, 41722, 41959,
+  42196, 42432, 42667, 42902, 43137, 43370, 43603, 43836,
+  44068, 44300, 44530, 44761, 44990, 45220, 45448, 45676,
+  45904, 46131, 46357, 46583, 46809, 47034, 47258, 47482,
+  47705, 47928, 48150, 48372, 48593, 48813, 49034, 49253,
+  49472, 49691, 49909, 50127, 50344, 50560, 50776, 50992,
+  51207, 51422, 51636, 51850, 52063, 52276, 52488, 52700,
+  52911, 53122, 53332, 53542, 53751, 53960, 54169, 54377,
+  54584, 54791, 54998, 55204, 55410, 55615, 55820, 56025,
+  56229, 56432, 56635, 56838, 57040, 57242, 57443, 57644,
+  57845, 58045, 58245, 58444, 58643, 58841, 59039, 59237,
+  59434, 59631, 59827, 60023, 60219, 60414, 60609, 60803,
+  60997, 61190, 61384, 61576, 61769, 61961, 62152, 62343,
+  62534, 62725, 62915, 63104, 63294, 63483, 63671, 63859,
+  64047, 64234, 64421, 64608, 64794, 64980, 65166, 65351,
+  65536,
+};
+
+// log2(([u] + 1) / 65536) in 16.16 fixed point, between -16 and 0
+int32_t _consistent_hasher_straw2_ln(uint32_t u)
+{
+  uint32_t x = (u & 0xFFFF) + 1;
+  int exponent = 0;
+#if defined(__GNUC__)
+  exponent = 31 - __builtin_clz(x);
+#else
+  while (x >> (exponent + 1)) exponent++;
+#endif
+
+  // 16 bits of mantissa below the leading one, the top 8 index the
+  // table and the others interpolate between two entries
+  uint32_t fraction = (x << (16 - exponent)) & 0xFFFF;
+  const int32_t *table = _consistent_hasher_log2_table + (fraction >> 8);
+  int32_t low = (int32_t)(fraction & 0xFF);
+  int32_t mantissa = table[0] + (((table[1] - table[0]) * low) >> 8);
+
+  return (int32_t)((exponent - 16) * 65536) + mantissa;
+}
+
+void consistent_hasher_straw2_init(ConsistentHasherStraw2 *straw2)
+{
+  if (!straw2) return;
+
+  *straw2 = (ConsistentHasherStraw2) {
+    .nodes = NULL,
+    .weights = NULL,
+    .inverse_weights = NULL,
+    .len = 0,
+    .capacity = 0,
+  };
+  
+  return;
+}
+
+void consistent_hasher_straw2_destroy(ConsistentHasherStraw2 *straw2)
+{
+  if (!straw2) return;
+
+  if (straw2->nodes) CONSISTENT_HASHER_FREE(straw2->nodes);
+  if (straw2->weights) CONSISTENT_HASHER_FREE(straw2->weights);
+  if (straw2->inverse_weights) CONSISTENT_HASHER_FREE(straw2->inverse_weights);
+  consistent_hasher_straw2_init(straw2);
+  
+  return;
+}
+
+ConsistentHasherError
+consistent_hasher_straw2_set_weight(ConsistentHasherStraw2 *straw2,
+                                    ConsistentHasherHash node_hash,
+                                    unsigned int weight)
+{
+  if (!straw2) return CONSISTENT_HASHER_ERROR_IS_NULL;
+
+  int index = 0;
+  while (index < straw2->len && straw2->nodes[index] != node_hash) index++;
+
+  if (index == straw2->len && straw2->len == straw2->capacity)
+  {
+    int capacity = (straw2->capacity)
+      ? straw2->capacity * 2 : CONSISTENT_HASHER_INITIAL_CAPACITY;
+    ConsistentHasherHash *nodes =
+      CONSISTENT_HASHER_CALLOC(capacity, sizeof(ConsistentHasherHash));
+    unsigned int *weights =
+      CONSISTENT_HASHER_CALLOC(capacity, sizeof(unsigned int));
+    double *inverse_weights = CONSISTENT_HASHER_CALLOC(capacity, sizeof(double));
+    if (!nodes || !weights || !inverse_weights)
+    {
+      if (nodes) CONSISTENT_HASHER_FREE(nodes);
+      if (weights) CONSISTENT_HASHER_FREE(weights);
+      if (inverse_weights) CONSISTENT_HASHER_FREE(inverse_weights);
+      return CONSISTENT_HASHER_ERROR_ALLOCATION;
+    }
+
+    for (int i = 0; i < straw2->len; ++i)
+    {
+      nodes[i] = straw2->nodes[i];
+      weights[i] = straw2->weights[i];
+      inverse_weights[i] = straw2->inverse_weights[i];
+    }
+    int len = straw2->len;
+    consistent_hasher_straw2_destroy(straw2);
+    *straw2 = (ConsistentHasherStraw2) {
+      .nodes = nodes,
+      .weights = weights,
+      .inverse_weights = inverse_weights,
+      .len = len,
+      .capacity = capacity,
+    };
+  }
+  if (index == straw2->len) straw2->len++;
+
+  straw2->nodes[index] = node_hash;
+  straw2->weights[index] = weight;
+  straw2->inverse_weights[index] = (weight) ? 1.0 / weight : 0;
+  
+  return CONSISTENT_HASHER_OK;
+}
+
+ConsistentHasherError
+consistent_hasher_straw2_remove(ConsistentHasherStraw2 *straw2,
+                                ConsistentHasherHash node_hash)
+{
+  if (!straw2) return CONSISTENT_HASHER_ERROR_IS_NULL;
+
+  // Draws do not depend on the order, move the last node in the hole
+  for (int i = 0; i < straw2->len; ++i)
+  {
+    if (straw2->nodes[i] != node_hash) continue;
+    
+    straw2->len--;
+    straw2->nodes[i] = straw2->nodes[straw2->len];
+    straw2->weights[i] = straw2->weights[straw2->len];
+    straw2->inverse_weights[i] = straw2->inverse_weights[straw2->len];
+    break;
+  }
+  
+  return CONSISTENT_HASHER_OK;
+}
+
+// splitmix64 finalizer of [x], a bijection of the 64-bit words
+uint64_t _consistent_hasher_straw2_mix(uint64_t x)
+{
+  x = (x + 0x9E3779B97F4A7C15ULL);
+  x = (x ^ (x >> 30)) * 0xBF58476D1CE4E5B9ULL;
+  x = (x ^ (x >> 27)) * 0x94D049BB133111EBULL;
+  return x ^ (x >> 31);
+}
+
+ConsistentHasherHash
+consistent_hasher_straw2_select(ConsistentHasherStraw2 *straw2,
+                                ConsistentHasherHash item_hash)
+{
+  // Mixing the item, then the node into it, keeps every bit of both:
+  // pairs that share the item or the node never share the draw
+  uint64_t item = _consistent_hasher_straw2_mix((uint64_t) item_hash);
+
+  // Selects instead of branches, so that the loop can be vectorized
+  ConsistentHasherHash best = 0;
+  double best_draw = -DBL_MAX;
+  for (int i = 0; i < straw2->len; ++i)
+  {
+    // 16 random bits from the item and the node
+    ConsistentHasherHash node = straw2->nodes[i];
+    uint64_t x = _consistent_hasher_straw2_mix(item ^ (uint64_t) node);
+    uint32_t u = (uint32_t)(x >> 48);
+
+    // The logarithm is negative: heavier nodes get shorter negative
+    // draws, which are longer straws
+    double draw = (straw2->weights[i])
+      ? _consistent_hasher_straw2_ln(u) * straw2->inverse_weights[i]
+      : -DBL_MAX;
+    // Ties go to the bigger hash, whatever the order of the nodes
+    bool longer = draw > best_draw || (draw == best_draw && node > best);
+    best = (longer) ? node : best;
+    best_draw = (longer) ? draw : best_draw;
+  }
+
+  return best;
+}
+
+// Items drawn together by consistent_hasher_straw2_select_batch
+#define _CONSISTENT_HASHER_STRAW2_BLOCK 64
+
+void consistent_hasher_straw2_select_batch(ConsistentHasherStraw2 *straw2,
+                                           const ConsistentHasherHash *item_hashes,
+                                           int n,
+                                           ConsistentHasherHash *out)
+{
+  if (!straw2 || !item_hashes || !out) return;
+
+  // Nodes of weight 0 only win when all are: every draw ties, and the
+  // bigger hash wins. Otherwise, skipping them changes nothing.
+  bool weighted = false;
+  ConsistentHasherHash biggest = 0;
+  for (int i = 0; i < straw2->len; ++i)
+  {
+    weighted = weighted || straw2->weights[i];
+    biggest = (straw2->nodes[i] > biggest) ? straw2->nodes[i] : biggest;
+  }
+  if (!weighted)
+  {
+    for (int i = 0; i < n; ++i) out[i] = biggest;
+    return;
+  }
+
+  enum { BLOCK = _CONSISTENT_HASHER_STRAW2_BLOCK };
+  uint64_t items[BLOCK];
+  int32_t exponents[BLOCK], lows[BLOCK], bases[BLOCK], nexts[BLOCK];
+  uint32_t indices[BLOCK];
+  double best_draws[BLOCK];
+  ConsistentHasherHash best[BLOCK];
+  for (int start = 0; start < n; start += BLOCK)
+  {
+    // Full blocks only, so that each loop below is vectorized whole.
+    // The last one repeats its first item.
+    int len = (n - start < BLOCK) ? n - start : BLOCK;
+    for (int j = 0; j < BLOCK; ++j)
+    {
+      items[j] = _consistent_hasher_straw2_mix(
+                   (uint64_t) item_hashes[start + ((j < len) ? j : 0)]);
+      best[j] = 0;
+      best_draws[j] = -DBL_MAX;
+    }
+
+    // One node at a time, the draws of the items are independent
+    for (int i = 0; i < straw2->len; ++i)
+    {
+      if (!straw2->weights[i]) continue;
+      ConsistentHasherHash node = straw2->nodes[i];
+      double inverse_weight = straw2->inverse_weights[i];
+
+      // Same steps as _consistent_hasher_straw2_ln, split around the
+      // table lookups. Up to 65536 is exact as a float, whose exponent
+      // and mantissa replace the count of leading zeros.
+      for (int j = 0; j < BLOCK; ++j)
+      {
+        uint64_t x = _consistent_hasher_straw2_mix(items[j] ^ (uint64_t) node);
+        union { float f; uint32_t bits; } value;
+        value.f = (float)(int32_t)((x >> 48) + 1);
+        uint32_t fraction = (value.bits >> 7) & 0xFFFF;
+        exponents[j] = (int32_t)(value.bits >> 23) - 127;
+        indices[j] = fraction >> 8;
+        lows[j] = (int32_t)(fraction & 0xFF);
+      }
+      for (int j = 0; j < BLOCK; ++j)
+      {
+        bases[j] = _consistent_hasher_log2_table[indices[j]];
+        nexts[j] = _consistent_hasher_log2_table[indices[j] + 1];
+      }
+      for (int j = 0; j < BLOCK; ++j)
+      {
+        int32_t ln = (exponents[j] - 16) * 65536 + bases[j]
+          + (((nexts[j] - bases[j]) * lows[j]) >> 8);
+        double draw = ln * inverse_weight;
+        bool longer = draw > best_draws[j]
+          || (draw == best_draws[j] && node > best[j]);
+        best[j] = (longer) ? node : best[j];
+        best_draws[j] = (longer) ? draw : best_draws[j];
+      }
+    }
+
+    for (int j = 0; j < len; ++j) out[start + j] = best[j];
+  }
+  
+  return;
+}
+
+#define _CONSISTENT_HASHER_GAPPED_END UINT64_MAX
+#define _CONSISTENT_HASHER_GAPPED_MIN 8
+
+void consistent_hasher_gapped_init(ConsistentHasherGapped *ring,
+                                   unsigned int ring_size)
+{
+  if (!ring) return;
+
+  *ring = (ConsistentHasherGapped) {
+    .keys = NULL,
+    .owners = NULL,
+    .hashes = NULL,
+    .used = NULL,
+    .capacity = 0,
+    .segment = 0,
+    .len = 0,
+    .ring_size = ring_size,
+  };
+  
+  return;
+}
+
+void consistent_hasher_gapped_destroy(ConsistentHasherGapped *ring)
+{
+  if (!ring) return;
+
+  // All the arrays share the allocation of [keys]
+  if (ring->keys) CONSISTENT_HASHER_FREE(ring->keys);
+  consistent_hasher_gapped_init(ring, ring->ring_size);
+  
+  return;
+}
+
+// Index of the first slot of [ring] with a key at or after [key], or
+// [ring->capacity] if there is none
+size_t _consistent_hasher_gapped_search(ConsistentHasherGapped *ring,
+                                        uint64_t key)
+{
+  const uint64_t *base = ring->keys;
+  size_t len = ring->capacity;
+  if (len == 0) return 0;
+
+  while (len > 1)
+  {
+    size_t half = len / 2;
+    base = (base[half] < key) ? base + half : base;
+    len -= half;
+  }
+
+  return (size_t)(base - ring->keys) + (*base < key);
+}
+
+// Copy slot [from] of [ring] to slot [to]
+void _consistent_hasher_gapped_copy(ConsistentHasherGapped *ring,
+                                    size_t from,
+                                    size_t to)
+{
+  ring->keys[to] = ring->keys[from];
+  ring->owners[to] = ring->owners[from];
+  ring->hashes[to] = ring->hashes[from];
+  
+  return;
+}
+
+// Make the gaps in [start, end) of [ring] copy their next point, as
+// well as the gaps right before [start]
+void _consistent_hasher_gapped_fill(ConsistentHasherGapped *ring,
+                                    size_t start,
+                                    size_t end)
+{
+  size_t next = end;
+  for (size_t i = end; i-- > start;)
+  {
+    if (ring->used[i])
+      next = i;
+    else if (next < ring->capacity)
+      _consistent_hasher_gapped_copy(ring, next, i);
+    else
+      ring->keys[i] = _CONSISTENT_HASHER_GAPPED_END;
+  }
+  
+  for (size_t i = start; i-- > 0 && !ring->used[i];)
+    _consistent_hasher_gapped_copy(ring, start, i);
+
+  return;
+}
+
+// Move the points of [ring] to a new array of [capacity] slots,
+// adding [extra] if not NULL
+ConsistentHasherError _consistent_hasher_gapped_resize(ConsistentHasherGapped *ring,
+                                                       size_t capacity,
+                                                       const ConsistentHasherNode *extra)
+{
+  size_t size = sizeof(uint64_t) + 2 * sizeof(ConsistentHasherHash) + 1;
+  uint64_t *keys = CONSISTENT_HASHER_CALLOC(capacity, size);
+  if (!keys) return CONSISTENT_HASHER_ERROR_ALLOCATION;
+
+  ConsistentHasherGapped grown = {
+    .keys = keys,
+    .owners = (ConsistentHasherHash*) (keys + capacity),
+    .hashes = (ConsistentHasherHash*) (keys + capacity) + capacity,
+    .used = (unsigned char*) ((ConsistentHasherHash*) (keys + capacity)
+                              + 2 * capacity),
+    .capacity = capacity,
+    .segment = _CONSISTENT_HASHER_GAPPED_MIN,
+    .len = ring->len + (extra != NULL),
+    .ring_size = ring->ring_size,
+  };
+  // Windows are spread down to about log2(capacity) slots
+  size_t bits = 0;
+  while (((size_t) 1 << bits) < capacity) bits++;
+  while (grown.segment < bits && grown.segment < capacity)
+    grown.segment *= 2;
+
+  // Spread the points evenly, merging [extra] in order
+  size_t m = 0;
+  for (size_t i = 0; i <= ring->capacity; ++i)
+  {
+    bool last = (i == ring->capacity);
+    if (extra && (last || (ring->used[i] && ring->keys[i] > extra->position)))
+    {
+      size_t to = m++ * capacity / grown.len;
+      grown.keys[to] = extra->position;
+      grown.owners[to] = extra->owner;
+      grown.hashes[to] = extra->hash;
+      grown.used[to] = 1;
+      extra = NULL;
+    }
+    if (last || !ring->used[i]) continue;
+
+    size_t to = m++ * capacity / grown.len;
+    grown.keys[to] = ring->keys[i];
+    grown.owners[to] = ring->owners[i];
+    grown.hashes[to] = ring->hashes[i];
+    grown.used[to] = 1;
+  }
+  _consistent_hasher_gapped_fill(&grown, 0, capacity);
+
+  if (ring->keys) CONSISTENT_HASHER_FREE(ring->keys);
+  *ring = grown;
+  return CONSISTENT_HASHER_OK;
+}
+
+// Insert [point] before slot [index] of [ring], spreading the
+// smallest window around it that stays below its density threshold
+ConsistentHasherError
+_consistent_hasher_gapped_spread(ConsistentHasherGapped *ring,
+                                 size_t index,
+                                 const ConsistentHasherNode *point)
+{
+  size_t slot = (index < ring->capacity) ? index : ring->capacity - 1;
+  size_t levels = 0;
+  while ((ring->segment << levels) < ring->capacity) levels++;
+
+  // Windows may be full at the bottom and 3/4 full at the top
+  size_t window = ring->segment, start = 0, count = 0;
+  for (size_t level = 0; ; ++level, window *= 2)
+  {
+    if (window > ring->capacity)
+      return _consistent_hasher_gapped_resize(ring, 2 * ring->capacity,
+                                              point);
+    start = slot & ~(window - 1);
+    count = 0;
+    for (size_t i = start; i < start + window; ++i) count += ring->used[i];
+
+    size_t limit = (levels) ? window - window * level / (4 * levels) : window;
+    if (count + 1 <= limit) break;
+  }
+
+  // Pack the points to the left, then add [point] in order
+  size_t end = start;
+  for (size_t i = start; i < start + window; ++i)
+  {
+    if (!ring->used[i]) continue;
+    if (i != end) _consistent_hasher_gapped_copy(ring, i, end);
+    ring->used[end++] = 1;
+  }
+  for (size_t i = end; i < start + window; ++i) ring->used[i] = 0;
+
+  size_t at = end;
+  for (; at > start && ring->keys[at - 1] > point->position; --at)
+    _consistent_hasher_gapped_copy(ring, at - 1, at);
+  ring->keys[at] = point->position;
+  ring->owners[at] = point->owner;
+  ring->hashes[at] = point->hash;
+  ring->used[end] = 1;
+  count++;
+  
+  // Spread from the right, so that no point is overwritten
+  for (size_t m = count; m-- > 0;)
+  {
+    size_t to = start + m * window / count;
+    if (to == start + m) continue;
+    _consistent_hasher_gapped_copy(ring, start + m, to);
+    ring->used[to] = 1;
+    ring->used[start + m] = 0;
+  }
+  _consistent_hasher_gapped_fill(ring, start, start + window);
+  ring->len++;
+  
+  return CONSISTENT_HASHER_OK;
+}
+
+ConsistentHasherError
+consistent_hasher_gapped_insert_point(ConsistentHasherGapped *ring,
+                                      ConsistentHasherHash node_hash,
+                                      ConsistentHasherHash point_hash)
+{
+  if (!ring) return CONSISTENT_HASHER_ERROR_IS_NULL;
+
+  ConsistentHasherNode point = {
+    .hash = point_hash,
+    .position = (ring->ring_size)
+      ? point_hash % ring->ring_size : (unsigned int) point_hash,
+    .owner = node_hash,
+  };
+  if (ring->capacity == 0)
+  {
+    size_t capacity = _CONSISTENT_HASHER_GAPPED_MIN;
+    while (capacity < CONSISTENT_HASHER_INITIAL_CAPACITY) capacity *= 2;
+    return _consistent_hasher_gapped_resize(ring, capacity, &point);
+  }
+
+  // Gaps copy the next point, so an equal key means it is present
+  size_t index = _consistent_hasher_gapped_search(ring, point.position);
+  if (index < ring->capacity && ring->keys[index] == point.position)
+    return CONSISTENT_HASHER_ERROR_NODE_PRESENT;
+
+  // The slots before [index] hold smaller points, so a gap at [index]
+  // is the only slot to change
+  if (index < ring->capacity && !ring->used[index])
+  {
+    ring->keys[index] = point.position;
+    ring->owners[index] = point.owner;
+    ring->hashes[index] = point.hash;
+    ring->used[index] = 1;
+    ring->len++;
+    return CONSISTENT_HASHER_OK;
+  }
+
+  return _consistent_hasher_gapped_spread(ring, index, &point);
+}
+
+ConsistentHasherError
+consistent_hasher_gapped_delete_point(ConsistentHasherGapped *ring,
+                                      ConsistentHasherHash point_hash)
+{
+  if (!ring) return CONSISTENT_HASHER_ERROR_IS_NULL;
+
+  uint64_t position = (ring->ring_size)
+    ? point_hash % ring->ring_size : (unsigned int) point_hash;
+  size_t index = _consistent_hasher_gapped_search(ring, position);
+  if (index == ring->capacity || ring->keys[index] != position)
+    return CONSISTENT_HASHER_OK;
+
+  // Skip the gaps copying the point, then make them and the point
+  // copy the next one
+  while (!ring->used[index]) index++;
+  ring->used[index] = 0;
+  ring->len--;
+  for (size_t i = index + 1; i-- > 0 && ring->keys[i] == position;)
+  {
+    if (index + 1 < ring->capacity)
+      _consistent_hasher_gapped_copy(ring, index + 1, i);
+    else
+      ring->keys[i] = _CONSISTENT_HASHER_GAPPED_END;
+  }
+
+  // Halve the array once it is mostly gaps
+  if (ring->len * 8 < ring->capacity
+      && ring->capacity > _CONSISTENT_HASHER_GAPPED_MIN)
+    _consistent_hasher_gapped_resize(ring, ring->capacity / 2, NULL);
+  
+  return CONSISTENT_HASHER_OK;
+}
+
+ConsistentHasherHash
+consistent_hasher_gapped_get_node_of(ConsistentHasherGapped *ring,
+                                     ConsistentHasherHash item_hash)
+{
+  uint64_t position = (ring->ring_size)
+    ? item_hash % ring->ring_size : (unsigned int) item_hash;
+  size_t index = _consistent_hasher_gapped_search(ring, position);
+  
+  // Past the last point, wrap around to the first one, which the
+  // first slot holds or copies
+  if (index == ring->capacity
+      || ring->keys[index] == _CONSISTENT_HASHER_GAPPED_END)
+    index = 0;
+
+  return ring->owners[index];
+}
+
+void consistent_hasher_scheduler_init(ConsistentHasherScheduler *scheduler,
+                                      ConsistentHasher *ch,
+                                      ConsistentHasherLookupDone done)
+{
+  if (!scheduler) return;
+
+  scheduler->ch = ch;
+  scheduler->done = done;
+  scheduler->active = 0;
+  
+  return;
+}
+
+// Free the [index]-th slot of [scheduler] and report its result
+void _consistent_hasher_scheduler_complete(ConsistentHasherScheduler *scheduler,
+                                           int index,
+                                           ConsistentHasherHash node_hash)
+{
+  // The slot is free before the callback runs, so a lookup it submits
+  // neither waits for this one nor completes it again
+  ConsistentHasherLookupState state = scheduler->slots[index];
+  scheduler->slots[index] = scheduler->slots[--scheduler->active];
+
+  if (state.out) *state.out = node_hash;
+  if (scheduler->done)
+    scheduler->done(state.user, state.item_hash, node_hash);
+  return;
+}
+
+void consistent_hasher_scheduler_submit(ConsistentHasherScheduler *scheduler,
+                                        ConsistentHasherHash item_hash,
+                                        ConsistentHasherHash *out,
+                                        void *user)
+{
+  if (!scheduler || !scheduler->ch) return;
+  ConsistentHasher *ch = scheduler->ch;
+
+  while (scheduler->active == CONSISTENT_HASHER_SCHEDULER_SLOTS)
+    consistent_hasher_scheduler_step(scheduler);
+  
+  ConsistentHasherLookupState *state = &scheduler->slots[scheduler->active++];
+  *state = (ConsistentHasherLookupState) {
+    .item_hash = item_hash,
+    .position = _consistent_hasher_position(ch, item_hash),
+    .base = ch->nodes,
+    .len = ch->nodes_len,
+    .k = 1,
+    .out = out,
+    .user = user,
+  };
+
+  // Overrides are a single probe, no need to interleave them
+  ConsistentHasherHash node_hash;
+  if (ch->overrides
+      && consistent_hasher_overrides_find(ch->overrides, item_hash, &node_hash))
+  {
+    _consistent_hasher_scheduler_complete(scheduler, scheduler->active - 1,
+                                          node_hash);
+    return;
+  }
+
+  if (ch->active_layout == CONSISTENT_HASHER_LAYOUT_EYTZINGER)
+    _CONSISTENT_HASHER_PREFETCH(&ch->eytzinger[1]);
+  else
+    _CONSISTENT_HASHER_PREFETCH(&ch->nodes[ch->nodes_len / 2]);
+  
+  return;
+}
+
+int consistent_hasher_scheduler_step(ConsistentHasherScheduler *scheduler)
+{
+  if (!scheduler || !scheduler->ch) return 0;
+  ConsistentHasher *ch = scheduler->ch;
+  bool eytzinger = (ch->active_layout == CONSISTENT_HASHER_LAYOUT_EYTZINGER);
 
-// Initialize [ch] with [ring_size] slots
-//
-// Notes: Remember to destroy [ch] when you are done.
-void consistent_hasher_init(ConsistentHasher *ch,
-                            unsigned int ring_size);
+  // Completed lookups are replaced by the last one, so walk backwards.
+  // A done callback that steps too may leave fewer than [i] lookups.
+  for (int i = scheduler->active - 1; i >= 0; --i)
+  {
+    if (i >= scheduler->active) continue;
+    ConsistentHasherLookupState *state = &scheduler->slots[i];
+    if (eytzinger)
+    {
+      unsigned int k = state->k;
+      k = 2 * k + (ch->eytzinger[k] < state->position);
+      state->k = k;
+      if (k <= (unsigned int) ch->eytzinger_len)
+      {
+        _CONSISTENT_HASHER_PREFETCH(&ch->eytzinger[k]);
+        continue;
+      }
 
-// Free allocated memory in [ch]
-void consistent_hasher_destroy(ConsistentHasher *ch);
+      // Go back up to the last left turn
+      while (k & 1) k >>= 1;
+      k >>= 1;
+      _consistent_hasher_scheduler_complete(scheduler, i,
+                                            ch->eytzinger_owners[k]);
+      continue;
+    }
+
+    if (state->len > 1)
+    {
+      int half = state->len / 2;
+      state->base = (state->base[half].position < state->position)
+        ? state->base + half : state->base;
+      state->len -= half;
+      _CONSISTENT_HASHER_PREFETCH(&state->base[state->len / 2]);
+      continue;
+    }
+
+    const ConsistentHasherNode *base =
+      state->base + (state->base->position < state->position);
+    _consistent_hasher_scheduler_complete(scheduler, i,
+      (base == ch->nodes + ch->nodes_len) ? ch->nodes[0].owner : base->owner);
+  }
+
+  return scheduler->active;
+}
+
+void consistent_hasher_scheduler_drain(ConsistentHasherScheduler *scheduler)
+{
+  while (consistent_hasher_scheduler_step(scheduler) > 0);
+  return;
+}
 
-// Insert a node with [node_hash] in [ch]
-//
-// Returns: CONSISTENT_HASHER_OK on success, or an error otherwise
-// Note: Fails if trying to insert a [node_hash] that is already
-// present
 ConsistentHasherError
-consistent_hasher_insert_node(ConsistentHasher *ch,
-                              ConsistentHasherHash node_hash);
+consistent_hasher_set_background_rebuild(ConsistentHasher *ch,
+                                         bool enabled)
+{
+  if (!ch) return CONSISTENT_HASHER_ERROR_IS_NULL;
+
+  ch->background_rebuild = enabled;
+  if (enabled) return CONSISTENT_HASHER_OK;
+
+  if (ch->spare_eytzinger) CONSISTENT_HASHER_FREE(ch->spare_eytzinger);
+  if (ch->spare_eytzinger_owners)
+    CONSISTENT_HASHER_FREE(ch->spare_eytzinger_owners);
+  ch->spare_eytzinger = NULL;
+  ch->spare_eytzinger_owners = NULL;
+  ch->spare_capacity = 0;
+  ch->built_generation = ch->generation;
+  return _consistent_hasher_apply_layout(ch, true);
+}
+
+bool consistent_hasher_rebuild_pending(ConsistentHasher *ch)
+{
+  if (!ch) return false;
+  return ch->generation != ch->built_generation;
+}
 
-// Remove node with [node_hash] in [ch]
-//
-// Returns: CONSISTENT_HASHER_OK on success, or an error otherwise
 ConsistentHasherError
-consistent_hasher_delete_node(ConsistentHasher *ch,
-                              ConsistentHasherHash node_hash);
+consistent_hasher_rebuild(ConsistentHasher *ch,
+                          ConsistentHasherRwLock *lock)
+{
+  if (!ch) return CONSISTENT_HASHER_ERROR_IS_NULL;
 
-// Get the hash of the node corresponding to [item_hash] in [ch]
-ConsistentHasherHash
-consistent_hasher_get_node_of(ConsistentHasher *ch,
-                              ConsistentHasherHash item_hash);
-  
-//
-// Implementations
-//
+  // Lookups do not use a stale copy outside background rebuilds, fill
+  // it in place
+  if (!lock && !ch->background_rebuild)
+    return (consistent_hasher_rebuild_pending(ch))
+      ? _consistent_hasher_apply_layout(ch, true) : CONSISTENT_HASHER_OK;
 
-#ifdef CONSISTENT_HASHER_IMPLEMENTATION
+  // Copy the points, so that the build does not block membership
+  // changes
+  if (lock) consistent_hasher_rwlock_read_lock(lock);
+  unsigned int generation = ch->generation;
+  int len = ch->nodes_len;
+  int capacity = ch->nodes_capacity + 1;
+  bool wanted =
+    _consistent_hasher_pick_layout(ch) == CONSISTENT_HASHER_LAYOUT_EYTZINGER;
+  ConsistentHasherNode *points = (wanted && len > 0)
+    ? CONSISTENT_HASHER_CALLOC(len, sizeof(ConsistentHasherNode)) : NULL;
+  for (int i = 0; points && i < len; ++i) points[i] = ch->nodes[i];
+  if (lock) consistent_hasher_rwlock_read_unlock(lock);
 
+  if (wanted && len > 0 && !points) return CONSISTENT_HASHER_ERROR_ALLOCATION;
+  if (!wanted && ch->spare_eytzinger)
+  {
+    // Give the memory back while the copy is not used
+    CONSISTENT_HASHER_FREE(ch->spare_eytzinger);
+    CONSISTENT_HASHER_FREE(ch->spare_eytzinger_owners);
+    ch->spare_eytzinger = NULL;
+    ch->spare_eytzinger_owners = NULL;
+    ch->spare_capacity = 0;
+  }
 
-void consistent_hasher_init(ConsistentHasher *ch,
-                            unsigned int ring_size)
+  ConsistentHasherError err = CONSISTENT_HASHER_OK;
+  if (points)
+  {
+    err = _consistent_hasher_eytzinger_reserve(&ch->spare_eytzinger,
+                                               &ch->spare_eytzinger_owners,
+                                               &ch->spare_capacity,
+                                               len, capacity);
+    if (err == CONSISTENT_HASHER_OK)
+    {
+      _consistent_hasher_eytzinger_fill(points, len, ch->spare_eytzinger,
+                                        ch->spare_eytzinger_owners, 0, 1);
+      ch->spare_eytzinger_owners[0] = points[0].owner;
+    }
+    CONSISTENT_HASHER_FREE(points);
+    if (err != CONSISTENT_HASHER_OK) return err;
+  }
+
+  if (lock) consistent_hasher_rwlock_write_lock(lock);
+  // A membership change may have switched to another layout meanwhile,
+  // or made the new copy stale for lookups that need the current one
+  bool current = ch->background_rebuild || ch->generation == generation;
+  if (points && current
+      && _consistent_hasher_pick_layout(ch) == CONSISTENT_HASHER_LAYOUT_EYTZINGER)
+  {
+    unsigned int *positions = ch->eytzinger;
+    ConsistentHasherHash *owners = ch->eytzinger_owners;
+    int allocated = ch->eytzinger_capacity;
+    ch->eytzinger = ch->spare_eytzinger;
+    ch->eytzinger_owners = ch->spare_eytzinger_owners;
+    ch->eytzinger_capacity = ch->spare_capacity;
+    ch->eytzinger_len = len;
+    ch->spare_eytzinger = positions;
+    ch->spare_eytzinger_owners = owners;
+    ch->spare_capacity = allocated;
+    ch->active_layout = CONSISTENT_HASHER_LAYOUT_EYTZINGER;
+  }
+  if (current) ch->built_generation = generation;
+  if (!ch->background_rebuild && ch->spare_eytzinger)
+  {
+    // No lookup holds the lock, the old copy is not used anymore
+    CONSISTENT_HASHER_FREE(ch->spare_eytzinger);
+    CONSISTENT_HASHER_FREE(ch->spare_eytzinger_owners);
+    ch->spare_eytzinger = NULL;
+    ch->spare_eytzinger_owners = NULL;
+    ch->spare_capacity = 0;
+  }
+  if (lock) consistent_hasher_rwlock_write_unlock(lock);
+  
+  return err;
+}
+
+ConsistentHasherError
+consistent_hasher_watch(ConsistentHasher *ch,
+                        ConsistentHasherWatcher *watcher,
+                        ConsistentHasherWatchCallback callback,
+                        void *user)
 {
-  if (!ch) return;
+  if (!ch || !watcher || !callback) return CONSISTENT_HASHER_ERROR_IS_NULL;
+  if (ch->is_static) return CONSISTENT_HASHER_ERROR_INVALID;
 
-  *ch = (ConsistentHasher) {
-    .ring_size = ring_size,
-    .nodes_len = 0,
-    .nodes_capacity = 0,
-    .nodes = NULL,
+  *watcher = (ConsistentHasherWatcher) {
+    .callback = callback,
+    .user = user,
+    .next = ch->watchers,
   };
-  
-  return;
+  ch->watchers = watcher;
+  return CONSISTENT_HASHER_OK;
 }
- 
-void consistent_hasher_destroy(ConsistentHasher *ch)
+
+void consistent_hasher_unwatch(ConsistentHasher *ch,
+                               ConsistentHasherWatcher *watcher)
 {
-  if (!ch) return;
-  
-  if (ch->nodes) CONSISTENT_HASHER_FREE(ch->nodes);
-  ch->nodes = NULL;
-  
+  if (!ch || !watcher) return;
+
+  for (ConsistentHasherWatcher **link = &ch->watchers; *link;
+       link = &(*link)->next)
+  {
+    if (*link != watcher) continue;
+    *link = watcher->next;
+    break;
+  }
+  if (ch->watchers) return;
+
+  // Nobody is left to read them
+  if (ch->changes) CONSISTENT_HASHER_FREE(ch->changes);
+  ch->changes = NULL;
+  ch->changes_len = 0;
+  ch->changes_capacity = 0;
+  ch->changes_lost = false;
   return;
 }
 
-bool _consistent_hasher_binary_search(ConsistentHasher *ch,
-                                      ConsistentHasherHash node_hash,
-                                      int *index)
+// Length of the arc of [ch] that ends at [position] and starts after
+// [previous], the whole ring if they are equal
+uint64_t _consistent_hasher_arc_length(ConsistentHasher *ch,
+                                       unsigned int previous,
+                                       unsigned int position)
 {
-  int start = 0;
-  int end = ch->nodes_len - 1;
-  unsigned int position = node_hash % ch->ring_size;
-  int mid = (end - start) / 2 + start;
-  
-  while(end >= start) {
-    
-    if (ch->nodes[mid].position == position)
+  uint64_t size = (ch->ring_size) ? ch->ring_size : (uint64_t) UINT32_MAX + 1;
+  if (position > previous) return position - previous;
+  return position + size - previous;
+}
+
+ConsistentHasherError
+consistent_hasher_rank_scale_in(ConsistentHasher *ch,
+                                int k,
+                                ConsistentHasherScaleIn *ranking,
+                                int *len)
+{
+  if (!ch || !ranking || !len) return CONSISTENT_HASHER_ERROR_IS_NULL;
+  *len = 0;
+  if (ch->is_static) return CONSISTENT_HASHER_ERROR_INVALID;
+  int n = ch->nodes_len;
+  if (n == 0 || k <= 0) return CONSISTENT_HASHER_OK;
+
+  // Number the owners in [ch->points] order
+  int owners_len = 0;
+  for (int i = 0; i < n; ++i)
+    if (i == 0 || ch->points[i].owner != ch->points[i - 1].owner)
+      owners_len++;
+
+  ConsistentHasherHash *owners =
+    CONSISTENT_HASHER_CALLOC(owners_len, sizeof(ConsistentHasherHash));
+  bool *removed = CONSISTENT_HASHER_CALLOC(owners_len, sizeof(bool));
+  uint64_t *loads = CONSISTENT_HASHER_CALLOC(owners_len, sizeof(uint64_t));
+  uint64_t *gains = CONSISTENT_HASHER_CALLOC(owners_len, sizeof(uint64_t));
+  int *offsets = CONSISTENT_HASHER_CALLOC(owners_len + 1, sizeof(int));
+  // Owner number of each point of the ring, then the runs
+  int *ring = CONSISTENT_HASHER_CALLOC(n, sizeof(int));
+  int *run_from = CONSISTENT_HASHER_CALLOC(n, sizeof(int));
+  int *run_to = CONSISTENT_HASHER_CALLOC(n, sizeof(int));
+  uint64_t *run_arcs = CONSISTENT_HASHER_CALLOC(n, sizeof(uint64_t));
+  // Runs grouped by the owner giving them up
+  int *by_owner = CONSISTENT_HASHER_CALLOC(n, sizeof(int));
+  ConsistentHasherError err = CONSISTENT_HASHER_OK;
+  if (!owners || !removed || !loads || !gains || !offsets || !ring
+      || !run_from || !run_to || !run_arcs || !by_owner)
+  {
+    err = CONSISTENT_HASHER_ERROR_ALLOCATION;
+    goto done;
+  }
+
+  owners_len = 0;
+  for (int i = 0; i < n; ++i)
+    if (i == 0 || ch->points[i].owner != ch->points[i - 1].owner)
+      owners[owners_len++] = ch->points[i].owner;
+  for (int i = 0; i < n; ++i)
+  {
+    int lo = 0, hi = owners_len - 1;
+    while (lo < hi)
     {
-      if (index) *index = start;
-      return true;
+      int mid = lo + (hi - lo) / 2;
+      if (owners[mid] < ch->nodes[i].owner) lo = mid + 1;
+      else hi = mid;
     }
-    
-    if (ch->nodes[mid].position > position)
+    ring[i] = lo;
+  }
+
+  for (int round = 0; round < k; ++round)
+  {
+    // Loads of the nodes left
+    int last = n - 1;
+    while (last >= 0 && removed[ring[last]]) last--;
+    if (last < 0) break;
+    for (int o = 0; o < owners_len; ++o) loads[o] = 0;
+    unsigned int previous = ch->nodes[last].position;
+    for (int i = 0; i < n; ++i)
     {
-      end = mid - 1;
+      if (removed[ring[i]]) continue;
+      loads[ring[i]] +=
+        _consistent_hasher_arc_length(ch, previous, ch->nodes[i].position);
+      previous = ch->nodes[i].position;
     }
-    else if (ch->nodes[mid].position < position)
+
+    int left = 0;
+    uint64_t total = 0;
+    int top = -1, second = -1;
+    for (int o = 0; o < owners_len; ++o)
     {
-      start = mid + 1;
+      if (removed[o]) continue;
+      left++;
+      total += loads[o];
+      if (top < 0 || loads[o] > loads[top])
+      {
+        second = top;
+        top = o;
+      }
+      else if (second < 0 || loads[o] > loads[second])
+        second = o;
     }
+    if (left < 2) break;
 
-    mid = (end - start) / 2 + start;
+    // Runs of points with the same owner, from a point that starts
+    // one, each handing its arcs to the next run
+    int start = -1, before = last;
+    for (int i = 0; i < n; ++i)
+    {
+      if (removed[ring[i]]) continue;
+      if (ring[i] != ring[before])
+      {
+        start = i;
+        break;
+      }
+      before = i;
+    }
+    int runs = 0;
+    uint64_t arc = 0;
+    previous = ch->nodes[before].position;
+    for (int step = 0; step < n; ++step)
+    {
+      int i = (start + step) % n;
+      if (removed[ring[i]]) continue;
+      arc += _consistent_hasher_arc_length(ch, previous, ch->nodes[i].position);
+      previous = ch->nodes[i].position;
+
+      int next = (i + 1) % n;
+      while (removed[ring[next]]) next = (next + 1) % n;
+      if (ring[next] == ring[i]) continue;
+      run_from[runs] = ring[i];
+      run_to[runs] = ring[next];
+      run_arcs[runs++] = arc;
+      arc = 0;
+    }
+
+    // Group the runs by owner
+    for (int o = 0; o <= owners_len; ++o) offsets[o] = 0;
+    for (int r = 0; r < runs; ++r) offsets[run_from[r] + 1]++;
+    for (int o = 0; o < owners_len; ++o) offsets[o + 1] += offsets[o];
+    for (int r = 0; r < runs; ++r) by_owner[offsets[run_from[r]]++] = r;
+    for (int o = owners_len; o > 0; --o) offsets[o] = offsets[o - 1];
+    offsets[0] = 0;
+
+    int best = -1;
+    double best_cost = 0, best_imbalance = 0;
+    double mean = (double) total / (left - 1);
+    for (int o = 0; o < owners_len; ++o)
+    {
+      if (removed[o]) continue;
+      uint64_t biggest = loads[(o == top) ? second : top];
+      for (int r = offsets[o]; r < offsets[o + 1]; ++r)
+        gains[run_to[by_owner[r]]] += run_arcs[by_owner[r]];
+      for (int r = offsets[o]; r < offsets[o + 1]; ++r)
+      {
+        int to = run_to[by_owner[r]];
+        if (loads[to] + gains[to] > biggest) biggest = loads[to] + gains[to];
+      }
+      for (int r = offsets[o]; r < offsets[o + 1]; ++r)
+        gains[run_to[by_owner[r]]] = 0;
+
+      double imbalance = (double) biggest / mean;
+      double cost = (double) loads[o] / mean + imbalance;
+      if (best < 0 || cost < best_cost)
+      {
+        best = o;
+        best_cost = cost;
+        best_imbalance = imbalance;
+      }
+    }
+
+    removed[best] = true;
+    ranking[(*len)++] = (ConsistentHasherScaleIn) {
+      .node = owners[best],
+      .movement = loads[best],
+      .imbalance = best_imbalance,
+    };
   }
 
-  if (index) *index = mid;
-  return false;
+ done:
+  if (owners) CONSISTENT_HASHER_FREE(owners);
+  if (removed) CONSISTENT_HASHER_FREE(removed);
+  if (loads) CONSISTENT_HASHER_FREE(loads);
+  if (gains) CONSISTENT_HASHER_FREE(gains);
+  if (offsets) CONSISTENT_HASHER_FREE(offsets);
+  if (ring) CONSISTENT_HASHER_FREE(ring);
+  if (run_from) CONSISTENT_HASHER_FREE(run_from);
+  if (run_to) CONSISTENT_HASHER_FREE(run_to);
+  if (run_arcs) CONSISTENT_HASHER_FREE(run_arcs);
+  if (by_owner) CONSISTENT_HASHER_FREE(by_owner);
+  return err;
 }
 
 ConsistentHasherError
-consistent_hasher_insert_node(ConsistentHasher *ch,
-                              ConsistentHasherHash node_hash)
+consistent_hasher_assignment_init(ConsistentHasherAssignment *assignment,
+                                  int partitions)
 {
-  if (!ch) return CONSISTENT_HASHER_ERROR_IS_NULL;
+  if (!assignment) return CONSISTENT_HASHER_ERROR_IS_NULL;
+  if (partitions < 1) return CONSISTENT_HASHER_ERROR_INVALID;
 
-  ConsistentHasherNode new_node = (ConsistentHasherNode) {
-    .hash = node_hash,
-    .position = node_hash % ch->ring_size,
+  *assignment = (ConsistentHasherAssignment) {
+    .partitions = partitions,
+    .owners = CONSISTENT_HASHER_CALLOC(partitions, sizeof(ConsistentHasherHash)),
+    .next = CONSISTENT_HASHER_CALLOC(partitions, sizeof(ConsistentHasherHash)),
+    .order = CONSISTENT_HASHER_CALLOC(partitions, sizeof(int)),
+    .positions = CONSISTENT_HASHER_CALLOC(partitions, sizeof(unsigned int)),
+    .ring_size = 0,
+    .sorted = false,
+    .assigned = false,
   };
-  
-  if (!ch->nodes)
+  if (!assignment->owners || !assignment->next || !assignment->order
+      || !assignment->positions)
   {
-    ch->nodes = CONSISTENT_HASHER_CALLOC(CONSISTENT_HASHER_INITIAL_CAPACITY,
-                                         sizeof(ConsistentHasherNode));
-    if (!ch->nodes) return CONSISTENT_HASHER_ERROR_ALLOCATION;
+    consistent_hasher_assignment_destroy(assignment);
+    return CONSISTENT_HASHER_ERROR_ALLOCATION;
+  }
 
-    ch->nodes_capacity = CONSISTENT_HASHER_INITIAL_CAPACITY;
-    ch->nodes[0] = new_node;
-    ch->nodes_len = 1;
-    goto done;
+  return CONSISTENT_HASHER_OK;
+}
+
+void
+consistent_hasher_assignment_destroy(ConsistentHasherAssignment *assignment)
+{
+  if (!assignment) return;
+
+  if (assignment->owners) CONSISTENT_HASHER_FREE(assignment->owners);
+  if (assignment->next) CONSISTENT_HASHER_FREE(assignment->next);
+  if (assignment->order) CONSISTENT_HASHER_FREE(assignment->order);
+  if (assignment->positions) CONSISTENT_HASHER_FREE(assignment->positions);
+  assignment->owners = NULL;
+  assignment->next = NULL;
+  assignment->order = NULL;
+  assignment->positions = NULL;
+  assignment->partitions = 0;
+
+  return;
+}
+
+ConsistentHasherHash consistent_hasher_partition_hash(int partition)
+{
+  // Not the slot hashes, so that both can share a ring
+  return consistent_hasher_point_hash((ConsistentHasherHash) partition, 1);
+}
+
+// Move entry [i] of the heap of [len] partitions of [assignment] down
+// to its place, keeping the biggest position on top
+void _consistent_hasher_assignment_sift(ConsistentHasherAssignment *assignment,
+                                        int i,
+                                        int len)
+{
+  unsigned int *positions = assignment->positions;
+  int *order = assignment->order;
+  for (;;)
+  {
+    int child = 2 * i + 1;
+    if (child >= len) break;
+    if (child + 1 < len && positions[child + 1] > positions[child]) child++;
+    if (positions[child] <= positions[i]) break;
+
+    unsigned int position = positions[i];
+    positions[i] = positions[child];
+    positions[child] = position;
+    int partition = order[i];
+    order[i] = order[child];
+    order[child] = partition;
+    i = child;
   }
+  return;
+}
 
-  int index;
-  bool found = _consistent_hasher_binary_search(ch, node_hash, &index);
-  if (found) return CONSISTENT_HASHER_ERROR_NODE_PRESENT;
+// Sort the partitions of [assignment] by their position in [ch], in
+// place
+void _consistent_hasher_assignment_sort(ConsistentHasherAssignment *assignment,
+                                        ConsistentHasher *ch)
+{
+  int len = assignment->partitions;
+  for (int i = 0; i < len; ++i)
+  {
+    assignment->order[i] = i;
+    assignment->positions[i] = _consistent_hasher_position(ch,
+                                 consistent_hasher_partition_hash(i));
+  }
+
+  // Heap sort
+  for (int i = len / 2 - 1; i >= 0; --i)
+    _consistent_hasher_assignment_sift(assignment, i, len);
+  for (int end = len - 1; end > 0; --end)
+  {
+    unsigned int position = assignment->positions[0];
+    assignment->positions[0] = assignment->positions[end];
+    assignment->positions[end] = position;
+    int partition = assignment->order[0];
+    assignment->order[0] = assignment->order[end];
+    assignment->order[end] = partition;
+    _consistent_hasher_assignment_sift(assignment, 0, end);
+  }
+
+  assignment->ring_size = ch->ring_size;
+  assignment->sorted = true;
+  return;
+}
+
+int consistent_hasher_assign(ConsistentHasherAssignment *assignment,
+                             ConsistentHasher *ch,
+                             ConsistentHasherPartitionMove *moves,
+                             int max)
+{
+  if (!assignment || !assignment->owners || !ch || ch->nodes_len == 0)
+    return 0;
+
+  if (!assignment->sorted || assignment->ring_size != ch->ring_size)
+    _consistent_hasher_assignment_sort(assignment, ch);
+
+  // Partitions and points are both in ring order, walk them together
+  int point = 0;
+  for (int i = 0; i < assignment->partitions; ++i)
+  {
+    unsigned int position = assignment->positions[i];
+    while (point < ch->nodes_len && ch->nodes[point].position < position)
+      point++;
+    ConsistentHasherHash owner = (point < ch->nodes_len)
+      ? ch->nodes[point].owner : ch->nodes[0].owner;
+
+    int partition = assignment->order[i];
+    if (ch->overrides)
+      consistent_hasher_overrides_find(ch->overrides,
+        consistent_hasher_partition_hash(partition), &owner);
+    assignment->next[partition] = owner;
+  }
+
+  int moved = 0;
+  for (int partition = 0; partition < assignment->partitions; ++partition)
+  {
+    ConsistentHasherHash from = assignment->owners[partition];
+    ConsistentHasherHash to = assignment->next[partition];
+    assignment->owners[partition] = to;
+    if (!assignment->assigned || from == to) continue;
+
+    if (moves && moved < max)
+      moves[moved] = (ConsistentHasherPartitionMove) {
+        .partition = partition,
+        .from = from,
+        .to = to,
+      };
+    moved++;
+  }
+  assignment->assigned = true;
+
+  return moved;
+}
+
+// Bit [bit] of [hash], counting from the most significant one
+#define _CONSISTENT_HASHER_XOR_BIT(hash, bit) \
+  ((int)(((hash) >> (CONSISTENT_HASHER_XOR_BITS - 1 - (bit))) & 1))
+
+// First bit where [a] and [b] differ, counting from the most
+// significant one
+int _consistent_hasher_xor_crit_bit(ConsistentHasherHash a,
+                                    ConsistentHasherHash b)
+{
+  ConsistentHasherHash x = a ^ b;
+#if defined(__GNUC__)
+  return __builtin_clzll((unsigned long long) x)
+    - (64 - CONSISTENT_HASHER_XOR_BITS);
+#else
+  int bit = 0;
+  while (!_CONSISTENT_HASHER_XOR_BIT(x, bit)) bit++;
+  return bit;
+#endif
+}
+
+// Slot of [trie] that refers to [target], found following the bits
+// of [hash], or NULL
+int *_consistent_hasher_xor_slot(ConsistentHasherXorTrie *trie,
+                                 ConsistentHasherHash hash,
+                                 int target)
+{
+  int *slot = &trie->root;
+  while (*slot != target && *slot >= 0)
+  {
+    ConsistentHasherXorBranch *branch = &trie->branches[*slot];
+    slot = &branch->children[_CONSISTENT_HASHER_XOR_BIT(hash, branch->bit)];
+  }
+  return (*slot == target) ? slot : NULL;
+}
+
+void consistent_hasher_xor_init(ConsistentHasherXorTrie *trie)
+{
+  if (!trie) return;
+
+  *trie = (ConsistentHasherXorTrie) {
+    .branches = NULL,
+    .nodes = NULL,
+    .root = 0,
+    .len = 0,
+    .capacity = 0,
+  };
   
-  if (ch->nodes_capacity == ch->nodes_len)
+  return;
+}
+
+void consistent_hasher_xor_destroy(ConsistentHasherXorTrie *trie)
+{
+  if (!trie) return;
+
+  if (trie->branches) CONSISTENT_HASHER_FREE(trie->branches);
+  if (trie->nodes) CONSISTENT_HASHER_FREE(trie->nodes);
+  consistent_hasher_xor_init(trie);
+  
+  return;
+}
+
+ConsistentHasherError
+consistent_hasher_xor_insert(ConsistentHasherXorTrie *trie,
+                             ConsistentHasherHash node_hash)
+{
+  if (!trie) return CONSISTENT_HASHER_ERROR_IS_NULL;
+
+  if (trie->len == trie->capacity)
   {
-    unsigned int new_capacity = ch->nodes_capacity * 2;
-    ConsistentHasherNode *new_nodes =
-      CONSISTENT_HASHER_CALLOC(new_capacity,
-                               sizeof(ConsistentHasherNode));
-    if (!new_nodes) return CONSISTENT_HASHER_ERROR_ALLOCATION;
+    int capacity = (trie->capacity)
+      ? trie->capacity * 2 : CONSISTENT_HASHER_INITIAL_CAPACITY;
+    ConsistentHasherXorBranch *branches =
+      CONSISTENT_HASHER_CALLOC(capacity, sizeof(ConsistentHasherXorBranch));
+    ConsistentHasherHash *nodes =
+      CONSISTENT_HASHER_CALLOC(capacity, sizeof(ConsistentHasherHash));
+    if (!branches || !nodes)
+    {
+      if (branches) CONSISTENT_HASHER_FREE(branches);
+      if (nodes) CONSISTENT_HASHER_FREE(nodes);
+      return CONSISTENT_HASHER_ERROR_ALLOCATION;
+    }
 
-    for (int i = 0; i < ch->nodes_capacity; ++i)
+    for (int i = 0; i < trie->len; ++i)
     {
-      new_nodes[ (i >= index && i < ch->nodes_capacity) ? i+1 : i ] =
-        ch->nodes[i];
+      nodes[i] = trie->nodes[i];
+      if (i < trie->len - 1) branches[i] = trie->branches[i];
     }
-    CONSISTENT_HASHER_FREE(ch->nodes);
+    if (trie->branches) CONSISTENT_HASHER_FREE(trie->branches);
+    if (trie->nodes) CONSISTENT_HASHER_FREE(trie->nodes);
+    trie->branches = branches;
+    trie->nodes = nodes;
+    trie->capacity = capacity;
+  }
 
-    ch->nodes = new_nodes;
-    ch->nodes_capacity = new_capacity;
-    ch->nodes[index] = new_node;
-    ch->nodes_len += 1;
-    goto done;
+  int node = trie->len;
+  if (node == 0)
+  {
+    trie->nodes[0] = node_hash;
+    trie->root = ~0;
+    trie->len = 1;
+    return CONSISTENT_HASHER_OK;
   }
 
-  for (int i = ch->nodes_len - 1; i > index + 1; --i)
+  // The closest node shares the longest prefix, the new branch goes
+  // where the two differ
+  ConsistentHasherHash closest = consistent_hasher_xor_nearest(trie, node_hash);
+  if (closest == node_hash) return CONSISTENT_HASHER_ERROR_NODE_PRESENT;
+  int bit = _consistent_hasher_xor_crit_bit(closest, node_hash);
+
+  int *slot = &trie->root;
+  while (*slot >= 0 && trie->branches[*slot].bit < bit)
   {
-    ch->nodes[i] = ch->nodes[i - 1];
+    ConsistentHasherXorBranch *branch = &trie->branches[*slot];
+    slot = &branch->children[_CONSISTENT_HASHER_XOR_BIT(node_hash, branch->bit)];
   }
-  ch->nodes[index] = new_node;
-  ch->nodes_len += 1;
+
+  int side = _CONSISTENT_HASHER_XOR_BIT(node_hash, bit);
+  ConsistentHasherXorBranch *branch = &trie->branches[node - 1];
+  branch->bit = bit;
+  branch->children[side] = ~node;
+  branch->children[!side] = *slot;
+  *slot = node - 1;
+  trie->nodes[node] = node_hash;
+  trie->len++;
   
- done:
   return CONSISTENT_HASHER_OK;
 }
 
 ConsistentHasherError
-consistent_hasher_delete_node(ConsistentHasher *ch,
-                              ConsistentHasherHash node_hash)
+consistent_hasher_xor_delete(ConsistentHasherXorTrie *trie,
+                             ConsistentHasherHash node_hash)
 {
-  if (!ch) return CONSISTENT_HASHER_ERROR_IS_NULL;
+  if (!trie) return CONSISTENT_HASHER_ERROR_IS_NULL;
+  if (trie->len == 0) return CONSISTENT_HASHER_OK;
 
-  int index;
-  bool found = _consistent_hasher_binary_search(ch, node_hash, &index);
-  if (!found)
+  int *parent = NULL;
+  int *slot = &trie->root;
+  while (*slot >= 0)
   {
-    goto done;
+    ConsistentHasherXorBranch *branch = &trie->branches[*slot];
+    parent = slot;
+    slot = &branch->children[_CONSISTENT_HASHER_XOR_BIT(node_hash, branch->bit)];
   }
+  int node = ~*slot;
+  if (trie->nodes[node] != node_hash) return CONSISTENT_HASHER_OK;
 
-  if (ch->nodes_len - 1 == ch->nodes_capacity / 2)
+  trie->len--;
+  if (!parent) return CONSISTENT_HASHER_OK;
+
+  // The sibling takes the place of the parent branch
+  int removed = *parent;
+  ConsistentHasherXorBranch *branch = &trie->branches[removed];
+  *parent = branch->children[&branch->children[0] == slot];
+
+  // Keep the arrays dense by moving the last node and branch into
+  // the holes
+  int last = trie->len;
+  if (node != last)
   {
-    ConsistentHasherNode *new_nodes =
-      CONSISTENT_HASHER_CALLOC(ch->nodes_len - 1,
-                             sizeof(ConsistentHasherNode));
-    if (!new_nodes) return CONSISTENT_HASHER_ERROR_ALLOCATION;
-    
-    for (int i = 0; i < ch->nodes_len - 1; ++i)
-    {
-      new_nodes[i] = ch->nodes[ (i < index) ? i : i+1 ];
-    }
-    CONSISTENT_HASHER_FREE(ch->nodes);
-    
-    ch->nodes = new_nodes;
-    ch->nodes_len = ch->nodes_len - 1;
-    ch->nodes_capacity = ch->nodes_len;
-    goto done;
+    *_consistent_hasher_xor_slot(trie, trie->nodes[last], ~last) = ~node;
+    trie->nodes[node] = trie->nodes[last];
   }
-
-  for (int i = index; i < ch->nodes_len - 2; ++i)
+  last = trie->len - 1;
+  if (removed != last)
   {
-    ch->nodes[i] = ch->nodes[i+1];
+    // Any node below the last branch leads to it
+    int below = last;
+    while (below >= 0) below = trie->branches[below].children[0];
+    *_consistent_hasher_xor_slot(trie, trie->nodes[~below], last) = removed;
+    trie->branches[removed] = trie->branches[last];
   }
-  ch->nodes_len = ch->nodes_len - 1;
   
- done:
   return CONSISTENT_HASHER_OK;
 }
 
 ConsistentHasherHash
-consistent_hasher_get_node_of(ConsistentHasher *ch,
+consistent_hasher_xor_nearest(const ConsistentHasherXorTrie *trie,
                               ConsistentHasherHash item_hash)
 {
-  int index;
-  _consistent_hasher_binary_search(ch, item_hash, &index);
-  if (item_hash % ch->ring_size > ch->nodes[index].position)
-    index = 0;
+  // The subtree agreeing on the tested bit is closer than the other
+  // one, whatever the lower bits
+  int ref = trie->root;
+  while (ref >= 0)
+  {
+    const ConsistentHasherXorBranch *branch = &trie->branches[ref];
+    ref = branch->children[_CONSISTENT_HASHER_XOR_BIT(item_hash, branch->bit)];
+  }
+  return trie->nodes[~ref];
+}
+
+int consistent_hasher_xor_k_nearest(const ConsistentHasherXorTrie *trie,
+                                    ConsistentHasherHash item_hash,
+                                    ConsistentHasherHash *nodes,
+                                    int k)
+{
+  if (!trie || !nodes || trie->len == 0) return 0;
+
+  // Visit the closer subtree first, the other ones wait on the stack,
+  // which holds at most one per bit
+  int stack[CONSISTENT_HASHER_XOR_BITS + 1];
+  int top = 0;
+  int found = 0;
+  stack[top++] = trie->root;
+  while (top > 0 && found < k)
+  {
+    int ref = stack[--top];
+    while (ref >= 0)
+    {
+      const ConsistentHasherXorBranch *branch = &trie->branches[ref];
+      int side = _CONSISTENT_HASHER_XOR_BIT(item_hash, branch->bit);
+      stack[top++] = branch->children[!side];
+      ref = branch->children[side];
+    }
+    nodes[found++] = trie->nodes[~ref];
+  }
   
-  return ch->nodes[index].hash;
+  return found;
 }
   
 #endif // CONSISTENT_HASHER_IMPLEMENTATION
@@ -391,7 +5861,7 @@ int main(void)
 #endif // 0
 
   
-#ifdef _cplusplus
+#ifdef __cplusplus
 }
 #endif
 
@@ -0,0 +1,361 @@
+// SPDX-License-Identifier: MIT
+//
+// Contention benchmark
+// --------------------
+//
+// Runs lookup threads against a shared ring while a writer inserts
+// and deletes points at a fixed rate, and reports the lookup
+// throughput, the lookup latency percentiles and the writer latency
+// percentiles for each way of sharing the ring:
+//
+//   rwlock   ConsistentHasherRwLock
+//   pthread  pthread_rwlock_t
+//   mutex    pthread_mutex_t
+//
+// Usage:
+//
+//   ./contention [-t readers] [-r writes/s] [-d seconds] [-n nodes]
+//                [-w weight]
+//
+// Latencies include waiting for the lock. One lookup in
+// SAMPLE_EVERY is timed, so that the clock does not dominate.
+//
+
+#define _POSIX_C_SOURCE 200112L
+
+#define CONSISTENT_HASHER_IMPLEMENTATION
+#include "consistent-hasher.h"
+
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#define SAMPLE_EVERY 64
+#define MAX_SAMPLES (1 << 20)
+#define RING_SIZE 0xFFFFFFFFu
+
+typedef enum {
+  SCHEME_RWLOCK = 0,
+  SCHEME_PTHREAD,
+  SCHEME_MUTEX,
+  SCHEME_MAX,
+} Scheme;
+
+const char *scheme_names[SCHEME_MAX] = { "rwlock", "pthread", "mutex" };
+
+typedef struct {
+  Scheme scheme;
+  ConsistentHasher ch;
+  ConsistentHasherRwLock rwlock;
+  pthread_rwlock_t pthread_rwlock;
+  pthread_mutex_t mutex;
+  // Set to stop the threads
+  int stop;
+} Shared;
+
+typedef struct {
+  Shared *shared;
+  unsigned int seed;
+  long ops;
+  // Latencies in ns
+  double *samples;
+  long samples_len;
+  // Writer only
+  double rate;
+  int nodes;
+} Thread;
+
+double now_ns(void)
+{
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec * 1e9 + ts.tv_nsec;
+}
+
+void read_lock(Shared *s)
+{
+  switch (s->scheme)
+  {
+  case SCHEME_RWLOCK: consistent_hasher_rwlock_read_lock(&s->rwlock); break;
+  case SCHEME_PTHREAD: pthread_rwlock_rdlock(&s->pthread_rwlock); break;
+  default: pthread_mutex_lock(&s->mutex); break;
+  }
+}
+
+void read_unlock(Shared *s)
+{
+  switch (s->scheme)
+  {
+  case SCHEME_RWLOCK: consistent_hasher_rwlock_read_unlock(&s->rwlock); break;
+  case SCHEME_PTHREAD: pthread_rwlock_unlock(&s->pthread_rwlock); break;
+  default: pthread_mutex_unlock(&s->mutex); break;
+  }
+}
+
+void write_lock(Shared *s)
+{
+  switch (s->scheme)
+  {
+  case SCHEME_RWLOCK: consistent_hasher_rwlock_write_lock(&s->rwlock); break;
+  case SCHEME_PTHREAD: pthread_rwlock_wrlock(&s->pthread_rwlock); break;
+  default: pthread_mutex_lock(&s->mutex); break;
+  }
+}
+
+void write_unlock(Shared *s)
+{
+  switch (s->scheme)
+  {
+  case SCHEME_RWLOCK: consistent_hasher_rwlock_write_unlock(&s->rwlock); break;
+  case SCHEME_PTHREAD: pthread_rwlock_unlock(&s->pthread_rwlock); break;
+  default: pthread_mutex_unlock(&s->mutex); break;
+  }
+}
+
+unsigned int next_random(unsigned int *state)
+{
+  *state ^= *state << 13;
+  *state ^= *state >> 17;
+  *state ^= *state << 5;
+  return *state;
+}
+
+void record(Thread *t, double ns)
+{
+  if (t->samples_len < MAX_SAMPLES) t->samples[t->samples_len++] = ns;
+}
+
+void *reader(void *arg)
+{
+  Thread *t = arg;
+  Shared *s = t->shared;
+  ConsistentHasherHash sink = 0;
+
+  while (!__atomic_load_n(&s->stop, __ATOMIC_RELAXED))
+  {
+    for (int i = 0; i < SAMPLE_EVERY - 1; ++i)
+    {
+      ConsistentHasherHash item = next_random(&t->seed);
+      read_lock(s);
+      sink ^= consistent_hasher_get_node_of(&s->ch, item);
+      read_unlock(s);
+    }
+
+    ConsistentHasherHash item = next_random(&t->seed);
+    double start = now_ns();
+    read_lock(s);
+    sink ^= consistent_hasher_get_node_of(&s->ch, item);
+    read_unlock(s);
+    record(t, now_ns() - start);
+    t->ops += SAMPLE_EVERY;
+  }
+
+  // Keep the lookups from being optimized away
+  t->seed ^= (unsigned int) sink;
+  return NULL;
+}
+
+void *writer(void *arg)
+{
+  Thread *t = arg;
+  Shared *s = t->shared;
+  if (t->rate <= 0) return NULL;
+
+  // Move points of random nodes around, keeping the size steady
+  double period = 1e9 / t->rate;
+  double next = now_ns();
+  while (!__atomic_load_n(&s->stop, __ATOMIC_RELAXED))
+  {
+    ConsistentHasherHash node = 1 + next_random(&t->seed) % t->nodes;
+    ConsistentHasherHash point = next_random(&t->seed);
+    ConsistentHasherHash old = 0;
+
+    double start = now_ns();
+    write_lock(s);
+    int len;
+    const ConsistentHasherNode *points =
+      consistent_hasher_points_of(&s->ch, node, &len);
+    if (points) old = points[point % len].hash;
+    if (consistent_hasher_insert_point(&s->ch, node, point)
+        == CONSISTENT_HASHER_OK && points)
+      consistent_hasher_delete_node(&s->ch, old);
+    write_unlock(s);
+    record(t, now_ns() - start);
+    t->ops++;
+
+    next += period;
+    double wait = next - now_ns();
+    if (wait > 0)
+    {
+      struct timespec ts = {
+        .tv_sec = (time_t)(wait / 1e9),
+        .tv_nsec = (long)(wait - (double)(time_t)(wait / 1e9) * 1e9),
+      };
+      nanosleep(&ts, NULL);
+    }
+  }
+
+  return NULL;
+}
+
+int compare_doubles(const void *a, const void *b)
+{
+  double x = *(const double*) a, y = *(const double*) b;
+  return (x > y) - (x < y);
+}
+
+// Merge the samples of [threads] and sort them
+double *merge(Thread *threads, int n, long *len)
+{
+  *len = 0;
+  for (int i = 0; i < n; ++i) *len += threads[i].samples_len;
+  double *all = malloc((*len + 1) * sizeof(double));
+  if (!all) return NULL;
+
+  long k = 0;
+  for (int i = 0; i < n; ++i)
+  {
+    memcpy(all + k, threads[i].samples,
+           threads[i].samples_len * sizeof(double));
+    k += threads[i].samples_len;
+  }
+  qsort(all, *len, sizeof(double), compare_doubles);
+  return all;
+}
+
+double percentile(const double *sorted, long len, double p)
+{
+  if (len == 0) return 0;
+  long i = (long)(p * (len - 1));
+  return sorted[i];
+}
+
+int run(Scheme scheme, int readers, double rate, double seconds,
+        int nodes, int weight)
+{
+  Shared shared = { .scheme = scheme, .stop = 0 };
+  pthread_rwlock_init(&shared.pthread_rwlock, NULL);
+  pthread_mutex_init(&shared.mutex, NULL);
+  consistent_hasher_init(&shared.ch, RING_SIZE);
+  for (int node = 1; node <= nodes; ++node)
+  {
+    if (consistent_hasher_set_node_weight(&shared.ch, node, weight)
+        != CONSISTENT_HASHER_OK)
+    {
+      fprintf(stderr, "Error adding node %d\n", node);
+      return 1;
+    }
+  }
+
+  Thread *threads = calloc(readers + 1, sizeof(Thread));
+  pthread_t *ids = calloc(readers + 1, sizeof(pthread_t));
+  if (!threads || !ids)
+  {
+    fprintf(stderr, "Out of memory\n");
+    return 1;
+  }
+  for (int i = 0; i <= readers; ++i)
+  {
+    threads[i] = (Thread) {
+      .shared = &shared,
+      .seed = 2463534242u + 7919u * i,
+      .samples = malloc(MAX_SAMPLES * sizeof(double)),
+      .rate = rate,
+      .nodes = nodes,
+    };
+    if (!threads[i].samples)
+    {
+      fprintf(stderr, "Out of memory\n");
+      return 1;
+    }
+  }
+
+  // The writer is the last thread
+  double start = now_ns();
+  for (int i = 0; i < readers; ++i)
+    pthread_create(&ids[i], NULL, reader, &threads[i]);
+  pthread_create(&ids[readers], NULL, writer, &threads[readers]);
+
+  struct timespec ts = {
+    .tv_sec = (time_t) seconds,
+    .tv_nsec = (long)((seconds - (double)(time_t) seconds) * 1e9),
+  };
+  nanosleep(&ts, NULL);
+  __atomic_store_n(&shared.stop, 1, __ATOMIC_RELAXED);
+  for (int i = 0; i <= readers; ++i) pthread_join(ids[i], NULL);
+  double elapsed = (now_ns() - start) / 1e9;
+
+  long lookups = 0;
+  for (int i = 0; i < readers; ++i) lookups += threads[i].ops;
+  long lookup_len, write_len;
+  double *lookup = merge(threads, readers, &lookup_len);
+  double *write = merge(threads + readers, 1, &write_len);
+  if (!lookup || !write)
+  {
+    fprintf(stderr, "Out of memory\n");
+    return 1;
+  }
+
+  printf("%-8s %10.2f %8.0f %8.0f %8.0f %8ld %8.1f %8.1f %8.1f\n",
+         scheme_names[scheme], lookups / elapsed / 1e6,
+         percentile(lookup, lookup_len, 0.5),
+         percentile(lookup, lookup_len, 0.99),
+         percentile(lookup, lookup_len, 0.999),
+         threads[readers].ops,
+         percentile(write, write_len, 0.5) / 1e3,
+         percentile(write, write_len, 0.99) / 1e3,
+         (write_len) ? write[write_len - 1] / 1e3 : 0);
+
+  free(lookup);
+  free(write);
+  for (int i = 0; i <= readers; ++i) free(threads[i].samples);
+  free(threads);
+  free(ids);
+  consistent_hasher_destroy(&shared.ch);
+  pthread_rwlock_destroy(&shared.pthread_rwlock);
+  pthread_mutex_destroy(&shared.mutex);
+  return 0;
+}
+
+int main(int argc, char **argv)
+{
+  int readers = 4, nodes = 64, weight = 100;
+  double rate = 1000, seconds = 2;
+
+  int opt;
+  while ((opt = getopt(argc, argv, "t:r:d:n:w:")) != -1)
+  {
+    switch (opt)
+    {
+    case 't': readers = atoi(optarg); break;
+    case 'r': rate = atof(optarg); break;
+    case 'd': seconds = atof(optarg); break;
+    case 'n': nodes = atoi(optarg); break;
+    case 'w': weight = atoi(optarg); break;
+    default:
+      fprintf(stderr,
+              "Usage: %s [-t readers] [-r writes/s] [-d seconds] "
+              "[-n nodes] [-w weight]\n", argv[0]);
+      return 1;
+    }
+  }
+  if (readers < 1 || nodes < 1 || weight < 1 || seconds <= 0)
+  {
+    fprintf(stderr, "Invalid arguments\n");
+    return 1;
+  }
+
+  printf("%d readers, %.0f writes/s, %d nodes x %d points, %.1f s\n",
+         readers, rate, nodes, weight, seconds);
+  printf("%-8s %10s %8s %8s %8s %8s %8s %8s %8s\n", "scheme",
+         "Mlookup/s", "p50 ns", "p99 ns", "p999 ns",
+         "writes", "p50 us", "p99 us", "max us");
+  for (int scheme = 0; scheme < SCHEME_MAX; ++scheme)
+    if (run((Scheme) scheme, readers, rate, seconds, nodes, weight) != 0)
+      return 1;
+
+  return 0;
+}
@@ -0,0 +1,314 @@
+// SPDX-License-Identifier: MIT
+//
+// Bulk key mapper
+// ---------------
+//
+// Maps every key of a file to its owner, using all the cores, and
+// prints how many keys each owner got. With -o, the keys are also
+// split into one file per owner, ready to be moved.
+//
+// Usage:
+//
+//   ./keymap [options] <keys>
+//
+// Options:
+//
+//   -n <nodes>    number of nodes, named 1 to <nodes> (default 16)
+//   -w <weight>   points per node (default 100)
+//   -r <ring>     ring size (default 1000003)
+//   -s <seed>     seed of the key hash (default 0)
+//   -t <threads>  worker threads (default: one per core)
+//   -b            keys are 8 byte little-endian hashes, instead of
+//                 newline-separated strings hashed with the seed
+//   -o <prefix>   write the keys of node N to <prefix>.N
+//
+// The file is mmapped and split in one chunk per thread, so the run
+// is bounded by the disk rather than by the lookups.
+//
+
+#define _POSIX_C_SOURCE 200112L
+
+#define CONSISTENT_HASHER_IMPLEMENTATION
+#include "consistent-hasher.h"
+
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+// Keys hashed at once with consistent_hasher_hash_keys
+#define BATCH 64
+// Bytes buffered per thread and owner before writing them out
+#define OUT_BUFFER (16 * 1024)
+
+typedef struct {
+  FILE *file;
+  pthread_mutex_t lock;
+} Output;
+
+typedef struct {
+  ConsistentHasher *ch;
+  const unsigned char *begin;
+  const unsigned char *end;
+  bool binary;
+  int nodes;
+  // One per node, or NULL
+  Output *outputs;
+  // Keys per node
+  long *counts;
+  // OUT_BUFFER bytes per node
+  unsigned char *buffers;
+  size_t *buffered;
+  bool failed;
+} Worker;
+
+void flush(Worker *w, int node)
+{
+  Output *out = &w->outputs[node];
+  pthread_mutex_lock(&out->lock);
+  if (fwrite(w->buffers + (size_t) node * OUT_BUFFER, 1, w->buffered[node],
+             out->file) != w->buffered[node])
+    w->failed = true;
+  pthread_mutex_unlock(&out->lock);
+  w->buffered[node] = 0;
+}
+
+void emit(Worker *w, ConsistentHasherHash owner,
+          const unsigned char *key, size_t len)
+{
+  int node = (int) owner - 1;
+  w->counts[node]++;
+  if (!w->outputs) return;
+
+  // Strings get their newline back
+  size_t size = len + !w->binary;
+  if (w->buffered[node] + size > OUT_BUFFER) flush(w, node);
+  if (size > OUT_BUFFER)
+  {
+    pthread_mutex_lock(&w->outputs[node].lock);
+    fwrite(key, 1, len, w->outputs[node].file);
+    fputc('\n', w->outputs[node].file);
+    pthread_mutex_unlock(&w->outputs[node].lock);
+    return;
+  }
+
+  unsigned char *buffer = w->buffers + (size_t) node * OUT_BUFFER;
+  memcpy(buffer + w->buffered[node], key, len);
+  if (!w->binary) buffer[w->buffered[node] + len] = '\n';
+  w->buffered[node] += size;
+}
+
+void *work(void *arg)
+{
+  Worker *w = arg;
+  const void *keys[BATCH];
+  size_t lens[BATCH];
+  ConsistentHasherHash hashes[BATCH];
+
+  const unsigned char *p = w->begin;
+  while (p < w->end)
+  {
+    int n = 0;
+    if (w->binary)
+    {
+      for (; n < BATCH && p + 8 <= w->end; ++n, p += 8)
+      {
+        keys[n] = p;
+        lens[n] = 8;
+        hashes[n] = (ConsistentHasherHash) _consistent_hasher_load64_le(p);
+      }
+      if (n == 0) break;
+    }
+    else
+    {
+      while (n < BATCH && p < w->end)
+      {
+        const unsigned char *line = p;
+        const unsigned char *eol = memchr(p, '\n', (size_t)(w->end - p));
+        if (!eol) eol = w->end;
+        p = eol + 1;
+        if (eol == line) continue;
+        keys[n] = line;
+        lens[n++] = (size_t)(eol - line);
+      }
+      consistent_hasher_hash_keys(w->ch, keys, lens, n, hashes);
+    }
+
+    for (int i = 0; i < n; ++i)
+      emit(w, consistent_hasher_get_node_of(w->ch, hashes[i]),
+           keys[i], lens[i]);
+  }
+
+  if (w->outputs)
+    for (int node = 0; node < w->nodes; ++node)
+      if (w->buffered[node]) flush(w, node);
+
+  return NULL;
+}
+
+int usage(const char *name)
+{
+  fprintf(stderr,
+          "Usage: %s [-n nodes] [-w weight] [-r ring] [-s seed] "
+          "[-t threads] [-b] [-o prefix] <keys>\n", name);
+  return 1;
+}
+
+int main(int argc, char **argv)
+{
+  int nodes = 16, weight = 100, threads = 0;
+  unsigned long ring_size = 1000003;
+  unsigned long long seed = 0;
+  bool binary = false;
+  const char *prefix = NULL;
+
+  int opt;
+  while ((opt = getopt(argc, argv, "n:w:r:s:t:bo:")) != -1)
+  {
+    switch (opt)
+    {
+    case 'n': nodes = atoi(optarg); break;
+    case 'w': weight = atoi(optarg); break;
+    case 'r': ring_size = strtoul(optarg, NULL, 0); break;
+    case 's': seed = strtoull(optarg, NULL, 0); break;
+    case 't': threads = atoi(optarg); break;
+    case 'b': binary = true; break;
+    case 'o': prefix = optarg; break;
+    default: return usage(argv[0]);
+    }
+  }
+  if (optind + 1 != argc || nodes < 1 || weight < 1) return usage(argv[0]);
+  if (threads < 1) threads = (int) sysconf(_SC_NPROCESSORS_ONLN);
+  if (threads < 1) threads = 1;
+  const char *path = argv[optind];
+
+  int fd = open(path, O_RDONLY);
+  struct stat st;
+  if (fd < 0 || fstat(fd, &st) != 0)
+  {
+    perror(path);
+    return 1;
+  }
+  size_t size = (size_t) st.st_size;
+  const unsigned char *data = NULL;
+  if (size > 0)
+  {
+    data = mmap(NULL, size, PROT_READ, MAP_PRIVATE, fd, 0);
+    if (data == MAP_FAILED)
+    {
+      perror(path);
+      return 1;
+    }
+    posix_madvise((void*) data, size, POSIX_MADV_SEQUENTIAL);
+  }
+  close(fd);
+
+  ConsistentHasher ch;
+  consistent_hasher_init(&ch, (unsigned int) ring_size);
+  consistent_hasher_set_seed(&ch, seed, 0);
+  for (int node = 1; node <= nodes; ++node)
+  {
+    if (consistent_hasher_set_node_weight(&ch, node, weight)
+        != CONSISTENT_HASHER_OK)
+    {
+      fprintf(stderr, "Error adding node %d\n", node);
+      return 1;
+    }
+  }
+
+  Output *outputs = NULL;
+  if (prefix)
+  {
+    outputs = calloc(nodes, sizeof(Output));
+    size_t name_len = strlen(prefix) + 16;
+    char *name = malloc(name_len);
+    for (int node = 0; outputs && name && node < nodes; ++node)
+    {
+      snprintf(name, name_len, "%s.%d", prefix, node + 1);
+      outputs[node].file = fopen(name, "wb");
+      if (!outputs[node].file)
+      {
+        perror(name);
+        return 1;
+      }
+      pthread_mutex_init(&outputs[node].lock, NULL);
+    }
+    free(name);
+  }
+
+  // Split the file, keeping whole keys in each chunk
+  Worker *workers = calloc(threads, sizeof(Worker));
+  pthread_t *ids = calloc(threads, sizeof(pthread_t));
+  if (!workers || !ids || (prefix && !outputs))
+  {
+    fprintf(stderr, "Out of memory\n");
+    return 1;
+  }
+  const unsigned char *begin = data;
+  for (int t = 0; t < threads; ++t)
+  {
+    const unsigned char *end = data + size * (t + 1) / threads;
+    if (binary)
+      end = data + (size_t)(end - data) / 8 * 8;
+    else
+      while (end < data + size && end > begin && end[-1] != '\n') end++;
+    if (end < begin) end = begin;
+
+    workers[t] = (Worker) {
+      .ch = &ch,
+      .begin = begin,
+      .end = end,
+      .binary = binary,
+      .nodes = nodes,
+      .outputs = outputs,
+      .counts = calloc(nodes, sizeof(long)),
+      .buffers = (prefix) ? malloc((size_t) nodes * OUT_BUFFER) : NULL,
+      .buffered = calloc(nodes, sizeof(size_t)),
+    };
+    if (!workers[t].counts || !workers[t].buffered
+        || (prefix && !workers[t].buffers))
+    {
+      fprintf(stderr, "Out of memory\n");
+      return 1;
+    }
+    pthread_create(&ids[t], NULL, work, &workers[t]);
+    begin = end;
+  }
+
+  bool failed = false;
+  long total = 0;
+  for (int t = 0; t < threads; ++t)
+  {
+    pthread_join(ids[t], NULL);
+    failed |= workers[t].failed;
+    if (t == 0) continue;
+    for (int node = 0; node < nodes; ++node)
+      workers[0].counts[node] += workers[t].counts[node];
+  }
+  for (int node = 0; node < nodes; ++node)
+  {
+    printf("%d\t%ld\n", node + 1, workers[0].counts[node]);
+    total += workers[0].counts[node];
+    if (outputs && fclose(outputs[node].file) != 0) failed = true;
+  }
+  printf("total\t%ld\n", total);
+  if (failed) fprintf(stderr, "Error writing the output files\n");
+
+  for (int t = 0; t < threads; ++t)
+  {
+    free(workers[t].counts);
+    free(workers[t].buffers);
+    free(workers[t].buffered);
+  }
+  free(workers);
+  free(ids);
+  free(outputs);
+  consistent_hasher_destroy(&ch);
+  if (data) munmap((void*) data, size);
+
+  return failed;
+}
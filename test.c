@@ -1,14 +1,1594 @@
 // SPDX-License-Identifier: MIT
 
+#include <stdlib.h>
+
+// Bytes allocated by the hasher, see test_incremental_eytzinger
+size_t test_allocated = 0;
+
+void *test_calloc(size_t count, size_t size)
+{
+  __atomic_fetch_add(&test_allocated, count * size, __ATOMIC_RELAXED);
+  return calloc(count, size);
+}
+
+#define CONSISTENT_HASHER_CALLOC test_calloc
 #define CONSISTENT_HASHER_INITIAL_CAPACITY 1
+#define CONSISTENT_HASHER_TRACE
 #define CONSISTENT_HASHER_IMPLEMENTATION
 #include "consistent-hasher.h"
 
 #include <stdio.h>
 #include <assert.h>
+#include <limits.h>
+#include <string.h>
+#include <pthread.h>
+#include <sched.h>
 
 #define RING_SIZE 1024
 
+void test_static(void)
+{
+  ConsistentHasherNode buffer[3], points[3];
+  ConsistentHasher ch;
+  consistent_hasher_init_static(&ch, RING_SIZE, buffer, points, 3);
+
+  assert(consistent_hasher_insert_node(&ch, 456) == CONSISTENT_HASHER_OK);
+  assert(consistent_hasher_insert_node(&ch, 123) == CONSISTENT_HASHER_OK);
+  assert(consistent_hasher_insert_node(&ch, 924) == CONSISTENT_HASHER_OK);
+  assert(consistent_hasher_insert_node(&ch, 500) ==
+         CONSISTENT_HASHER_ERROR_FULL);
+  assert(consistent_hasher_insert_node(&ch, 123) ==
+         CONSISTENT_HASHER_ERROR_NODE_PRESENT);
+  assert(ch.nodes == buffer);
+
+  assert(consistent_hasher_get_node_of(&ch, 100) == 123);
+  assert(consistent_hasher_get_node_of(&ch, 457) == 924);
+  assert(consistent_hasher_get_node_of(&ch, 1000) == 123);
+
+  assert(consistent_hasher_delete_node(&ch, 456) == CONSISTENT_HASHER_OK);
+  assert(consistent_hasher_delete_node(&ch, 123) == CONSISTENT_HASHER_OK);
+  assert(ch.nodes == buffer);
+  assert(consistent_hasher_get_node_of(&ch, 100) == 924);
+  assert(consistent_hasher_insert_node(&ch, 500) == CONSISTENT_HASHER_OK);
+  assert(consistent_hasher_get_node_of(&ch, 100) == 500);
+  assert(ch.points == points);
+  consistent_hasher_destroy(&ch);
+
+  // Without room for the points index nothing fits
+  consistent_hasher_init_static(&ch, RING_SIZE, buffer, NULL, 3);
+  assert(consistent_hasher_insert_node(&ch, 456) ==
+         CONSISTENT_HASHER_ERROR_FULL);
+  consistent_hasher_destroy(&ch);
+  return;
+}
+
+// Compare [ch] against a linear scan of the nodes
+ConsistentHasherHash reference_node_of(ConsistentHasher *ch,
+                                       ConsistentHasherHash item_hash)
+{
+  unsigned int position = item_hash % ch->ring_size;
+  for (int i = 0; i < ch->nodes_len; ++i)
+    if (ch->nodes[i].position >= position) return ch->nodes[i].owner;
+  return ch->nodes[0].owner;
+}
+
+void test_random(ConsistentHasherLayout layout)
+{
+  ConsistentHasher ch;
+  consistent_hasher_init(&ch, RING_SIZE);
+  assert(consistent_hasher_set_layout(&ch, layout) == CONSISTENT_HASHER_OK);
+
+  unsigned int state = 42;
+  for (int i = 0; i < 4000; ++i)
+  {
+    state = state * 1103515245 + 12345;
+    ConsistentHasherHash hash = (state >> 8) % (4 * RING_SIZE);
+    if (state & 0x10000)
+      consistent_hasher_delete_node(&ch, hash);
+    else
+      consistent_hasher_insert_node(&ch, hash);
+
+    for (int j = 1; j < ch.nodes_len; ++j)
+    {
+      assert(ch.nodes[j - 1].position < ch.nodes[j].position);
+      assert(ch.points[j - 1].owner < ch.points[j].owner
+             || (ch.points[j - 1].owner == ch.points[j].owner
+                 && ch.points[j - 1].position < ch.points[j].position));
+    }
+    if (ch.nodes_len == 0) continue;
+    if (layout != CONSISTENT_HASHER_LAYOUT_AUTO)
+      assert(consistent_hasher_get_layout(&ch) == layout);
+    
+    for (ConsistentHasherHash item = 0; item < RING_SIZE; item += 7)
+    {
+      assert(consistent_hasher_get_node_of(&ch, item) ==
+             reference_node_of(&ch, item));
+      assert(consistent_hasher_lookup(&ch, item) ==
+             reference_node_of(&ch, item));
+    }
+
+    // Odd length, so that the batch ends with single lookups
+    ConsistentHasherHash items[15], owners[15];
+    for (int j = 0; j < 15; ++j) items[j] = (state >> 4) + 97 * j;
+    consistent_hasher_lookup_batch(&ch, items, 15, owners);
+    for (int j = 0; j < 15; ++j)
+      assert(owners[j] == reference_node_of(&ch, items[j]));
+  }
+
+  consistent_hasher_destroy(&ch);
+  return;
+}
+
+void test_layout(void)
+{
+  ConsistentHasher ch;
+  consistent_hasher_init(&ch, 1 << 24);
+
+  assert(consistent_hasher_set_node_weight(&ch, 1, 10) == CONSISTENT_HASHER_OK);
+  assert(consistent_hasher_get_layout(&ch) == CONSISTENT_HASHER_LAYOUT_LINEAR);
+  assert(consistent_hasher_set_node_weight(&ch, 1, 1000) == CONSISTENT_HASHER_OK);
+  assert(consistent_hasher_get_layout(&ch) ==
+         CONSISTENT_HASHER_LAYOUT_BRANCHLESS);
+  assert(consistent_hasher_set_node_weight(&ch, 2, CONSISTENT_HASHER_EYTZINGER_MIN)
+         == CONSISTENT_HASHER_OK);
+  // The Eytzinger copy of a big ring is left stale by changes, until
+  // it is rebuilt
+  assert(consistent_hasher_get_layout(&ch) ==
+         CONSISTENT_HASHER_LAYOUT_BRANCHLESS);
+  assert(consistent_hasher_rebuild_pending(&ch));
+  ConsistentHasherRwLock lock = {0};
+  assert(consistent_hasher_rebuild(&ch, &lock) == CONSISTENT_HASHER_OK);
+  assert(consistent_hasher_get_layout(&ch) ==
+         CONSISTENT_HASHER_LAYOUT_EYTZINGER);
+  assert(!consistent_hasher_rebuild_pending(&ch));
+  assert(ch.spare_eytzinger == NULL);
+
+  // Changes that change nothing keep it
+  int len = ch.nodes_len;
+  assert(consistent_hasher_delete_node(&ch, 3) == CONSISTENT_HASHER_OK);
+  assert(consistent_hasher_set_node_weight(&ch, 2, CONSISTENT_HASHER_EYTZINGER_MIN)
+         == CONSISTENT_HASHER_OK);
+  assert(ch.nodes_len == len);
+  assert(consistent_hasher_get_layout(&ch) ==
+         CONSISTENT_HASHER_LAYOUT_EYTZINGER);
+
+  for (ConsistentHasherHash item = 0; item < (1 << 24); item += 4099)
+    assert(consistent_hasher_get_node_of(&ch, item) ==
+           reference_node_of(&ch, item));
+
+  assert(consistent_hasher_delete_points_of(&ch, 2) == CONSISTENT_HASHER_OK);
+  assert(consistent_hasher_get_layout(&ch) ==
+         CONSISTENT_HASHER_LAYOUT_BRANCHLESS);
+  assert(ch.eytzinger == NULL);
+
+  consistent_hasher_destroy(&ch);
+
+  ConsistentHasherNode buffer[4], points[4];
+  consistent_hasher_init_static(&ch, RING_SIZE, buffer, points, 4);
+  assert(consistent_hasher_set_layout(&ch, CONSISTENT_HASHER_LAYOUT_EYTZINGER)
+         == CONSISTENT_HASHER_OK);
+  assert(consistent_hasher_get_layout(&ch) ==
+         CONSISTENT_HASHER_LAYOUT_BRANCHLESS);
+  consistent_hasher_destroy(&ch);
+  
+  return;
+}
+
+void test_points(void)
+{
+  ConsistentHasher ch;
+  consistent_hasher_init(&ch, RING_SIZE);
+
+  assert(consistent_hasher_insert_point(&ch, 1, 100) == CONSISTENT_HASHER_OK);
+  assert(consistent_hasher_insert_point(&ch, 2, 200) == CONSISTENT_HASHER_OK);
+  assert(consistent_hasher_insert_point(&ch, 1, 300) == CONSISTENT_HASHER_OK);
+  assert(consistent_hasher_insert_point(&ch, 2, 1324) ==
+         CONSISTENT_HASHER_ERROR_NODE_PRESENT);
+  assert(consistent_hasher_get_node_of(&ch, 50) == 1);
+  assert(consistent_hasher_get_node_of(&ch, 150) == 2);
+  assert(consistent_hasher_get_node_of(&ch, 250) == 1);
+  assert(consistent_hasher_get_node_of(&ch, 350) == 1);
+
+  int len;
+  const ConsistentHasherNode *points = consistent_hasher_points_of(&ch, 1, &len);
+  assert(len == 2 && points[0].hash == 100 && points[1].hash == 300);
+  assert(consistent_hasher_node_load(&ch, 1) == RING_SIZE - 100);
+  assert(consistent_hasher_node_load(&ch, 2) == 100);
+  assert(consistent_hasher_points_of(&ch, 3, &len) == NULL && len == 0);
+
+  assert(consistent_hasher_delete_points_of(&ch, 1) == CONSISTENT_HASHER_OK);
+  assert(ch.nodes_len == 1);
+  assert(consistent_hasher_get_node_of(&ch, 50) == 2);
+  assert(consistent_hasher_node_load(&ch, 2) == RING_SIZE);
+
+  // Weights only move the arcs of the added or removed points
+  assert(consistent_hasher_set_node_weight(&ch, 7, 40) == CONSISTENT_HASHER_OK);
+  assert(consistent_hasher_set_node_weight(&ch, 8, 40) == CONSISTENT_HASHER_OK);
+  consistent_hasher_points_of(&ch, 7, &len);
+  assert(len == 40);
+  
+  ConsistentHasherHash before[RING_SIZE];
+  for (int i = 0; i < RING_SIZE; ++i)
+    before[i] = consistent_hasher_get_node_of(&ch, i);
+  
+  assert(consistent_hasher_set_node_weight(&ch, 7, 10) == CONSISTENT_HASHER_OK);
+  consistent_hasher_points_of(&ch, 7, &len);
+  assert(len == 10);
+  for (int i = 0; i < RING_SIZE; ++i)
+  {
+    ConsistentHasherHash after = consistent_hasher_get_node_of(&ch, i);
+    assert(after == before[i] || before[i] == 7);
+  }
+  
+  assert(consistent_hasher_set_node_weight(&ch, 7, 40) == CONSISTENT_HASHER_OK);
+  for (int i = 0; i < RING_SIZE; ++i)
+    assert(consistent_hasher_get_node_of(&ch, i) == before[i]);
+
+  // Points inserted by hand go first, whatever their positions
+  int added = 0;
+  for (ConsistentHasherHash hash = RING_SIZE - 1; added < 5; --hash)
+    added += (consistent_hasher_insert_point(&ch, 7, hash)
+              == CONSISTENT_HASHER_OK);
+  assert(consistent_hasher_set_node_weight(&ch, 7, 10) == CONSISTENT_HASHER_OK);
+  points = consistent_hasher_points_of(&ch, 7, &len);
+  assert(len == 10);
+  for (int j = 0; j < len; ++j)
+  {
+    int i = 0;
+    while (i < 40 && consistent_hasher_point_hash(7, i) != points[j].hash) i++;
+    assert(i < 40);
+  }
+  assert(consistent_hasher_set_node_weight(&ch, 7, 40) == CONSISTENT_HASHER_OK);
+  for (int i = 0; i < RING_SIZE; ++i)
+    assert(consistent_hasher_get_node_of(&ch, i) == before[i]);
+
+  // Without derived points the lowest positions are kept
+  assert(consistent_hasher_set_node_weight(&ch, 7, 0) == CONSISTENT_HASHER_OK);
+  assert(consistent_hasher_points_of(&ch, 7, &len) == NULL);
+  added = 0;
+  for (ConsistentHasherHash hash = 0; added < 5; ++hash)
+    added += (consistent_hasher_insert_point(&ch, 7, hash)
+              == CONSISTENT_HASHER_OK);
+  ConsistentHasherNode lowest = *consistent_hasher_points_of(&ch, 7, &len);
+  assert(consistent_hasher_set_node_weight(&ch, 7, 1) == CONSISTENT_HASHER_OK);
+  points = consistent_hasher_points_of(&ch, 7, &len);
+  assert(len == 1 && points[0].hash == lowest.hash);
+
+  consistent_hasher_destroy(&ch);
+  return;
+}
+
+void test_keyed(void)
+{
+  ConsistentHasher ch;
+  consistent_hasher_init(&ch, RING_SIZE);
+
+  // Reference vectors of SipHash-2-4
+  consistent_hasher_set_seed(&ch, 0x0706050403020100ULL,
+                             0x0f0e0d0c0b0a0908ULL);
+  unsigned char message[15];
+  for (int i = 0; i < 15; ++i) message[i] = i;
+  assert(consistent_hasher_siphash(&ch.key, message, 0)
+         == 0x726fdb47dd0e0e31ULL);
+  assert(consistent_hasher_siphash(&ch.key, message, 1)
+         == 0x74f839c593dc67fdULL);
+  assert(consistent_hasher_siphash(&ch.key, message, 8)
+         == 0x93f5f5799a932462ULL);
+  assert(consistent_hasher_siphash(&ch.key, message, 15)
+         == 0xa129ca6149be45e5ULL);
+  assert(consistent_hasher_siphash_u64(&ch.key, 0x0706050403020100ULL)
+         == 0x93f5f5799a932462ULL);
+
+  uint64_t values[7], hashes[7];
+  for (int i = 0; i < 7; ++i) values[i] = i * 0x1234567ULL;
+  consistent_hasher_siphash_u64_batch(&ch.key, values, 7, hashes);
+  for (int i = 0; i < 7; ++i)
+    assert(hashes[i] == consistent_hasher_siphash_u64(&ch.key, values[i]));
+
+  const void *keys[2] = { "foo", "barbaz" };
+  size_t lens[2] = { 3, 6 };
+  ConsistentHasherHash out[2];
+  consistent_hasher_hash_keys(&ch, keys, lens, 2, out);
+  assert(out[0] == consistent_hasher_hash_key(&ch, "foo", 3));
+  assert(out[1] == consistent_hasher_hash_key(&ch, "barbaz", 6));
+
+  // A different seed moves the keys
+  assert(consistent_hasher_insert_node(&ch, 123) == CONSISTENT_HASHER_OK);
+  assert(consistent_hasher_insert_node(&ch, 456) == CONSISTENT_HASHER_OK);
+  assert(consistent_hasher_get_node_of_key(&ch, "foo", 3)
+         == consistent_hasher_get_node_of(&ch, out[0]));
+  consistent_hasher_set_seed(&ch, 1, 2);
+  assert(consistent_hasher_hash_key(&ch, "foo", 3) != out[0]);
+
+  consistent_hasher_destroy(&ch);
+  return;
+}
+
+#define PRODUCERS 4
+#define PRODUCED 5000
+
+typedef struct {
+  ConsistentHasherDispatcher *d;
+  int producer;
+} Producer;
+
+void *producer_run(void *arg)
+{
+  Producer *p = arg;
+  for (uintptr_t i = 0; i < PRODUCED; ++i)
+  {
+    uintptr_t item = (uintptr_t) p->producer * PRODUCED + i + 1;
+    while (consistent_hasher_dispatch(p->d, (ConsistentHasherHash) i,
+                                      (void*) item, NULL)
+           == CONSISTENT_HASHER_ERROR_FULL)
+      sched_yield();
+  }
+  return NULL;
+}
+
+void test_hash_tags(void)
+{
+  ConsistentHasher ch;
+  consistent_hasher_init(&ch, RING_SIZE);
+  consistent_hasher_set_seed(&ch, 1, 2);
+
+  size_t len;
+  const char *key = "{user1000}.following";
+  assert(consistent_hasher_hash_tag(key, strlen(key), &len)
+         == key + 1 && len == 8);
+  key = "foo{}{bar}";
+  assert(consistent_hasher_hash_tag(key, strlen(key), &len)
+         == key && len == strlen(key));
+  key = "foo{{bar}}zap";
+  assert(consistent_hasher_hash_tag(key, strlen(key), &len)
+         == key + 4 && len == 4);
+  key = "no tag {here";
+  assert(consistent_hasher_hash_tag(key, strlen(key), &len)
+         == key && len == strlen(key));
+
+  // Braces past the first 16 bytes take the vector and the scalar path
+  key = "a-rather-long-prefix-before-the-{tag}";
+  assert(consistent_hasher_hash_key(&ch, "tag", 3)
+         == consistent_hasher_hash_tagged_key(&ch, key, strlen(key)));
+  key = "0123456789abcdef{tag}";
+  assert(consistent_hasher_hash_key(&ch, "tag", 3)
+         == consistent_hasher_hash_tagged_key(&ch, key, strlen(key)));
+
+  for (int i = 0; i < 16; ++i)
+    assert(consistent_hasher_insert_node(&ch, i * 61) == CONSISTENT_HASHER_OK);
+  ConsistentHasherHash items =
+    consistent_hasher_get_node_of_tagged_key(&ch, "{cart:7}.items", 14);
+  assert(consistent_hasher_get_node_of_tagged_key(&ch, "{cart:7}.total", 14)
+         == items);
+  key = "plain";
+  assert(consistent_hasher_get_node_of_tagged_key(&ch, key, 5)
+         == consistent_hasher_get_node_of_key(&ch, key, 5));
+
+  consistent_hasher_destroy(&ch);
+  return;
+}
+
+void test_dispatcher(void)
+{
+  ConsistentHasherDispatcher d;
+  assert(consistent_hasher_dispatcher_init(&d, 8, 256, 64)
+         == CONSISTENT_HASHER_OK);
+  assert(consistent_hasher_dispatcher_core_of(&d, 1) == -1);
+  assert(consistent_hasher_dispatch(&d, 1, NULL, NULL)
+         == CONSISTENT_HASHER_ERROR_EMPTY);
+  assert(consistent_hasher_dispatcher_add_core(&d, 8)
+         == CONSISTENT_HASHER_ERROR_INVALID);
+
+  for (int core = 0; core < 4; ++core)
+    assert(consistent_hasher_dispatcher_add_core(&d, core)
+           == CONSISTENT_HASHER_OK);
+
+  // Adding a core only takes flows, removing it only gives its own
+  enum { FLOWS = 10000 };
+  static int before[FLOWS];
+  for (int i = 0; i < FLOWS; ++i)
+    before[i] = consistent_hasher_dispatcher_core_of(&d, i * 2654435761u);
+  assert(consistent_hasher_dispatcher_add_core(&d, 4) == CONSISTENT_HASHER_OK);
+  int moved = 0;
+  for (int i = 0; i < FLOWS; ++i)
+  {
+    int core = consistent_hasher_dispatcher_core_of(&d, i * 2654435761u);
+    assert(core == before[i] || core == 4);
+    moved += (core != before[i]);
+  }
+  assert(moved > FLOWS / 10 && moved < FLOWS * 3 / 10);
+  assert(consistent_hasher_dispatcher_remove_core(&d, 4)
+         == CONSISTENT_HASHER_OK);
+  for (int i = 0; i < FLOWS; ++i)
+    assert(consistent_hasher_dispatcher_core_of(&d, i * 2654435761u)
+           == before[i]);
+
+  // Items of a flow come out in order on their core
+  int core;
+  void *item;
+  assert(consistent_hasher_dispatch(&d, 42, (void*) 1, &core)
+         == CONSISTENT_HASHER_OK);
+  assert(consistent_hasher_dispatch(&d, 42, (void*) 2, NULL)
+         == CONSISTENT_HASHER_OK);
+  assert(consistent_hasher_dispatcher_pop(&d, core, &item) && item == (void*) 1);
+  assert(consistent_hasher_dispatcher_pop(&d, core, &item) && item == (void*) 2);
+  assert(!consistent_hasher_dispatcher_pop(&d, core, &item));
+
+  ConsistentHasherHash flows[300];
+  void *items[300];
+  int cores[300];
+  for (int i = 0; i < 300; ++i)
+  {
+    flows[i] = 42;
+    items[i] = (void*)(uintptr_t)(i + 1);
+  }
+  assert(consistent_hasher_dispatch_batch(&d, flows, items, 300, cores) == 256);
+  assert(cores[255] == core && cores[256] == -1);
+  for (int i = 0; i < 256; ++i)
+    assert(consistent_hasher_dispatcher_pop(&d, core, &item));
+
+  // Concurrent producers while cores change
+  pthread_t threads[PRODUCERS];
+  Producer producers[PRODUCERS];
+  for (int i = 0; i < PRODUCERS; ++i)
+  {
+    producers[i] = (Producer) { .d = &d, .producer = i };
+    pthread_create(&threads[i], NULL, producer_run, &producers[i]);
+  }
+  
+  long received = 0;
+  uintptr_t sum = 0;
+  for (int round = 0; received < PRODUCERS * PRODUCED; ++round)
+  {
+    if (round % 64 == 0)
+      consistent_hasher_dispatcher_add_core(&d, 4 + (round / 64) % 4);
+    if (round % 64 == 32)
+      consistent_hasher_dispatcher_remove_core(&d, 4 + (round / 64) % 4);
+    long popped = 0;
+    for (int c = 0; c < 8; ++c)
+    {
+      while (consistent_hasher_dispatcher_pop(&d, c, &item))
+      {
+        popped++;
+        sum += (uintptr_t) item;
+      }
+    }
+    received += popped;
+    if (!popped) sched_yield();
+  }
+  for (int i = 0; i < PRODUCERS; ++i)
+    pthread_join(threads[i], NULL);
+  
+  uintptr_t total = (uintptr_t) PRODUCERS * PRODUCED;
+  assert(sum == total * (total + 1) / 2);
+
+  consistent_hasher_dispatcher_destroy(&d);
+  return;
+}
+
+void test_flow_table(void)
+{
+  ConsistentHasher ch;
+  ConsistentHasherFlowTable table;
+  consistent_hasher_init(&ch, RING_SIZE);
+  assert(consistent_hasher_flow_table_init(&table, 4096, 100)
+         == CONSISTENT_HASHER_OK);
+  assert(consistent_hasher_insert_node(&ch, 100) == CONSISTENT_HASHER_OK);
+  assert(consistent_hasher_insert_node(&ch, 600) == CONSISTENT_HASHER_OK);
+
+  // Established flows stay on their backend across ring changes
+  ConsistentHasherHash backend;
+  assert(consistent_hasher_flow_lookup(&table, &ch, 50, 1) == 100);
+  assert(consistent_hasher_flow_lookup(&table, &ch, 550, 1) == 600);
+  assert(consistent_hasher_insert_node(&ch, 500) == CONSISTENT_HASHER_OK);
+  assert(consistent_hasher_flow_lookup(&table, &ch, 550, 2) == 600);
+  assert(consistent_hasher_flow_lookup(&table, &ch, 551, 2) == 600);
+  assert(consistent_hasher_flow_lookup(&table, &ch, 450, 2) == 500);
+  assert(consistent_hasher_flow_find(&table, 550, 3, &backend)
+         && backend == 600);
+
+  consistent_hasher_flow_remove(&table, 550);
+  assert(!consistent_hasher_flow_find(&table, 550, 3, &backend));
+  assert(consistent_hasher_flow_lookup(&table, &ch, 550, 3) == 600);
+
+  // Idle flows expire
+  assert(consistent_hasher_flow_find(&table, 50, 101, &backend));
+  assert(!consistent_hasher_flow_find(&table, 551, 103, &backend));
+
+  consistent_hasher_flow_remove_backend(&table, 100);
+  assert(!consistent_hasher_flow_find(&table, 50, 101, &backend));
+  assert(consistent_hasher_flow_find(&table, 450, 101, &backend)
+         && backend == 500);
+  consistent_hasher_flow_table_destroy(&table);
+
+  // A full bucket evicts its least recently used flow
+  assert(consistent_hasher_flow_table_init(&table, 1, 0)
+         == CONSISTENT_HASHER_OK);
+  for (uint32_t i = 0; i < CONSISTENT_HASHER_FLOW_WAYS; ++i)
+    consistent_hasher_flow_lookup(&table, &ch, 1000 + i, 1 + i);
+  assert(consistent_hasher_flow_find(&table, 1000, 10, &backend));
+  consistent_hasher_flow_lookup(&table, &ch, 2000, 11);
+  assert(consistent_hasher_flow_find(&table, 1000, 12, &backend));
+  assert(!consistent_hasher_flow_find(&table, 1001, 12, &backend));
+  assert(consistent_hasher_flow_find(&table, 2000, 12, &backend));
+  consistent_hasher_flow_table_destroy(&table);
+
+  consistent_hasher_destroy(&ch);
+  return;
+}
+
+void test_overrides(void)
+{
+  ConsistentHasher ch;
+  ConsistentHasherOverrides overrides;
+  consistent_hasher_init(&ch, RING_SIZE);
+  assert(consistent_hasher_overrides_init(&overrides, 16)
+         == CONSISTENT_HASHER_OK);
+  assert(((uintptr_t) overrides.buckets & 63) == 0);
+  assert(consistent_hasher_insert_node(&ch, 100) == CONSISTENT_HASHER_OK);
+  assert(consistent_hasher_insert_node(&ch, 600) == CONSISTENT_HASHER_OK);
+  consistent_hasher_set_overrides(&ch, &overrides);
+
+  // Overridden items skip the ring, the others are unaffected
+  assert(consistent_hasher_overrides_set(&overrides, 50, 600)
+         == CONSISTENT_HASHER_OK);
+  assert(consistent_hasher_get_node_of(&ch, 50) == 600);
+  assert(consistent_hasher_get_node_of(&ch, 51) == 100);
+  assert(consistent_hasher_overrides_set(&overrides, 50, 700)
+         == CONSISTENT_HASHER_OK);
+  assert(consistent_hasher_get_node_of(&ch, 50) == 700);
+  consistent_hasher_overrides_remove(&overrides, 50);
+  assert(consistent_hasher_get_node_of(&ch, 50) == 100);
+
+  ConsistentHasherHash items[8], nodes[8], node;
+  for (int i = 0; i < 8; ++i)
+  {
+    items[i] = 1000 + i;
+    nodes[i] = 600;
+  }
+  assert(consistent_hasher_overrides_set_batch(&overrides, items, nodes, 8)
+         == 8);
+  for (int i = 0; i < 8; ++i)
+    assert(consistent_hasher_overrides_find(&overrides, items[i], &node)
+           && node == 600);
+  consistent_hasher_overrides_remove_batch(&overrides, items, 4);
+  assert(!consistent_hasher_overrides_find(&overrides, items[0], &node));
+  assert(consistent_hasher_overrides_find(&overrides, items[4], &node));
+
+  consistent_hasher_set_overrides(&ch, NULL);
+  assert(consistent_hasher_get_node_of(&ch, items[4]) == 100);
+  consistent_hasher_overrides_destroy(&overrides);
+
+  // A full bucket refuses new items
+  assert(consistent_hasher_overrides_init(&overrides, 1)
+         == CONSISTENT_HASHER_OK);
+  ConsistentHasherHash item = 0;
+  int set = 0;
+  while (consistent_hasher_overrides_set(&overrides, item++, 1)
+         == CONSISTENT_HASHER_OK)
+    set++;
+  assert(set >= (int) CONSISTENT_HASHER_OVERRIDE_WAYS);
+  consistent_hasher_overrides_destroy(&overrides);
+
+  consistent_hasher_destroy(&ch);
+  return;
+}
+
+void test_ranges(void)
+{
+  ConsistentHasher ch;
+  consistent_hasher_init(&ch, 0);
+
+  // Keys keep the order of their bytes
+  assert(consistent_hasher_range_key("b", 1)
+         > consistent_hasher_range_key("abcd", 4));
+  assert(consistent_hasher_range_key("ab", 2)
+         < consistent_hasher_range_key("abc", 3));
+  assert(consistent_hasher_range_key("ab", 2) == 0x61620000u);
+
+  // One range owned by 1, split in [0, 1000] [1001, 2000] [2001, max]
+  assert(consistent_hasher_range_split(&ch, UINT_MAX, 1)
+         == CONSISTENT_HASHER_OK);
+  assert(consistent_hasher_range_split(&ch, 2000, 2)
+         == CONSISTENT_HASHER_OK);
+  assert(consistent_hasher_range_split(&ch, 1000, 3)
+         == CONSISTENT_HASHER_OK);
+  assert(consistent_hasher_range_split(&ch, 1000, 4)
+         == CONSISTENT_HASHER_ERROR_NODE_PRESENT);
+  assert(consistent_hasher_get_node_of(&ch, 0) == 3);
+  assert(consistent_hasher_get_node_of(&ch, 1000) == 3);
+  assert(consistent_hasher_get_node_of(&ch, 1001) == 2);
+  assert(consistent_hasher_get_node_of(&ch, 2001) == 1);
+  assert(consistent_hasher_get_node_of(&ch, UINT_MAX) == 1);
+
+  ConsistentHasherHash owners[4];
+  assert(consistent_hasher_range_owners(&ch, 10, 20, owners, 4) == 1
+         && owners[0] == 3);
+  assert(consistent_hasher_range_owners(&ch, 10, 1001, owners, 4) == 1);
+  assert(consistent_hasher_range_owners(&ch, 10, 1002, owners, 4) == 2
+         && owners[0] == 3 && owners[1] == 2);
+  assert(consistent_hasher_range_owners(&ch, 1500, 0, owners, 4) == 2
+         && owners[0] == 2 && owners[1] == 1);
+  assert(consistent_hasher_range_owners(&ch, 2500, 500, owners, 4) == 2
+         && owners[0] == 1 && owners[1] == 3);
+  assert(consistent_hasher_range_owners(&ch, 1500, 1400, owners, 1) == 4
+         && owners[0] == 2);
+
+  // Merging gives the keys to the following range
+  assert(consistent_hasher_range_merge(&ch, 1000) == CONSISTENT_HASHER_OK);
+  assert(consistent_hasher_range_merge(&ch, 1000)
+         == CONSISTENT_HASHER_ERROR_INVALID);
+  assert(consistent_hasher_get_node_of(&ch, 500) == 2);
+  assert(consistent_hasher_range_owners(&ch, 0, 2002, owners, 4) == 2
+         && owners[0] == 2 && owners[1] == 1);
+  consistent_hasher_destroy(&ch);
+
+  consistent_hasher_init(&ch, RING_SIZE);
+  assert(consistent_hasher_range_split(&ch, 10, 1)
+         == CONSISTENT_HASHER_ERROR_INVALID);
+  consistent_hasher_destroy(&ch);
+  return;
+}
+
+void test_cluster(void)
+{
+  ConsistentHasherCluster cluster;
+  assert(consistent_hasher_cluster_init(&cluster) == CONSISTENT_HASHER_OK);
+
+  // Same slots as Redis Cluster
+  assert(consistent_hasher_key_slot("123456789", 9) == (0x31C3 & 16383));
+  assert(consistent_hasher_key_slot("foo", 3) == 12182);
+  assert(consistent_hasher_key_slot("{user1000}.following", 21)
+         == consistent_hasher_key_slot("user1000", 8));
+
+  ConsistentHasher ch;
+  consistent_hasher_init(&ch, RING_SIZE);
+  for (int i = 1; i <= 4; ++i)
+    assert(consistent_hasher_set_node_weight(&ch, i, 32)
+           == CONSISTENT_HASHER_OK);
+
+  // Every slot moves out of the empty table
+  static ConsistentHasherSlotMove moves[CONSISTENT_HASHER_CLUSTER_SLOTS];
+  int n = consistent_hasher_cluster_plan(&cluster, &ch, moves,
+                                         CONSISTENT_HASHER_CLUSTER_SLOTS);
+  assert(n == CONSISTENT_HASHER_CLUSTER_SLOTS);
+  assert(consistent_hasher_cluster_apply(&cluster, moves, n, false)
+         == CONSISTENT_HASHER_OK);
+  assert(consistent_hasher_cluster_plan(&cluster, &ch, NULL, 0) == 0);
+  for (unsigned int slot = 0; slot < 100; ++slot)
+    assert(consistent_hasher_cluster_node_of(&cluster, slot)
+           == consistent_hasher_get_node_of(&ch,
+                                  consistent_hasher_slot_hash(slot)));
+
+  // A joining node only takes slots, about a fifth of them
+  assert(consistent_hasher_set_node_weight(&ch, 5, 32)
+         == CONSISTENT_HASHER_OK);
+  n = consistent_hasher_cluster_plan(&cluster, &ch, moves,
+                                     CONSISTENT_HASHER_CLUSTER_SLOTS);
+  assert(n > 0 && n < CONSISTENT_HASHER_CLUSTER_SLOTS / 2);
+  for (int i = 0; i < n; ++i)
+    assert(moves[i].to == 5 && moves[i].from != 5);
+
+  // Migrating slots keep their owner until the move is done
+  ConsistentHasherHash peer;
+  unsigned int slot = moves[0].slot;
+  assert(consistent_hasher_cluster_apply(&cluster, moves, n, true)
+         == CONSISTENT_HASHER_OK);
+  assert(consistent_hasher_cluster_node_of(&cluster, slot) == moves[0].from);
+  assert(consistent_hasher_cluster_get_state(&cluster, slot, &peer)
+         == CONSISTENT_HASHER_SLOT_MIGRATING && peer == 5);
+  assert(consistent_hasher_cluster_set_node(&cluster, slot, 5)
+         == CONSISTENT_HASHER_OK);
+  assert(consistent_hasher_cluster_get_state(&cluster, slot, &peer)
+         == CONSISTENT_HASHER_SLOT_STABLE);
+  assert(consistent_hasher_cluster_plan(&cluster, &ch, NULL, 0) == n - 1);
+  assert(consistent_hasher_cluster_set_state(&cluster,
+                                    CONSISTENT_HASHER_CLUSTER_SLOTS,
+                                    CONSISTENT_HASHER_SLOT_IMPORTING, 1)
+         == CONSISTENT_HASHER_ERROR_INVALID);
+
+  consistent_hasher_destroy(&ch);
+  consistent_hasher_cluster_destroy(&cluster);
+  return;
+}
+
+void test_owned_mask(void)
+{
+  enum { ITEMS = 300 };
+  ConsistentHasherHash items[ITEMS];
+  uint64_t mask[(ITEMS + 63) / 64];
+  for (int i = 0; i < ITEMS; ++i)
+    items[i] = consistent_hasher_point_hash(7, i);
+
+  // Few arcs, many arcs, and the per-item fallback
+  int weights[] = { 1, 4, 100 };
+  for (int w = 0; w < 3; ++w)
+  {
+    ConsistentHasher ch;
+    consistent_hasher_init(&ch, RING_SIZE);
+    for (int node = 1; node <= 3; ++node)
+      assert(consistent_hasher_set_node_weight(&ch, node, weights[w])
+             == CONSISTENT_HASHER_OK);
+
+    for (int node = 1; node <= 4; ++node)
+    {
+      assert(consistent_hasher_owned_mask(&ch, node, items, ITEMS, mask)
+             == CONSISTENT_HASHER_OK);
+      for (int i = 0; i < ITEMS; ++i)
+        assert(((mask[i / 64] >> (i % 64)) & 1)
+               == (consistent_hasher_get_node_of(&ch, items[i])
+                   == (ConsistentHasherHash) node));
+    }
+
+    ConsistentHasherOverrides overrides;
+    assert(consistent_hasher_overrides_init(&overrides, 1)
+           == CONSISTENT_HASHER_OK);
+    consistent_hasher_set_overrides(&ch, &overrides);
+    assert(consistent_hasher_overrides_set(&overrides, items[0], 4)
+           == CONSISTENT_HASHER_OK);
+    assert(consistent_hasher_owned_mask(&ch, 4, items, ITEMS, mask)
+           == CONSISTENT_HASHER_OK);
+    assert(mask[0] == 1);
+    consistent_hasher_set_overrides(&ch, NULL);
+    consistent_hasher_overrides_destroy(&overrides);
+    consistent_hasher_destroy(&ch);
+  }
+
+  // A single point owns the whole ring
+  ConsistentHasher ch;
+  consistent_hasher_init(&ch, 0);
+  assert(consistent_hasher_insert_node(&ch, 5) == CONSISTENT_HASHER_OK);
+  assert(consistent_hasher_owned_mask(&ch, 5, items, 64, mask)
+         == CONSISTENT_HASHER_OK);
+  assert(mask[0] == UINT64_MAX);
+  consistent_hasher_destroy(&ch);
+  return;
+}
+
+void test_straw2(void)
+{
+  // The logarithm table is exact at powers of two and monotonic
+  assert(_consistent_hasher_straw2_ln(65535) == 0);
+  assert(_consistent_hasher_straw2_ln(32767) == -65536);
+  assert(_consistent_hasher_straw2_ln(0) == -16 * 65536);
+  for (uint32_t u = 1; u < 65536; ++u)
+    assert(_consistent_hasher_straw2_ln(u)
+           > _consistent_hasher_straw2_ln(u - 1));
+
+  enum { ITEMS = 20000 };
+  static ConsistentHasherHash items[ITEMS], before[ITEMS], after[ITEMS];
+  for (int i = 0; i < ITEMS; ++i)
+    items[i] = consistent_hasher_point_hash(3, i);
+
+  ConsistentHasherStraw2 straw2;
+  consistent_hasher_straw2_init(&straw2);
+  for (int node = 1; node <= 4; ++node)
+    assert(consistent_hasher_straw2_set_weight(&straw2, node, node)
+           == CONSISTENT_HASHER_OK);
+  assert(consistent_hasher_straw2_set_weight(&straw2, 5, 0)
+         == CONSISTENT_HASHER_OK);
+  consistent_hasher_straw2_select_batch(&straw2, items, ITEMS, before);
+  for (int i = 0; i < ITEMS; ++i)
+    assert(before[i] == consistent_hasher_straw2_select(&straw2, items[i]));
+
+  // Items follow the weights, 1/10 to 4/10
+  int counts[6] = {0};
+  for (int i = 0; i < ITEMS; ++i) counts[before[i]]++;
+  assert(counts[5] == 0);
+  for (int node = 1; node <= 4; ++node)
+    assert(counts[node] > ITEMS * node / 10 * 9 / 10
+           && counts[node] < ITEMS * node / 10 * 11 / 10);
+
+  // A weight change only moves items to or from that node
+  assert(consistent_hasher_straw2_set_weight(&straw2, 2, 6)
+         == CONSISTENT_HASHER_OK);
+  consistent_hasher_straw2_select_batch(&straw2, items, ITEMS, after);
+  for (int i = 0; i < ITEMS; ++i)
+    assert(before[i] == after[i] || after[i] == 2);
+  assert(consistent_hasher_straw2_set_weight(&straw2, 2, 1)
+         == CONSISTENT_HASHER_OK);
+  consistent_hasher_straw2_select_batch(&straw2, items, ITEMS, after);
+  for (int i = 0; i < ITEMS; ++i)
+    assert(before[i] == after[i] || before[i] == 2);
+
+  // So does removing it, whatever the order of the others
+  assert(consistent_hasher_straw2_remove(&straw2, 1) == CONSISTENT_HASHER_OK);
+  consistent_hasher_straw2_select_batch(&straw2, items, ITEMS, before);
+  for (int i = 0; i < ITEMS; ++i)
+    assert(before[i] == after[i] || after[i] == 1);
+
+  // Without weights, both go to the bigger hash
+  for (int node = 2; node <= 4; ++node)
+    assert(consistent_hasher_straw2_set_weight(&straw2, node, 0)
+           == CONSISTENT_HASHER_OK);
+  consistent_hasher_straw2_select_batch(&straw2, items, ITEMS, before);
+  for (int i = 0; i < ITEMS; ++i)
+    assert(before[i] == 5
+           && consistent_hasher_straw2_select(&straw2, items[i]) == 5);
+
+  consistent_hasher_straw2_destroy(&straw2);
+  return;
+}
+
+void test_gapped(void)
+{
+  ConsistentHasher ch;
+  ConsistentHasherGapped ring;
+  consistent_hasher_init(&ch, RING_SIZE);
+  consistent_hasher_gapped_init(&ring, RING_SIZE);
+
+  // Random churn, checked against the sorted array
+  uint32_t state = 99;
+  for (int step = 0; step < 4000; ++step)
+  {
+    state = state * 1103515245u + 12345u;
+    ConsistentHasherHash hash = (state >> 8) % (2 * RING_SIZE);
+    ConsistentHasherHash owner = hash % 7;
+    // Grow to a few hundred points, then mostly delete
+    bool insert = (step < 2500) ? (state >> 28) < 11 : (state >> 28) < 3;
+    if (insert)
+      assert(consistent_hasher_gapped_insert_point(&ring, owner, hash)
+             == consistent_hasher_insert_point(&ch, owner, hash));
+    else
+    {
+      assert(consistent_hasher_gapped_delete_point(&ring, hash)
+             == CONSISTENT_HASHER_OK);
+      consistent_hasher_delete_node(&ch, hash);
+    }
+    assert(ring.len == (size_t) ch.nodes_len);
+    if (ch.nodes_len == 0 || step % 50 != 0) continue;
+
+    for (ConsistentHasherHash item = 0; item < RING_SIZE; ++item)
+      assert(consistent_hasher_gapped_get_node_of(&ring, item)
+             == consistent_hasher_get_node_of(&ch, item));
+  }
+  assert(ring.capacity < 8 * (size_t) ch.nodes_len + 16);
+
+  consistent_hasher_gapped_destroy(&ring);
+  consistent_hasher_destroy(&ch);
+  return;
+}
+
+void scheduler_done(void *user, ConsistentHasherHash item_hash,
+                    ConsistentHasherHash node_hash)
+{
+  int *completed = user;
+  (*completed)++;
+  (void) item_hash;
+  (void) node_hash;
+}
+
+// Lookups that submit the next item from their done callback
+typedef struct {
+  ConsistentHasherScheduler *scheduler;
+  ConsistentHasherHash *out;
+  int *calls;
+  int next;
+  int items;
+} SchedulerChain;
+
+void scheduler_chain(void *user, ConsistentHasherHash item_hash,
+                     ConsistentHasherHash node_hash)
+{
+  SchedulerChain *chain = user;
+  chain->calls[item_hash]++;
+  (void) node_hash;
+  if (chain->next == chain->items) return;
+
+  int i = chain->next++;
+  consistent_hasher_scheduler_submit(chain->scheduler, i, &chain->out[i],
+                                     chain);
+}
+
+void test_scheduler(void)
+{
+  enum { ITEMS = 1000 };
+  static ConsistentHasherHash out[ITEMS];
+  ConsistentHasherLayout layouts[] = {
+    CONSISTENT_HASHER_LAYOUT_BRANCHLESS,
+    CONSISTENT_HASHER_LAYOUT_EYTZINGER,
+  };
+  
+  for (int l = 0; l < 2; ++l)
+  {
+    ConsistentHasher ch;
+    consistent_hasher_init(&ch, RING_SIZE);
+    assert(consistent_hasher_set_layout(&ch, layouts[l])
+           == CONSISTENT_HASHER_OK);
+    for (int node = 1; node <= 5; ++node)
+      assert(consistent_hasher_set_node_weight(&ch, node, 20)
+             == CONSISTENT_HASHER_OK);
+
+    ConsistentHasherOverrides overrides;
+    assert(consistent_hasher_overrides_init(&overrides, 1)
+           == CONSISTENT_HASHER_OK);
+    assert(consistent_hasher_overrides_set(&overrides, 3, 9)
+           == CONSISTENT_HASHER_OK);
+    consistent_hasher_set_overrides(&ch, &overrides);
+
+    // More lookups than slots, stepped while submitting
+    int completed = 0;
+    ConsistentHasherScheduler scheduler;
+    consistent_hasher_scheduler_init(&scheduler, &ch, scheduler_done);
+    for (int i = 0; i < ITEMS; ++i)
+    {
+      consistent_hasher_scheduler_submit(&scheduler, i, &out[i], &completed);
+      if (i % 3 == 0) consistent_hasher_scheduler_step(&scheduler);
+    }
+    consistent_hasher_scheduler_drain(&scheduler);
+    assert(scheduler.active == 0 && completed == ITEMS);
+    
+    for (int i = 0; i < ITEMS; ++i)
+      assert(out[i] == consistent_hasher_get_node_of(&ch, i));
+    assert(out[3] == 9);
+
+    // Submitting from the callback while every slot is full completes
+    // each lookup once
+    static int calls[ITEMS];
+    memset(calls, 0, sizeof(calls));
+    memset(out, 0, sizeof(out));
+    SchedulerChain chain = {
+      .scheduler = &scheduler,
+      .out = out,
+      .calls = calls,
+      .next = CONSISTENT_HASHER_SCHEDULER_SLOTS,
+      .items = ITEMS,
+    };
+    consistent_hasher_scheduler_init(&scheduler, &ch, scheduler_chain);
+    for (int i = 0; i < CONSISTENT_HASHER_SCHEDULER_SLOTS; ++i)
+      consistent_hasher_scheduler_submit(&scheduler, i, &out[i], &chain);
+    consistent_hasher_scheduler_drain(&scheduler);
+    assert(scheduler.active == 0 && chain.next == ITEMS);
+    for (int i = 0; i < ITEMS; ++i)
+    {
+      assert(calls[i] == 1);
+      assert(out[i] == consistent_hasher_get_node_of(&ch, i));
+    }
+
+    consistent_hasher_set_overrides(&ch, NULL);
+    consistent_hasher_overrides_destroy(&overrides);
+    consistent_hasher_destroy(&ch);
+  }
+  return;
+}
+
+void test_incremental(void)
+{
+  enum { POINTS = 3 * CONSISTENT_HASHER_INCREMENTAL_MIN };
+  ConsistentHasher ch;
+  ConsistentHasherGapped ring;
+  consistent_hasher_init(&ch, 0);
+  consistent_hasher_gapped_init(&ring, 0);
+  assert(consistent_hasher_set_layout(&ch, CONSISTENT_HASHER_LAYOUT_BINARY)
+         == CONSISTENT_HASHER_OK);
+
+  // Grow through several incremental copies, then shrink back
+  bool migrated = false;
+  int capacity = 0;
+  for (int step = 0; step < 2 * POINTS; ++step)
+  {
+    ConsistentHasherHash hash =
+      consistent_hasher_point_hash(step % POINTS, 0);
+    if (step < POINTS)
+    {
+      assert(consistent_hasher_insert_point(&ch, step % 5, hash)
+             == consistent_hasher_gapped_insert_point(&ring, step % 5, hash));
+    }
+    else
+    {
+      assert(consistent_hasher_delete_node(&ch, hash) == CONSISTENT_HASHER_OK);
+      consistent_hasher_gapped_delete_point(&ring, hash);
+    }
+    migrated |= (ch.next_nodes != NULL);
+    if (step == POINTS - 1) capacity = ch.nodes_capacity;
+    if (ch.nodes_len == 0 || step % 997 != 0) continue;
+
+    assert((size_t) ch.nodes_len == ring.len);
+    for (int j = 1; j < ch.nodes_len; ++j)
+      assert(ch.points[j - 1].owner < ch.points[j].owner
+             || (ch.points[j - 1].owner == ch.points[j].owner
+                 && ch.points[j - 1].position < ch.points[j].position));
+    for (int i = 0; i < 64; ++i)
+    {
+      ConsistentHasherHash item = consistent_hasher_point_hash(i, step);
+      assert(consistent_hasher_get_node_of(&ch, item)
+             == consistent_hasher_gapped_get_node_of(&ring, item));
+    }
+  }
+  assert(migrated && capacity >= POINTS);
+  assert(ch.nodes_len == 0 && ch.nodes_capacity < capacity);
+
+  consistent_hasher_gapped_destroy(&ring);
+  consistent_hasher_destroy(&ch);
+  return;
+}
+
+void test_incremental_eytzinger(void)
+{
+  enum { POINTS = 2 * CONSISTENT_HASHER_EYTZINGER_MIN };
+  ConsistentHasher ch, reference;
+  consistent_hasher_init(&ch, 0);
+  consistent_hasher_init(&reference, 0);
+  assert(consistent_hasher_set_layout(&reference,
+           CONSISTENT_HASHER_LAYOUT_BINARY) == CONSISTENT_HASHER_OK);
+
+  // Count what each insert allocates and whether it fills the
+  // Eytzinger copy, which overwrites the poisoned first entry
+  size_t most = 0;
+  int rebuilds = 0, moving = 0;
+  for (int i = 0; i < POINTS; ++i)
+  {
+    ConsistentHasherHash hash = consistent_hasher_point_hash(i, 9);
+    unsigned int *copy = ch.eytzinger;
+    if (copy && ch.eytzinger_capacity > 1) copy[1] = UINT_MAX;
+    else copy = NULL;
+    size_t before = test_allocated;
+    assert(consistent_hasher_insert_point(&ch, i % 7, hash)
+           == CONSISTENT_HASHER_OK);
+    size_t allocated = test_allocated - before;
+    assert(consistent_hasher_insert_point(&reference, i % 7, hash)
+           == CONSISTENT_HASHER_OK);
+    if (ch.nodes_len <= CONSISTENT_HASHER_EYTZINGER_MIN) continue;
+
+    // Changes leave the copy stale, whether the arrays move or not
+    assert(!copy || (ch.eytzinger == copy && copy[1] == UINT_MAX));
+    assert(consistent_hasher_get_layout(&ch)
+           == CONSISTENT_HASHER_LAYOUT_BRANCHLESS);
+    assert(consistent_hasher_rebuild_pending(&ch));
+    moving += (ch.next_nodes != NULL);
+    if (allocated > most) most = allocated;
+
+    if (i % 997 != 0) continue;
+    assert(consistent_hasher_rebuild(&ch, NULL) == CONSISTENT_HASHER_OK);
+    assert(consistent_hasher_get_layout(&ch)
+           == CONSISTENT_HASHER_LAYOUT_EYTZINGER);
+    rebuilds++;
+    for (int j = 0; j < 64; ++j)
+    {
+      ConsistentHasherHash item = consistent_hasher_point_hash(j, i);
+      assert(consistent_hasher_get_node_of(&ch, item)
+             == consistent_hasher_get_node_of(&reference, item));
+    }
+  }
+  assert(moving > 0 && rebuilds > 0);
+
+  // At most the next arrays, once
+  assert(most <= 2 * (size_t) ch.nodes_capacity * sizeof(ConsistentHasherNode));
+
+  consistent_hasher_destroy(&reference);
+  consistent_hasher_destroy(&ch);
+  return;
+}
+
+typedef struct {
+  ConsistentHasher *ch;
+  ConsistentHasherRwLock *lock;
+  int stop;
+  int rebuilds;
+} Rebuilder;
+
+void *rebuilder_run(void *arg)
+{
+  Rebuilder *r = arg;
+  while (!__atomic_load_n(&r->stop, __ATOMIC_ACQUIRE))
+  {
+    assert(consistent_hasher_rebuild(r->ch, r->lock) == CONSISTENT_HASHER_OK);
+    r->rebuilds++;
+  }
+  return NULL;
+}
+
+void test_background_rebuild(void)
+{
+  ConsistentHasher ch, fresh, stale;
+  ConsistentHasherRwLock lock = {0};
+  consistent_hasher_init(&ch, 1000003);
+  consistent_hasher_init(&fresh, 1000003);
+  consistent_hasher_init(&stale, 1000003);
+  assert(consistent_hasher_set_layout(&ch, CONSISTENT_HASHER_LAYOUT_EYTZINGER)
+         == CONSISTENT_HASHER_OK);
+  assert(consistent_hasher_set_background_rebuild(&ch, true)
+         == CONSISTENT_HASHER_OK);
+
+  // Nothing built yet, lookups search the points directly
+  for (int node = 1; node <= 8; ++node)
+  {
+    assert(consistent_hasher_set_node_weight(&ch, node, 50)
+           == CONSISTENT_HASHER_OK);
+    assert(consistent_hasher_set_node_weight(&fresh, node, 50)
+           == CONSISTENT_HASHER_OK);
+    assert(consistent_hasher_set_node_weight(&stale, node, 50)
+           == CONSISTENT_HASHER_OK);
+  }
+  assert(consistent_hasher_get_layout(&ch)
+         == CONSISTENT_HASHER_LAYOUT_BRANCHLESS);
+  assert(consistent_hasher_rebuild_pending(&ch));
+  assert(consistent_hasher_rebuild(&ch, &lock) == CONSISTENT_HASHER_OK);
+  assert(!consistent_hasher_rebuild_pending(&ch));
+  assert(consistent_hasher_get_layout(&ch)
+         == CONSISTENT_HASHER_LAYOUT_EYTZINGER);
+
+  // Lookups see the old points until the next rebuild
+  assert(consistent_hasher_set_node_weight(&ch, 9, 50) == CONSISTENT_HASHER_OK);
+  assert(consistent_hasher_set_node_weight(&fresh, 9, 50)
+         == CONSISTENT_HASHER_OK);
+  assert(consistent_hasher_rebuild_pending(&ch));
+  for (int i = 0; i < 1000; ++i)
+  {
+    ConsistentHasherHash item = consistent_hasher_point_hash(i, 1);
+    assert(consistent_hasher_get_node_of(&ch, item)
+           == consistent_hasher_get_node_of(&stale, item));
+    assert(consistent_hasher_lookup(&ch, item)
+           == consistent_hasher_get_node_of(&stale, item));
+  }
+  assert(consistent_hasher_rebuild(&ch, NULL) == CONSISTENT_HASHER_OK);
+  for (int i = 0; i < 1000; ++i)
+  {
+    ConsistentHasherHash item = consistent_hasher_point_hash(i, 1);
+    assert(consistent_hasher_get_node_of(&ch, item)
+           == consistent_hasher_get_node_of(&fresh, item));
+  }
+
+  // Membership changes keep going while another thread rebuilds
+  Rebuilder rebuilder = { .ch = &ch, .lock = &lock };
+  pthread_t thread;
+  pthread_create(&thread, NULL, rebuilder_run, &rebuilder);
+  for (int step = 0; step < 200; ++step)
+  {
+    ConsistentHasherHash node = 10 + step % 20;
+    consistent_hasher_rwlock_write_lock(&lock);
+    assert(consistent_hasher_set_node_weight(&ch, node, (step % 3 + 1) * 20)
+           == CONSISTENT_HASHER_OK);
+    consistent_hasher_rwlock_write_unlock(&lock);
+    assert(consistent_hasher_set_node_weight(&fresh, node, (step % 3 + 1) * 20)
+           == CONSISTENT_HASHER_OK);
+
+    consistent_hasher_rwlock_read_lock(&lock);
+    ConsistentHasherHash owner =
+      consistent_hasher_get_node_of(&ch, consistent_hasher_point_hash(step, 2));
+    consistent_hasher_rwlock_read_unlock(&lock);
+    assert(owner >= 1 && owner < 30);
+  }
+  __atomic_store_n(&rebuilder.stop, 1, __ATOMIC_RELEASE);
+  pthread_join(thread, NULL);
+  assert(rebuilder.rebuilds > 0);
+
+  assert(consistent_hasher_rebuild(&ch, &lock) == CONSISTENT_HASHER_OK);
+  assert(!consistent_hasher_rebuild_pending(&ch));
+  for (int i = 0; i < 1000; ++i)
+  {
+    ConsistentHasherHash item = consistent_hasher_point_hash(i, 3);
+    assert(consistent_hasher_get_node_of(&ch, item)
+           == consistent_hasher_get_node_of(&fresh, item));
+  }
+
+  // Back to building during membership changes
+  assert(consistent_hasher_set_background_rebuild(&ch, false)
+         == CONSISTENT_HASHER_OK);
+  assert(consistent_hasher_delete_points_of(&ch, 9) == CONSISTENT_HASHER_OK);
+  assert(consistent_hasher_delete_points_of(&fresh, 9) == CONSISTENT_HASHER_OK);
+  assert(!consistent_hasher_rebuild_pending(&ch));
+  for (int i = 0; i < 1000; ++i)
+  {
+    ConsistentHasherHash item = consistent_hasher_point_hash(i, 4);
+    assert(consistent_hasher_get_node_of(&ch, item)
+           == consistent_hasher_get_node_of(&fresh, item));
+  }
+
+  consistent_hasher_destroy(&stale);
+  consistent_hasher_destroy(&fresh);
+  consistent_hasher_destroy(&ch);
+  return;
+}
+
+void test_budget(void)
+{
+  enum { POINTS = 1024 };
+  size_t budget = 2 * POINTS * sizeof(ConsistentHasherNode)
+    + (POINTS + 1) * (sizeof(unsigned int) + sizeof(ConsistentHasherHash));
+  assert(consistent_hasher_budget_points(budget,
+           CONSISTENT_HASHER_LAYOUT_EYTZINGER) == POINTS);
+  int max = consistent_hasher_budget_points(budget,
+              CONSISTENT_HASHER_LAYOUT_BRANCHLESS);
+  assert(max > POINTS);
+
+  ConsistentHasher ch, reference;
+  consistent_hasher_init_budget(&ch, 0, budget);
+  consistent_hasher_init(&reference, 0);
+  assert(consistent_hasher_set_layout(&ch, CONSISTENT_HASHER_LAYOUT_EYTZINGER)
+         == CONSISTENT_HASHER_OK);
+
+  // The Eytzinger copy fits until the arrays grow past POINTS
+  for (int i = 0; i < max; ++i)
+  {
+    ConsistentHasherHash node = (ConsistentHasherHash) i * 7919 + 1;
+    assert(consistent_hasher_insert_node(&ch, node) == CONSISTENT_HASHER_OK);
+    assert(consistent_hasher_insert_node(&reference, node)
+           == CONSISTENT_HASHER_OK);
+    assert(consistent_hasher_footprint(&ch) <= budget);
+    assert(consistent_hasher_get_layout(&ch)
+           == ((i < POINTS) ? CONSISTENT_HASHER_LAYOUT_EYTZINGER
+                            : CONSISTENT_HASHER_LAYOUT_BRANCHLESS));
+  }
+  assert(consistent_hasher_insert_node(&ch, 3) == CONSISTENT_HASHER_ERROR_FULL);
+  assert(ch.nodes_len == max);
+  for (int i = 0; i < 1000; ++i)
+  {
+    ConsistentHasherHash item = consistent_hasher_point_hash(i, 0);
+    assert(consistent_hasher_get_node_of(&ch, item)
+           == consistent_hasher_get_node_of(&reference, item));
+  }
+
+  // Shrinking makes room for the copy again
+  for (int i = max / 2; i < max; ++i)
+    assert(consistent_hasher_delete_node(&ch, (ConsistentHasherHash) i * 7919 + 1)
+           == CONSISTENT_HASHER_OK);
+  assert(consistent_hasher_get_layout(&ch)
+         == CONSISTENT_HASHER_LAYOUT_EYTZINGER);
+  assert(consistent_hasher_footprint(&ch) <= budget);
+
+  consistent_hasher_destroy(&reference);
+  consistent_hasher_destroy(&ch);
+  return;
+}
+
+typedef struct {
+  // Owner of each position, kept up to date from the changes
+  ConsistentHasherHash owners[1000];
+  int calls;
+} WatchCopy;
+
+void watch_apply(ConsistentHasher *ch,
+                 const ConsistentHasherArcChange *changes,
+                 int len,
+                 void *user)
+{
+  WatchCopy *copy = user;
+  assert(len > 0 && changes);
+  for (int i = 0; i < len; ++i)
+  {
+    unsigned int position = changes[i].start;
+    do
+    {
+      position = (position + 1) % ch->ring_size;
+      assert(copy->owners[position] == changes[i].old_owner);
+      copy->owners[position] = changes[i].new_owner;
+    } while (position != changes[i].end);
+  }
+  copy->calls++;
+  return;
+}
+
+void test_watch(void)
+{
+  ConsistentHasher ch;
+  ConsistentHasherWatcher watcher;
+  static WatchCopy copy;
+  consistent_hasher_init(&ch, 1000);
+  assert(consistent_hasher_set_node_weight(&ch, 1, 10) == CONSISTENT_HASHER_OK);
+  for (int i = 0; i < 1000; ++i)
+    copy.owners[i] = consistent_hasher_get_node_of(&ch, i);
+  assert(consistent_hasher_watch(&ch, &watcher, watch_apply, &copy)
+         == CONSISTENT_HASHER_OK);
+
+  // Replaying the changes keeps the copy equal to the ring
+  for (int step = 0; step < 40; ++step)
+  {
+    ConsistentHasherHash node = 2 + step % 7;
+    switch (step % 4)
+    {
+    case 0: consistent_hasher_set_node_weight(&ch, node, 5 + step % 9); break;
+    case 1: consistent_hasher_insert_point(&ch, node, 1000 + step * 37); break;
+    case 2: consistent_hasher_delete_points_of(&ch, node); break;
+    default: consistent_hasher_delete_node(&ch, 1000 + (step - 2) * 37); break;
+    }
+    for (int i = 0; i < 1000; ++i)
+      assert(copy.owners[i] == consistent_hasher_get_node_of(&ch, i));
+  }
+  assert(copy.calls > 0);
+
+  // Nothing changes owner, nothing is reported
+  int calls = copy.calls;
+  assert(consistent_hasher_set_node_weight(&ch, 1, 10) == CONSISTENT_HASHER_OK);
+  assert(copy.calls == calls);
+
+  consistent_hasher_unwatch(&ch, &watcher);
+  assert(consistent_hasher_set_node_weight(&ch, 42, 10) == CONSISTENT_HASHER_OK);
+  assert(copy.calls == calls);
+
+  ConsistentHasherNode buffer[4], points[4];
+  ConsistentHasher fixed;
+  consistent_hasher_init_static(&fixed, 1000, buffer, points, 4);
+  assert(consistent_hasher_watch(&fixed, &watcher, watch_apply, &copy)
+         == CONSISTENT_HASHER_ERROR_INVALID);
+
+  consistent_hasher_destroy(&ch);
+  return;
+}
+
+// Cost of removing [removed] nodes from a ring of [nodes] nodes of
+// weight 3 * node, the way consistent_hasher_rank_scale_in computes it
+double scale_in_cost(const bool *removed, int nodes, ConsistentHasherHash node,
+                     uint64_t *movement, double *imbalance)
+{
+  ConsistentHasher ch;
+  consistent_hasher_init(&ch, 100003);
+  for (int i = 1; i <= nodes; ++i)
+    if (!removed[i])
+      assert(consistent_hasher_set_node_weight(&ch, i, 3 * i)
+             == CONSISTENT_HASHER_OK);
+  *movement = consistent_hasher_node_load(&ch, node);
+  assert(consistent_hasher_delete_points_of(&ch, node) == CONSISTENT_HASHER_OK);
+
+  unsigned int biggest = 0, left = 0;
+  for (int i = 1; i <= nodes; ++i)
+  {
+    if (removed[i] || i == (int) node) continue;
+    unsigned int load = consistent_hasher_node_load(&ch, i);
+    if (load > biggest) biggest = load;
+    left++;
+  }
+  double mean = 100003.0 / left;
+  *imbalance = biggest / mean;
+  consistent_hasher_destroy(&ch);
+  return *movement / mean + *imbalance;
+}
+
+void test_scale_in(void)
+{
+  enum { NODES = 8 };
+  ConsistentHasher ch;
+  consistent_hasher_init(&ch, 100003);
+  for (int i = 1; i <= NODES; ++i)
+    assert(consistent_hasher_set_node_weight(&ch, i, 3 * i)
+           == CONSISTENT_HASHER_OK);
+
+  ConsistentHasherScaleIn ranking[NODES];
+  int len;
+  assert(consistent_hasher_rank_scale_in(&ch, 3, ranking, &len)
+         == CONSISTENT_HASHER_OK);
+  assert(len == 3);
+
+  // Each pick is the best removal after the ones before it
+  bool removed[NODES + 1] = { false };
+  for (int r = 0; r < len; ++r)
+  {
+    double best = 0;
+    for (int i = 1; i <= NODES; ++i)
+    {
+      if (removed[i]) continue;
+      uint64_t movement;
+      double imbalance;
+      double cost = scale_in_cost(removed, NODES, i, &movement, &imbalance);
+      if (best == 0 || cost < best) best = cost;
+      if (ranking[r].node != (ConsistentHasherHash) i) continue;
+      assert(ranking[r].movement == movement);
+      assert(ranking[r].imbalance > imbalance - 1e-9
+             && ranking[r].imbalance < imbalance + 1e-9);
+    }
+    uint64_t movement;
+    double imbalance;
+    double cost = scale_in_cost(removed, NODES, ranking[r].node,
+                                &movement, &imbalance);
+    assert(cost < best + 1e-9);
+    removed[ranking[r].node] = true;
+  }
+
+  // The last node cannot be removed
+  assert(consistent_hasher_rank_scale_in(&ch, NODES + 2, ranking, &len)
+         == CONSISTENT_HASHER_OK);
+  assert(len == NODES - 1);
+
+  consistent_hasher_destroy(&ch);
+  return;
+}
+
+void test_assignment(void)
+{
+  enum { PARTITIONS = 2000, CONSUMERS = 10 };
+  ConsistentHasher ch;
+  ConsistentHasherAssignment assignment;
+  static ConsistentHasherPartitionMove moves[PARTITIONS];
+  static ConsistentHasherHash before[PARTITIONS];
+  consistent_hasher_init(&ch, 1000003);
+  assert(consistent_hasher_assignment_init(&assignment, PARTITIONS)
+         == CONSISTENT_HASHER_OK);
+  for (int c = 1; c <= CONSUMERS; ++c)
+    assert(consistent_hasher_set_node_weight(&ch, c, 100) == CONSISTENT_HASHER_OK);
+
+  assert(consistent_hasher_assign(&assignment, &ch, moves, PARTITIONS) == 0);
+  for (int p = 0; p < PARTITIONS; ++p)
+    assert(assignment.owners[p] == consistent_hasher_get_node_of(&ch,
+             consistent_hasher_partition_hash(p)));
+
+  // A new consumer only takes partitions, a leaving one only gives
+  // them away
+  for (int round = 0; round < 2; ++round)
+  {
+    for (int p = 0; p < PARTITIONS; ++p) before[p] = assignment.owners[p];
+    if (round == 0)
+      assert(consistent_hasher_set_node_weight(&ch, CONSUMERS + 1, 100)
+             == CONSISTENT_HASHER_OK);
+    else
+      assert(consistent_hasher_delete_points_of(&ch, 3) == CONSISTENT_HASHER_OK);
+
+    int moved = consistent_hasher_assign(&assignment, &ch, moves, PARTITIONS);
+    assert(moved > 0 && moved < PARTITIONS / 4);
+    int changed = 0;
+    for (int p = 0; p < PARTITIONS; ++p)
+    {
+      assert(assignment.owners[p] == consistent_hasher_get_node_of(&ch,
+               consistent_hasher_partition_hash(p)));
+      changed += (assignment.owners[p] != before[p]);
+    }
+    assert(changed == moved);
+    for (int i = 0; i < moved; ++i)
+    {
+      assert(i == 0 || moves[i - 1].partition < moves[i].partition);
+      assert(moves[i].from == before[moves[i].partition]);
+      assert((round == 0) ? moves[i].to == CONSUMERS + 1 : moves[i].from == 3);
+    }
+  }
+
+  // Nothing changed, nothing moves
+  assert(consistent_hasher_assign(&assignment, &ch, moves, 0) == 0);
+
+  consistent_hasher_assignment_destroy(&assignment);
+  consistent_hasher_destroy(&ch);
+  return;
+}
+
+void test_xor_trie(void)
+{
+  enum { NODES = 300 };
+  ConsistentHasherXorTrie trie;
+  ConsistentHasherHash ids[NODES];
+  bool present[NODES] = { false };
+  consistent_hasher_xor_init(&trie);
+
+  for (int i = 0; i < NODES; ++i)
+  {
+    ids[i] = consistent_hasher_point_hash(i, 7);
+    assert(consistent_hasher_xor_insert(&trie, ids[i]) == CONSISTENT_HASHER_OK);
+    present[i] = true;
+  }
+  assert(consistent_hasher_xor_insert(&trie, ids[5])
+         == CONSISTENT_HASHER_ERROR_NODE_PRESENT);
+
+  for (int round = 0; round < 4; ++round)
+  {
+    // Remove and put back some nodes between the checks
+    for (int i = round % 2; i < NODES; i += 3)
+    {
+      assert((present[i] ? consistent_hasher_xor_delete(&trie, ids[i])
+                         : consistent_hasher_xor_insert(&trie, ids[i]))
+             == CONSISTENT_HASHER_OK);
+      present[i] = !present[i];
+    }
+    int len = 0;
+    for (int i = 0; i < NODES; ++i) len += present[i];
+    assert(trie.len == len);
+
+    for (int j = 0; j < 200; ++j)
+    {
+      ConsistentHasherHash item = consistent_hasher_point_hash(j, round);
+      ConsistentHasherHash nearest[5];
+      int found = consistent_hasher_xor_k_nearest(&trie, item, nearest, 5);
+      assert(found == 5);
+      assert(nearest[0] == consistent_hasher_xor_nearest(&trie, item));
+
+      // The k nearest are the k smallest distances, in order
+      for (int n = 0; n < found; ++n)
+      {
+        int closer = 0;
+        for (int i = 0; i < NODES; ++i)
+          closer += present[i] && (ids[i] ^ item) < (nearest[n] ^ item);
+        assert(closer == n);
+      }
+    }
+  }
+
+  // Down to nothing and back
+  for (int i = 0; i < NODES; ++i)
+    if (present[i])
+      assert(consistent_hasher_xor_delete(&trie, ids[i]) == CONSISTENT_HASHER_OK);
+  assert(trie.len == 0);
+  ConsistentHasherHash nearest[2];
+  assert(consistent_hasher_xor_k_nearest(&trie, 1, nearest, 2) == 0);
+  assert(consistent_hasher_xor_insert(&trie, 12) == CONSISTENT_HASHER_OK);
+  assert(consistent_hasher_xor_k_nearest(&trie, 1, nearest, 2) == 1);
+  assert(nearest[0] == 12);
+
+  consistent_hasher_xor_destroy(&trie);
+  return;
+}
+
+void *trace_lookups(void *arg)
+{
+  ConsistentHasher *ch = arg;
+  for (int i = 0; i < 10000; ++i) consistent_hasher_get_node_of(ch, i);
+  return NULL;
+}
+
+void test_trace(void)
+{
+  ConsistentHasher ch;
+  ConsistentHasherTrace trace;
+  consistent_hasher_init(&ch, RING_SIZE);
+  assert(consistent_hasher_insert_node(&ch, 123) == CONSISTENT_HASHER_OK);
+
+  FILE *file = tmpfile();
+  assert(file);
+  assert(consistent_hasher_trace_start(&ch, &trace, file, 2)
+         == CONSISTENT_HASHER_OK);
+  assert(consistent_hasher_insert_node(&ch, 456) == CONSISTENT_HASHER_OK);
+  consistent_hasher_get_node_of(&ch, 1);
+  consistent_hasher_get_node_of(&ch, 2);
+  consistent_hasher_get_node_of(&ch, 3);
+  consistent_hasher_get_node_of(&ch, 4);
+  assert(consistent_hasher_delete_node(&ch, 999) == CONSISTENT_HASHER_OK);
+  assert(consistent_hasher_delete_node(&ch, 123) == CONSISTENT_HASHER_OK);
+  assert(consistent_hasher_trace_stop(&ch) == CONSISTENT_HASHER_OK);
+  consistent_hasher_get_node_of(&ch, 5);
+  consistent_hasher_get_node_of(&ch, 6);
+
+  ConsistentHasherTraceRecord expected[] = {
+    { CONSISTENT_HASHER_TRACE_INSERT, 0, 123, 123 },
+    { CONSISTENT_HASHER_TRACE_INSERT, 0, 456, 456 },
+    { CONSISTENT_HASHER_TRACE_LOOKUP, 0, 2, 0 },
+    { CONSISTENT_HASHER_TRACE_LOOKUP, 0, 4, 0 },
+    { CONSISTENT_HASHER_TRACE_DELETE, 0, 123, 123 },
+  };
+  
+  rewind(file);
+  ConsistentHasherTraceHeader header;
+  ConsistentHasherTraceRecord record;
+  assert(consistent_hasher_trace_read_header(file, &header)
+         == CONSISTENT_HASHER_OK);
+  assert(header.ring_size == RING_SIZE);
+  for (unsigned int i = 0; i < sizeof(expected) / sizeof(expected[0]); ++i)
+  {
+    assert(consistent_hasher_trace_read(file, &record));
+    assert(record.op == expected[i].op);
+    assert(record.hash == expected[i].hash);
+    assert(record.owner == expected[i].owner);
+  }
+  assert(!consistent_hasher_trace_read(file, &record));
+
+  // Traces of another hash size are rejected
+  rewind(file);
+  header.hash_size = 3;
+  assert(fwrite(&header, sizeof(header), 1, file) == 1);
+  rewind(file);
+  assert(consistent_hasher_trace_read_header(file, &header)
+         == CONSISTENT_HASHER_ERROR_INVALID);
+  fclose(file);
+
+  // Parallel lookups record exactly one in [sample_every]
+  file = tmpfile();
+  assert(file);
+  assert(consistent_hasher_trace_start(&ch, &trace, file, 2)
+         == CONSISTENT_HASHER_OK);
+  pthread_t threads[4];
+  for (int i = 0; i < 4; ++i)
+    assert(pthread_create(&threads[i], NULL, trace_lookups, &ch) == 0);
+  for (int i = 0; i < 4; ++i)
+    assert(pthread_join(threads[i], NULL) == 0);
+  assert(consistent_hasher_trace_stop(&ch) == CONSISTENT_HASHER_OK);
+
+  rewind(file);
+  int lookups = 0;
+  assert(consistent_hasher_trace_read_header(file, &header)
+         == CONSISTENT_HASHER_OK);
+  while (consistent_hasher_trace_read(file, &record))
+    lookups += (record.op == CONSISTENT_HASHER_TRACE_LOOKUP);
+  assert(lookups == 4 * 10000 / 2);
+
+  fclose(file);
+  consistent_hasher_destroy(&ch);
+  return;
+}
+
 int main(void)
 {
   ConsistentHasher ch;
@@ -41,5 +1621,32 @@ int main(void)
   assert(consistent_hasher_get_node_of(&ch, 1000) == 123);
 
   consistent_hasher_destroy(&ch);
+
+  test_static();
+  for (ConsistentHasherLayout layout = CONSISTENT_HASHER_LAYOUT_AUTO;
+       layout < _CONSISTENT_HASHER_LAYOUT_MAX; ++layout)
+    test_random(layout);
+  test_layout();
+  test_points();
+  test_keyed();
+  test_hash_tags();
+  test_dispatcher();
+  test_flow_table();
+  test_overrides();
+  test_ranges();
+  test_cluster();
+  test_owned_mask();
+  test_straw2();
+  test_gapped();
+  test_scheduler();
+  test_incremental();
+  test_incremental_eytzinger();
+  test_background_rebuild();
+  test_budget();
+  test_watch();
+  test_scale_in();
+  test_assignment();
+  test_xor_trie();
+  test_trace();
   return 0;
 }